@@ -0,0 +1,402 @@
+/*
+ * bench.c
+ *
+ * Throughput benchmark for the libstringfun kernels: make bench.
+ *
+ * Three corpora are generated in memory: random words in 80 column lines,
+ * the same words with no newline for a megabyte, and a worst case of one
+ * short pattern repeated back to back (a word boundary every 16 bytes and
+ * a search string whose first and last bytes match nearly everywhere).
+ * Every kernel runs over every corpus at sizes from 50 bytes up to the
+ * limit given on the command line, and each result is reported as the
+ * mean GB/s of several timed samples together with their spread, so a
+ * kernel change can be judged against run to run noise.
+ *
+ * usage: sfbench [max_size]      e.g. 64M, 1G (default)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sflib.h"
+
+#define MIN_SAMPLES     3
+#define MAX_SAMPLES     9
+#define SAMPLE_NS       20000000.0      //aim for 20ms per sample
+#define SAMPLE_BUDGET_NS 2000000000.0   //and at most 2s per kernel and size
+#define VOCAB_SZ        512
+#define BENCH_REGEX     "th[a-z]*|q[^ ]+|a{8,}b?"
+
+typedef struct {
+    const char *name;
+    void      (*fill)(char *, size_t);
+    const char *find;           //search string for the replace kernels, and
+    const char *repl;           //a replacement no longer than it
+} corpus_t;
+
+typedef struct {
+    const corpus_t *corpus;
+    const char     *src;
+    size_t          len;
+    char           *work;       //len bytes the in-place kernels may modify
+    char           *dst;        //len bytes of output space
+    sf_out_buff_t  *sink;       //buffered writer to /dev/null
+    ac_automaton_t *ac;
+    rx_t           *rx;
+    int             nthreads;
+} bench_ctx_t;
+
+typedef struct {
+    const char *name;
+    void      (*run)(bench_ctx_t *);
+} kernel_t;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping a result nobody reads
+static volatile size_t bench_sink;
+
+/*
+ * Corpora
+ */
+static char vocab[VOCAB_SZ][12];
+
+static void build_vocab(void) {
+    strcpy(vocab[0], "the");
+    for (int i = 1; i < VOCAB_SZ; i++) {
+        int n = 1 + (int)(rng() % 10);
+        for (int k = 0; k < n; k++) {
+            vocab[i][k] = (char)('a' + rng() % 26);
+        }
+        vocab[i][n] = '\0';
+    }
+}
+
+// Words are drawn with a skew towards the front of the vocabulary, so
+// "the" and friends repeat the way common words do in real text
+static void fill_words(char *dst, size_t len, size_t line_len) {
+    size_t col = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t idx = (size_t)((rng() % VOCAB_SZ) * (rng() % VOCAB_SZ) / VOCAB_SZ);
+        const char *w = vocab[idx];
+        size_t n = strlen(w);
+
+        for (size_t k = 0; k < n && i < len; k++) {
+            dst[i++] = w[k];
+        }
+        col += n + 1;
+        if (i < len) {
+            dst[i++] = (col >= line_len) ? '\n' : ' ';
+        }
+        if (col >= line_len) {
+            col = 0;
+        }
+    }
+}
+
+static void fill_lines(char *dst, size_t len) {
+    fill_words(dst, len, 80);
+}
+
+static void fill_long_lines(char *dst, size_t len) {
+    fill_words(dst, len, 1 << 20);
+}
+
+static void fill_repeat(char *dst, size_t len) {
+    static const char pattern[] = "aaaaaaaaaaaaaaa ";
+
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = pattern[i % (sizeof(pattern) - 1)];
+    }
+}
+
+/*
+ * Kernels.  The in-place ones (reverse) work on ctx->work, which is
+ * refreshed from the corpus only between sizes: reversing twice gives the
+ * same text back, so samples keep measuring the same input.
+ */
+static void k_count_words(bench_ctx_t *c) {
+    size_t n;
+    sf_count_words(c->src, c->len, &n);
+    bench_sink = n;
+}
+
+static void k_count_words_mt(bench_ctx_t *c) {
+    size_t n;
+    sf_count_words_mt(c->src, c->len, c->nthreads, &n);
+    bench_sink = n;
+}
+
+static void k_word_print(bench_ctx_t *c) {
+    size_t n;
+    sf_print_words(c->src, c->len, c->sink, &n);
+    bench_sink = n;
+}
+
+static void k_word_freq(bench_ctx_t *c) {
+    bench_sink = (size_t)sf_word_freq(c->src, c->len, c->nthreads, 10, c->sink);
+}
+
+static void k_reverse(bench_ctx_t *c) {
+    sf_reverse(c->work, c->len);
+    bench_sink = (unsigned char)c->work[0];
+}
+
+static void k_reverse_copy(bench_ctx_t *c) {
+    sf_reverse_copy(c->src, c->len, c->dst);
+    bench_sink = (unsigned char)c->dst[0];
+}
+
+static void k_normalize(bench_ctx_t *c) {
+    size_t n;
+    sf_normalize(c->src, c->len, c->dst, c->len, &n);
+    bench_sink = n;
+}
+
+static void k_replace(bench_ctx_t *c) {
+    const corpus_t *cp = c->corpus;
+    size_t n;
+    bench_sink = (size_t)sf_replace(c->src, c->len, cp->find, strlen(cp->find), cp->repl,
+                                    strlen(cp->repl), c->dst, c->len, &n);
+}
+
+static void k_replace_all(bench_ctx_t *c) {
+    const corpus_t *cp = c->corpus;
+    size_t n;
+    bench_sink = (size_t)sf_replace_all(c->src, c->len, cp->find, strlen(cp->find), cp->repl,
+                                        strlen(cp->repl), c->dst, c->len, &n);
+}
+
+static void k_multi_replace(bench_ctx_t *c) {
+    bench_sink = (size_t)ac_rewrite(c->ac, c->src, c->len, c->sink);
+}
+
+static void k_regex_replace(bench_ctx_t *c) {
+    size_t n;
+    bench_sink = (size_t)rx_replace(c->rx, c->src, c->len, "<&>", 3, c->sink, &n);
+}
+
+static void k_utf8_validate(bench_ctx_t *c) {
+    bench_sink = (size_t)sf_utf8_validate(c->src, c->len);
+}
+
+static void k_count_words_utf8(bench_ctx_t *c) {
+    size_t n;
+    sf_count_words_utf8(c->src, c->len, &n);
+    bench_sink = n;
+}
+
+static void k_reverse_utf8(bench_ctx_t *c) {
+    sf_reverse_utf8(c->work, c->len);
+    bench_sink = (unsigned char)c->work[0];
+}
+
+static const kernel_t kernels[] = {
+    { "count_words",        k_count_words },
+    { "count_words -j",     k_count_words_mt },
+    { "word_print",         k_word_print },
+    { "word_freq -j",       k_word_freq },
+    { "reverse",            k_reverse },
+    { "reverse_copy",       k_reverse_copy },
+    { "normalize",          k_normalize },
+    { "replace",            k_replace },
+    { "replace_all",        k_replace_all },
+    { "multi_replace",      k_multi_replace },
+    { "regex_replace",      k_regex_replace },
+    { "utf8_validate",      k_utf8_validate },
+    { "count_words_utf8",   k_count_words_utf8 },
+    { "reverse_utf8",       k_reverse_utf8 },
+};
+
+/*
+ * Runs one kernel at one size: an untimed warm-up call, a calibration of
+ * how many calls make up a sample, then the samples themselves.
+ */
+static void bench_one(const kernel_t *k, bench_ctx_t *c, double *mean, double *stddev,
+                      int *nsamples) {
+    double gbps[MAX_SAMPLES];
+    double t0 = now_ns();
+    size_t iters = 1;
+
+    k->run(c);
+    double once = now_ns() - t0;
+    if (once < SAMPLE_NS) {
+        iters = (size_t)(SAMPLE_NS / (once > 50.0 ? once : 50.0));
+    }
+
+    int samples = (int)(SAMPLE_BUDGET_NS / (once * iters + 1.0));
+    samples = samples < MIN_SAMPLES ? MIN_SAMPLES : samples > MAX_SAMPLES ? MAX_SAMPLES : samples;
+
+    double sum = 0.0;
+    for (int s = 0; s < samples; s++) {
+        t0 = now_ns();
+        for (size_t i = 0; i < iters; i++) {
+            k->run(c);
+        }
+        double ns = now_ns() - t0;
+        sf_out_flush(c->sink);
+        gbps[s] = (double)c->len * (double)iters / ns;     //bytes per ns == GB/s
+        sum += gbps[s];
+    }
+
+    *mean = sum / samples;
+    double var = 0.0;
+    for (int s = 0; s < samples; s++) {
+        var += (gbps[s] - *mean) * (gbps[s] - *mean);
+    }
+    *stddev = (samples > 1) ? sqrt(var / (samples - 1)) : 0.0;
+    *nsamples = samples;
+}
+
+static size_t parse_size(const char *arg) {
+    char *end;
+    double v = strtod(arg, &end);
+
+    switch (*end) {
+        case 'k': case 'K': v *= 1024.0; break;
+        case 'm': case 'M': v *= 1024.0 * 1024.0; break;
+        case 'g': case 'G': v *= 1024.0 * 1024.0 * 1024.0; break;
+        default: break;
+    }
+    return (v >= 1.0) ? (size_t)v : 0;
+}
+
+static void format_size(size_t n, char *buf, size_t cap) {
+    if (n >= (1u << 30) && n % (1u << 30) == 0) {
+        snprintf(buf, cap, "%zuG", n >> 30);
+    } else if (n >= (1u << 20) && n % (1u << 20) == 0) {
+        snprintf(buf, cap, "%zuM", n >> 20);
+    } else if (n >= (1u << 10) && n % (1u << 10) == 0) {
+        snprintf(buf, cap, "%zuK", n >> 10);
+    } else {
+        snprintf(buf, cap, "%zuB", n);
+    }
+}
+
+static int load_rules(ac_automaton_t *ac) {
+    char path[] = "/tmp/sfbench-rulesXXXXXX";
+    static const char rules[] = "the\tTHE\nand\t&\naaaaaaaa\tA\nqu\tkw\n";
+    int fd = mkstemp(path);
+    int rc;
+
+    if (fd < 0) {
+        return SF_ERR_IO;
+    }
+    rc = (write(fd, rules, sizeof(rules) - 1) == (ssize_t)(sizeof(rules) - 1)) ? SF_OK : SF_ERR_IO;
+    close(fd);
+    if (rc == SF_OK) {
+        rc = ac_load_rules(ac, path);
+    }
+    if (rc == SF_OK) {
+        rc = ac_compile(ac);
+    }
+    unlink(path);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = {
+        50, 4096, 1 << 20, 64 << 20, (size_t)1 << 30
+    };
+    static const corpus_t corpora[] = {
+        { "words",      fill_lines,      "the", "THE" },
+        { "long-lines", fill_long_lines, "the", "THE" },
+        { "repeat",     fill_repeat,     "aaaaaaaabaaaaaaa", "X" },
+    };
+    size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t max = (size_t)1 << 30;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ac_automaton_t ac;
+    rx_t rx;
+    sf_out_buff_t sink;
+
+    if (argc > 2 || (argc == 2 && (max = parse_size(argv[1])) == 0)) {
+        fprintf(stderr, "usage: %s [max_size]\n", argv[0]);
+        return 1;
+    }
+    while (nsizes > 1 && sizes[nsizes - 1] > max) {
+        nsizes--;
+    }
+    size_t top = sizes[nsizes - 1];
+
+    if (load_rules(&ac) != SF_OK) {
+        fprintf(stderr, "error: cannot build the multi_replace rules\n");
+        return 3;
+    }
+    if (rx_compile(&rx, BENCH_REGEX, strlen(BENCH_REGEX)) != SF_OK) {
+        fprintf(stderr, "error: cannot compile the regex_replace pattern\n");
+        return 3;
+    }
+    if (sf_out_init(&sink, open("/dev/null", O_WRONLY), SF_OUT_BUFF_SZ) != SF_OK || sink.fd < 0) {
+        fprintf(stderr, "error: cannot open /dev/null\n");
+        return 3;
+    }
+
+    // One corpus at a time: at 1G the text, its working copy and the
+    // output space already take 3G
+    char *data = malloc(top);
+    char *work = malloc(top);
+    char *dst = malloc(top);
+    if (data == NULL || work == NULL || dst == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 2;
+    }
+    build_vocab();
+
+    printf("%-11s %6s  %-17s %10s %9s %6s %3s\n",
+           "corpus", "size", "kernel", "GB/s", "stddev", "cv%", "n");
+    for (size_t ci = 0; ci < sizeof(corpora) / sizeof(corpora[0]); ci++) {
+        corpora[ci].fill(data, top);
+
+        for (size_t si = 0; si < nsizes; si++) {
+            size_t len = sizes[si];
+            char label[24];
+
+            format_size(len, label, sizeof(label));
+            memcpy(work, data, len);
+
+            bench_ctx_t ctx = { &corpora[ci], data, len, work, dst, &sink, &ac, &rx,
+                                ncpu > 0 ? (int)ncpu : 1 };
+            for (size_t ki = 0; ki < sizeof(kernels) / sizeof(kernels[0]); ki++) {
+                double mean, stddev;
+                int n;
+
+                bench_one(&kernels[ki], &ctx, &mean, &stddev, &n);
+                printf("%-11s %6s  %-17s %10.3f %9.3f %6.1f %3d\n", corpora[ci].name, label,
+                       kernels[ki].name, mean, stddev, mean > 0 ? 100.0 * stddev / mean : 0.0, n);
+                fflush(stdout);
+            }
+        }
+    }
+
+    free(data);
+    free(work);
+    free(dst);
+    ac_free(&ac);
+    rx_free(&rx);
+    int null_fd = sink.fd;
+    sf_out_free(&sink);
+    close(null_fd);
+    return 0;
+}
@@ -0,0 +1,2405 @@
+/*
+ * sflib.c
+ *
+ * libstringfun: the stringfun text kernels as a library.  Nothing in here
+ * prints on its own or exits; see sflib.h for the conventions.
+ */
+
+#define _GNU_SOURCE         //memmem
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "sflib.h"
+
+/*
+ * sf_out_init
+ *
+ * Sets up an output buffer of cap bytes writing to fd, or an in-memory
+ * buffer that starts at cap bytes and grows when fd is SF_OUT_MEMORY.
+ */
+int sf_out_init(sf_out_buff_t *out, int fd, size_t cap) {
+    out->fd = fd;
+    out->len = 0;
+    out->cap = cap;
+    out->err = SF_OK;
+    out->data = malloc(cap);
+    return (out->data == NULL) ? SF_ERR_MEMORY : SF_OK;
+}
+
+/*
+ * sf_out_flush
+ *
+ * Hands everything buffered to write(), retrying short writes.  A memory
+ * sink keeps its contents.
+ *
+ * returns:  the buffer's sticky error, SF_OK if nothing has failed yet
+ */
+int sf_out_flush(sf_out_buff_t *out) {
+    size_t done = 0;
+
+    if (out->fd == SF_OUT_MEMORY) {
+        return out->err;
+    }
+    while (done < out->len) {
+        ssize_t n = write(out->fd, out->data + done, out->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            out->err = out->err ? out->err : SF_ERR_WRITE;
+            break;
+        }
+        done += (size_t)n;
+    }
+    out->len = 0;
+    return out->err;
+}
+
+void sf_out_free(sf_out_buff_t *out) {
+    sf_out_flush(out);
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+}
+
+// Makes room for n more bytes, flushing or growing as needed
+static int out_reserve(sf_out_buff_t *out, size_t n) {
+    if (out->len + n <= out->cap) {
+        return SF_OK;
+    }
+    if (out->fd != SF_OUT_MEMORY) {
+        sf_out_flush(out);         //a failed write is kept in out->err
+        return SF_OK;
+    }
+
+    size_t cap = out->cap ? out->cap : SF_OUT_BUFF_SZ;
+    while (cap < out->len + n) {
+        cap *= 2;
+    }
+    char *data = realloc(out->data, cap);
+    if (data == NULL) {
+        out->err = out->err ? out->err : SF_ERR_MEMORY;
+        return SF_ERR_MEMORY;
+    }
+    out->data = data;
+    out->cap = cap;
+    return SF_OK;
+}
+
+/*
+ * sf_out_claim
+ *
+ * Reserves n bytes at the end of the buffer for the caller to fill in
+ * place.  Returns NULL if a fixed block cannot hold n bytes at all.
+ */
+char *sf_out_claim(sf_out_buff_t *out, size_t n) {
+    if (out_reserve(out, n) < 0 || out->len + n > out->cap) {
+        return NULL;
+    }
+    char *p = out->data + out->len;
+    out->len += n;
+    return p;
+}
+
+void sf_out_bytes(sf_out_buff_t *out, const char *src, size_t n) {
+    if (out_reserve(out, n) < 0) {
+        return;
+    }
+    // Blocks bigger than the whole buffer skip the copy
+    if (n > out->cap) {
+        sf_out_buff_t direct = { out->fd, (char *)src, n, n, out->err };
+        out->err = sf_out_flush(&direct);
+        return;
+    }
+    memcpy(out->data + out->len, src, n);
+    out->len += n;
+}
+
+void sf_out_str(sf_out_buff_t *out, const char *str) {
+    sf_out_bytes(out, str, strlen(str));
+}
+
+void sf_out_char(sf_out_buff_t *out, char c) {
+    if (out->len == out->cap && out_reserve(out, 1) < 0) {
+        return;
+    }
+    out->data[out->len++] = c;
+}
+
+void sf_out_uint(sf_out_buff_t *out, size_t value) {
+    char digits[24];
+    char *p = digits + sizeof(digits);
+
+    do {
+        *--p = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    sf_out_bytes(out, p, digits + sizeof(digits) - p);
+}
+
+void sf_out_int(sf_out_buff_t *out, long long value) {
+    if (value < 0) {
+        sf_out_char(out, '-');
+        sf_out_uint(out, (size_t)0 - (size_t)value);
+    } else {
+        sf_out_uint(out, (size_t)value);
+    }
+}
+
+/*
+ * Words are runs of non-whitespace everywhere in the library, the same
+ * definition wc -w uses.
+ */
+static const unsigned char is_ws[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1
+};
+
+/*
+ * Whitespace normalization.
+ *
+ * Every run of blanks (spaces and tabs) becomes one space, and runs at the
+ * start or end of the text are dropped.  With lines set, as --normalize
+ * uses it, a newline ends a line: blanks next to it are dropped too.
+ * Without it a newline is an ordinary word byte, which is what setup_buff
+ * has always done.  The vector kernels work on 64 byte blocks in three
+ * steps:
+ *
+ *   1. classify: bit masks of the blanks (B) and newlines (N) in the block
+ *   2. keep mask: a blank survives only if it is the last of its run, the
+ *      next byte is a word byte and the run does not start a line.  Runs
+ *      that start a line are found with one add: seeding each such run at
+ *      its first bit and adding the seeds to B clears exactly those runs.
+ *   3. compress: vpcompressb where available, otherwise pshufb with a
+ *      256 entry table that packs each 8 byte group by its keep bits.
+ *
+ * The only state carried between blocks (and between calls) is whether
+ * the current position is still at the start of a line.
+ */
+static const unsigned char is_blank[256] = { [' '] = 1, ['\t'] = 1 };
+
+static inline int is_word_byte(unsigned char c, int lines) {
+    return !is_blank[c] && (c != '\n' || !lines);
+}
+
+static inline uint64_t normalize_keep_mask(uint64_t B, uint64_t N, int next_word, int *lead) {
+    uint64_t W = ~(B | N);
+    uint64_t seeds = B & ((N << 1) | (uint64_t)*lead);
+    uint64_t leading = B & ~(B + seeds);
+    uint64_t word_next = (W >> 1) | ((uint64_t)next_word << 63);
+
+    if (N >> 63) {
+        *lead = 1;
+    } else if (B >> 63) {
+        *lead = (int)(leading >> 63);
+    } else {
+        *lead = 0;
+    }
+    return W | N | (B & ~leading & word_next);
+}
+
+static size_t normalize_scalar(const char *src, size_t n, int next_word, int *lead,
+                               int lines, char *dst) {
+    size_t out = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if (c == '\n' && lines) {
+            dst[out++] = '\n';
+            *lead = 1;
+        } else if (is_blank[c]) {
+            int word = (i + 1 < n) ? is_word_byte((unsigned char)src[i + 1], lines) : next_word;
+            if (!*lead && word) {
+                dst[out++] = ' ';
+            }
+        } else {
+            dst[out++] = (char)c;
+            *lead = 0;
+        }
+    }
+    return out;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t compress_tbl[256];      // pshufb indices packing 8 bytes
+
+static void build_compress_tbl(void) {
+    for (int m = 0; m < 256; m++) {
+        uint64_t idx = 0;
+        int k = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            if (m & (1 << bit)) {
+                idx |= (uint64_t)bit << (8 * k++);
+            }
+        }
+        compress_tbl[m] = idx;
+    }
+}
+
+__attribute__((target("ssse3,popcnt")))
+static size_t normalize_ssse3(const char *src, size_t n, int next_word, int *lead,
+                              int lines, char *dst) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const uint64_t hi_offset = 0x0808080808080808ULL;
+    size_t out = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= n; i += 64) {
+        __m128i v[4];
+        uint64_t B = 0, N = 0;
+
+        for (int k = 0; k < 4; k++) {
+            v[k] = _mm_loadu_si128((const __m128i *)(src + i + 16 * k));
+            __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v[k], space), _mm_cmpeq_epi8(v[k], tab));
+            B |= (uint64_t)(unsigned)_mm_movemask_epi8(blank) << (16 * k);
+            if (lines) {
+                N |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v[k], newline)) << (16 * k);
+            }
+            v[k] = _mm_or_si128(_mm_andnot_si128(blank, v[k]), _mm_and_si128(blank, space));
+        }
+
+        int word = (i + 64 < n) ? is_word_byte((unsigned char)src[i + 64], lines) : next_word;
+        uint64_t keep = normalize_keep_mask(B, N, word, lead);
+
+        if (keep == ~0ULL) {
+            for (int k = 0; k < 4; k++) {
+                _mm_storeu_si128((__m128i *)(dst + out + 16 * k), v[k]);
+            }
+            out += 64;
+            continue;
+        }
+        // Each 8 byte store ends at or before the input position, so the
+        // output never runs past n bytes
+        for (int k = 0; k < 4; k++) {
+            unsigned lo = (unsigned)(keep >> (16 * k)) & 0xff;
+            unsigned hi = (unsigned)(keep >> (16 * k + 8)) & 0xff;
+            __m128i idx = _mm_set_epi64x((long long)(compress_tbl[hi] + hi_offset),
+                                         (long long)compress_tbl[lo]);
+            __m128i packed = _mm_shuffle_epi8(v[k], idx);
+            _mm_storel_epi64((__m128i *)(dst + out), packed);
+            out += (size_t)__builtin_popcount(lo);
+            _mm_storel_epi64((__m128i *)(dst + out), _mm_srli_si128(packed, 8));
+            out += (size_t)__builtin_popcount(hi);
+        }
+    }
+    return out + normalize_scalar(src + i, n - i, next_word, lead, lines, dst + out);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi2,popcnt")))
+static size_t normalize_avx512(const char *src, size_t n, int next_word, int *lead,
+                               int lines, char *dst) {
+    const __m512i space = _mm512_set1_epi8(' ');
+    const __m512i tab = _mm512_set1_epi8('\t');
+    const __m512i newline = _mm512_set1_epi8('\n');
+    size_t out = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= n; i += 64) {
+        __m512i v = _mm512_loadu_si512(src + i);
+        uint64_t B = _mm512_cmpeq_epi8_mask(v, space) | _mm512_cmpeq_epi8_mask(v, tab);
+        uint64_t N = lines ? _mm512_cmpeq_epi8_mask(v, newline) : 0;
+        int word = (i + 64 < n) ? is_word_byte((unsigned char)src[i + 64], lines) : next_word;
+        uint64_t keep = normalize_keep_mask(B, N, word, lead);
+
+        v = _mm512_mask_blend_epi8(B, v, space);
+        _mm512_mask_compressstoreu_epi8(dst + out, keep, v);
+        out += (size_t)__builtin_popcountll(keep);
+    }
+    return out + normalize_scalar(src + i, n - i, next_word, lead, lines, dst + out);
+}
+#endif
+
+static size_t (*normalize_fn)(const char *, size_t, int, int *, int, char *);
+static pthread_once_t normalize_once = PTHREAD_ONCE_INIT;
+
+// Runs once, through pthread_once, before the first normalize call
+static void pick_normalize_kernel(void) {
+    size_t (*fn)(const char *, size_t, int, int *, int, char *) = normalize_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vbmi2") && __builtin_cpu_supports("avx512bw")) {
+        fn = normalize_avx512;
+    } else if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+        build_compress_tbl();
+        fn = normalize_ssse3;
+    }
+#endif
+    normalize_fn = fn;
+}
+
+/*
+ * sf_normalize_block
+ *
+ * Normalizes n bytes of a longer text line by line into dst, which must have room for
+ * n bytes.  next is the byte that follows src[n - 1], or -1 at the end of
+ * the text; *lead is the start-of-line state, 1 before the first call.
+ *
+ * returns:  number of bytes written to dst
+ */
+static size_t normalize_span(const char *src, size_t n, int next, int *lead, int lines,
+                             char *dst) {
+    pthread_once(&normalize_once, pick_normalize_kernel);
+    int next_word = (next >= 0) && is_word_byte((unsigned char)next, lines);
+    return normalize_fn(src, n, next_word, lead, lines, dst);
+}
+
+size_t sf_normalize_block(const char *src, size_t n, int next, int *lead, char *dst) {
+    return normalize_span(src, n, next, lead, 1, dst);
+}
+
+/*
+ * sf_normalize
+ *
+ * Squeezes the blanks of a complete text into dst the way setup_buff
+ * always has; newlines are left alone, blanks around them included.
+ *
+ * returns:  SF_OK, SF_ERR_NO_SPACE if the result needs more than cap
+ *           bytes, or SF_ERR_MEMORY
+ */
+int sf_normalize(const char *src, size_t len, char *dst, size_t cap, size_t *out_len) {
+    int lead = 1;
+
+    // The kernel may need up to len bytes before it knows the final size
+    if (len <= cap) {
+        *out_len = normalize_span(src, len, -1, &lead, 0, dst);
+        return SF_OK;
+    }
+
+    char *tmp = malloc(len);
+    if (tmp == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    size_t n = normalize_span(src, len, -1, &lead, 0, tmp);
+    if (n <= cap) {
+        memcpy(dst, tmp, n);
+        *out_len = n;
+    }
+    free(tmp);
+    return (n <= cap) ? SF_OK : SF_ERR_NO_SPACE;
+}
+
+/*
+ * sf_normalize_fd
+ *
+ * Normalizes a stream.  The last byte of every read is held back until
+ * the next one arrives, since whether a blank survives depends on the
+ * byte after it.
+ */
+int sf_normalize_fd(int fd, sf_out_buff_t *out) {
+    char *buf = malloc(SF_STREAM_CHUNK_SZ);
+    size_t have = 0;
+    int lead = 1;
+    ssize_t got;
+
+    if (buf == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    while ((got = read(fd, buf + have, SF_STREAM_CHUNK_SZ - have)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return SF_ERR_IO;
+        }
+        have += (size_t)got;
+        if (have < 2) {
+            continue;
+        }
+
+        size_t n = have - 1;
+        char *dst = sf_out_claim(out, n);
+        if (dst == NULL) {
+            free(buf);
+            return SF_ERR_MEMORY;
+        }
+        out->len -= n - sf_normalize_block(buf, n, (unsigned char)buf[n], &lead, dst);
+        buf[0] = buf[n];
+        have = 1;
+    }
+
+    char *dst = sf_out_claim(out, have);
+    if (dst != NULL) {
+        out->len -= have - sf_normalize_block(buf, have, -1, &lead, dst);
+    }
+    free(buf);
+    return (dst != NULL) ? out->err : SF_ERR_MEMORY;
+}
+
+/*
+ * Per thread state for the parallel word count.  Each range is counted
+ * as if it were a complete text; ranges also report whether they start
+ * and end inside a word so a word straddling a boundary, which both
+ * sides counted, can be taken out once in the merge.
+ */
+typedef struct {
+    const char *start;
+    size_t      len;
+    size_t      count;
+    int         starts_in_word;
+    int         ends_in_word;
+} count_range_t;
+
+static void *count_range(void *arg) {
+    count_range_t *r = (count_range_t *)arg;
+    const unsigned char *ptr = (const unsigned char *)r->start;
+    const unsigned char *end = ptr + r->len;
+    size_t count = 0;
+    int prev_ws = 1;
+
+    // A word starts on every whitespace -> non-whitespace transition
+    while (ptr < end) {
+        int ws = is_ws[*ptr];
+        count += (size_t)(prev_ws & !ws);
+        prev_ws = ws;
+        ptr++;
+    }
+
+    r->count = count;
+    r->starts_in_word = r->len > 0 && !is_ws[(unsigned char)r->start[0]];
+    r->ends_in_word = r->len > 0 && !prev_ws;
+    return NULL;
+}
+
+int sf_count_words(const char *src, size_t len, size_t *count) {
+    count_range_t r = { src, len, 0, 0, 0 };
+
+    count_range(&r);
+    *count = r.count;
+    return SF_OK;
+}
+
+static void print_word(sf_out_buff_t *out, size_t n, const char *word, size_t len, size_t chars) {
+    sf_out_uint(out, n);
+    sf_out_str(out, ". ");
+    sf_out_bytes(out, word, len);
+    sf_out_char(out, '(');
+    sf_out_uint(out, chars);
+    sf_out_str(out, ")\n");
+}
+
+/*
+ * sf_print_words
+ *
+ * Lists the words of src as "N. word(length)" lines.
+ */
+int sf_print_words(const char *src, size_t len, sf_out_buff_t *out, size_t *nwords) {
+    const char *ptr = src;
+    const char *end = src + len;
+    size_t total = 0;
+
+    while (ptr < end) {
+        if (is_ws[(unsigned char)*ptr]) {
+            ptr++;
+            continue;
+        }
+
+        // Emit the whole word in one copy once its extent is known
+        const char *word = ptr;
+        while (ptr < end && !is_ws[(unsigned char)*ptr]) {
+            ptr++;
+        }
+        print_word(out, ++total, word, ptr - word, ptr - word);
+    }
+
+    *nwords = total;
+    return out->err;
+}
+
+/*
+ * Byte reversal.
+ *
+ * Each kernel swaps whole blocks taken from both ends of the buffer and
+ * reverses the bytes inside a block with a single shuffle: pshufb on 16
+ * bytes, pshufb plus a lane swap on 32, vpermb on 64.  Whatever is left in
+ * the middle falls through to 8 byte bswaps and finally single bytes.  The
+ * widest kernel the CPU supports is picked once at first use, so the
+ * library does not have to be built with -march flags.
+ */
+static inline uint64_t load64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store64(char *p, uint64_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static void reverse_inplace_word(char *buf, size_t len) {
+    char *start = buf;
+    char *end = buf + len;
+
+    while (end - start >= 16) {
+        uint64_t a = load64(start);
+        uint64_t z = load64(end - 8);
+        store64(start, __builtin_bswap64(z));
+        store64(end - 8, __builtin_bswap64(a));
+        start += 8;
+        end -= 8;
+    }
+    while (start + 1 < end) {
+        char tmp = *start;
+        *start++ = *--end;
+        *end = tmp;
+    }
+}
+
+static void reverse_copy_word(const char *src, size_t len, char *dst) {
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        store64(dst + i, __builtin_bswap64(load64(src + len - i - 8)));
+    }
+    for (; i < len; i++) {
+        dst[i] = src[len - 1 - i];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void reverse_inplace_ssse3(char *buf, size_t len) {
+    const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    char *start = buf;
+    char *end = buf + len;
+
+    while (end - start >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)start);
+        __m128i z = _mm_loadu_si128((const __m128i *)(end - 16));
+        _mm_storeu_si128((__m128i *)start, _mm_shuffle_epi8(z, rev));
+        _mm_storeu_si128((__m128i *)(end - 16), _mm_shuffle_epi8(a, rev));
+        start += 16;
+        end -= 16;
+    }
+    reverse_inplace_word(start, end - start);
+}
+
+__attribute__((target("ssse3")))
+static void reverse_copy_ssse3(const char *src, size_t len, char *dst) {
+    const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + len - i - 16));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, rev));
+    }
+    reverse_copy_word(src, len - i, dst + i);
+}
+
+// pshufb only works inside 128 bit lanes, so the lanes are swapped after
+__attribute__((target("avx2")))
+static inline __m256i rev32_avx2(__m256i v) {
+    const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                         15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, rev), 0x4e);
+}
+
+__attribute__((target("avx2")))
+static void reverse_inplace_avx2(char *buf, size_t len) {
+    char *start = buf;
+    char *end = buf + len;
+
+    while (end - start >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)start);
+        __m256i z = _mm256_loadu_si256((const __m256i *)(end - 32));
+        _mm256_storeu_si256((__m256i *)start, rev32_avx2(z));
+        _mm256_storeu_si256((__m256i *)(end - 32), rev32_avx2(a));
+        start += 32;
+        end -= 32;
+    }
+    reverse_inplace_ssse3(start, end - start);
+}
+
+__attribute__((target("avx2")))
+static void reverse_copy_avx2(const char *src, size_t len, char *dst) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + len - i - 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), rev32_avx2(v));
+    }
+    reverse_copy_ssse3(src, len - i, dst + i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void reverse_inplace_avx512(char *buf, size_t len) {
+    const __m512i rev = _mm512_set_epi8(
+         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+        32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+        48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63);
+    char *start = buf;
+    char *end = buf + len;
+
+    while (end - start >= 128) {
+        __m512i a = _mm512_loadu_si512(start);
+        __m512i z = _mm512_loadu_si512(end - 64);
+        _mm512_storeu_si512(start, _mm512_permutexvar_epi8(rev, z));
+        _mm512_storeu_si512(end - 64, _mm512_permutexvar_epi8(rev, a));
+        start += 64;
+        end -= 64;
+    }
+    reverse_inplace_avx2(start, end - start);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void reverse_copy_avx512(const char *src, size_t len, char *dst) {
+    const __m512i rev = _mm512_set_epi8(
+         0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+        32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+        48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512(src + len - i - 64);
+        _mm512_storeu_si512(dst + i, _mm512_permutexvar_epi8(rev, v));
+    }
+    reverse_copy_avx2(src, len - i, dst + i);
+}
+#endif
+
+static void (*reverse_inplace_fn)(char *, size_t);
+static void (*reverse_copy_fn)(const char *, size_t, char *);
+static pthread_once_t reverse_once = PTHREAD_ONCE_INIT;
+
+// Runs once, through pthread_once, before the first reverse call
+static void pick_reverse_kernels(void) {
+    void (*inplace)(char *, size_t) = reverse_inplace_word;
+    void (*copy)(const char *, size_t, char *) = reverse_copy_word;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+        inplace = reverse_inplace_avx512;
+        copy = reverse_copy_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        inplace = reverse_inplace_avx2;
+        copy = reverse_copy_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        inplace = reverse_inplace_ssse3;
+        copy = reverse_copy_ssse3;
+    }
+#endif
+    reverse_copy_fn = copy;
+    reverse_inplace_fn = inplace;
+}
+
+void sf_reverse(char *buf, size_t len) {
+    pthread_once(&reverse_once, pick_reverse_kernels);
+    reverse_inplace_fn(buf, len);
+}
+
+/*
+ * sf_reverse_copy
+ *
+ * Writes the bytes of src into dst in reverse order.  dst must not
+ * overlap src.
+ */
+void sf_reverse_copy(const char *src, size_t len, char *dst) {
+    pthread_once(&reverse_once, pick_reverse_kernels);
+    reverse_copy_fn(src, len, dst);
+}
+
+/*
+ * sf_reverse_out
+ *
+ * Writes src reversed to out, one output block at a time, so the input
+ * (typically a read-only mapping) is never modified or copied first.
+ */
+int sf_reverse_out(const char *src, size_t len, sf_out_buff_t *out) {
+    while (len > 0) {
+        size_t n = (len < SF_OUT_BUFF_SZ) ? len : SF_OUT_BUFF_SZ;
+        char *dst = sf_out_claim(out, n);
+        if (dst == NULL) {
+            return SF_ERR_MEMORY;
+        }
+        sf_reverse_copy(src + len - n, n, dst);
+        len -= n;
+    }
+    return out->err;
+}
+
+static int reverse_line(const char *line, size_t len, int nl, void *arg) {
+    sf_out_buff_t *out = arg;
+    char *dst = sf_out_claim(out, len + nl);
+
+    if (dst == NULL) {
+        // Longer than a fixed output block: go through the slow path
+        sf_reverse_out(line, len, out);
+        if (nl) {
+            sf_out_char(out, '\n');
+        }
+    } else {
+        sf_reverse_copy(line, len, dst);
+        if (nl) {
+            dst[len] = '\n';
+        }
+    }
+    return 0;
+}
+
+/*
+ * sf_reverse_lines
+ *
+ * Reverses every line of src on its own, keeping the newlines in place.
+ * Returns the number of bytes consumed, which stops short of a trailing
+ * partial line unless final is set.
+ */
+size_t sf_reverse_lines(const char *src, size_t len, int final, sf_out_buff_t *out) {
+    const char *ptr = src;
+    const char *end = src + len;
+
+    while (ptr < end) {
+        const char *nl = memchr(ptr, '\n', end - ptr);
+        if (nl == NULL && !final) {
+            break;
+        }
+        size_t line_len = (nl != NULL ? nl : end) - ptr;
+        reverse_line(ptr, line_len, nl != NULL, out);
+        ptr += line_len + (nl != NULL);
+    }
+    return ptr - src;
+}
+
+/*
+ * sf_read_fd
+ *
+ * Reads everything readable from fd into one malloc'd buffer, for input
+ * that has to be seen whole and cannot be mapped (pipes, terminals).
+ *
+ * returns:  SF_OK, SF_ERR_MEMORY or SF_ERR_IO
+ */
+int sf_read_fd(int fd, char **data, size_t *len) {
+    size_t cap = SF_STREAM_CHUNK_SZ;
+    size_t n = 0;
+    char *buf = malloc(cap);
+
+    if (buf == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    for (;;) {
+        if (n == cap) {
+            char *bigger = realloc(buf, cap * 2);
+            if (bigger == NULL) {
+                free(buf);
+                return SF_ERR_MEMORY;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+        ssize_t got = read(fd, buf + n, cap - n);
+        if (got == 0) {
+            break;
+        }
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return SF_ERR_IO;
+        }
+        n += (size_t)got;
+    }
+    *data = buf;
+    *len = n;
+    return SF_OK;
+}
+
+/*
+ * sf_reverse_fd
+ *
+ * Reverses everything readable from fd.  Regular files are mapped; pipes
+ * have to be read to the end first since the first byte out is the last
+ * byte in.
+ */
+int sf_reverse_fd(int fd, sf_out_buff_t *out) {
+    struct stat st;
+    char *data;
+    size_t len;
+    int rc;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            rc = sf_reverse_out(data, (size_t)st.st_size, out);
+            munmap(data, (size_t)st.st_size);
+            return rc;
+        }
+    }
+
+    rc = sf_read_fd(fd, &data, &len);
+    if (rc != SF_OK) {
+        return rc;
+    }
+    rc = sf_reverse_out(data, len, out);
+    free(data);
+    return rc;
+}
+
+/*
+ * sf_lines_fd
+ *
+ * Calls fn on every line of a stream.  Input is read SF_LINES_BUFF_SZ at
+ * a time and lines are handed out in place, so short lines cost one
+ * memchr and one call each.  A line that does not fit in the read buffer
+ * makes the buffer grow, so there is no line length limit.
+ *
+ * returns:  SF_OK, SF_ERR_MEMORY, SF_ERR_IO, or whatever nonzero value
+ *           fn stopped the walk with
+ */
+int sf_lines_fd(int fd, sf_line_fn fn, void *arg) {
+    size_t cap = SF_LINES_BUFF_SZ;
+    size_t have = 0;
+    char *buf = malloc(cap);
+    ssize_t got;
+    int rc = SF_OK;
+
+    if (buf == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    while ((got = read(fd, buf + have, cap - have)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return SF_ERR_IO;
+        }
+        have += (size_t)got;
+
+        // Hand out every complete line, then keep the partial one
+        char *ptr = buf;
+        char *end = buf + have;
+        char *nl;
+        while ((nl = memchr(ptr, '\n', end - ptr)) != NULL) {
+            if ((rc = fn(ptr, nl - ptr, 1, arg)) != 0) {
+                free(buf);
+                return rc;
+            }
+            ptr = nl + 1;
+        }
+        have = end - ptr;
+        memmove(buf, ptr, have);
+        if (have == cap) {
+            char *bigger = realloc(buf, cap * 2);
+            if (bigger == NULL) {
+                free(buf);
+                return SF_ERR_MEMORY;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+    }
+    if (have > 0) {
+        rc = fn(buf, have, 0, arg);
+    }
+    free(buf);
+    return rc;
+}
+
+/*
+ * sf_reverse_lines_fd
+ *
+ * Line-wise reverse of a stream.
+ */
+int sf_reverse_lines_fd(int fd, sf_out_buff_t *out) {
+    int rc = sf_lines_fd(fd, reverse_line, out);
+    return (rc == SF_OK) ? out->err : rc;
+}
+
+/*
+ * UTF-8 text.
+ *
+ * The byte kernels above treat every byte >= 0x80 as part of a word,
+ * which counts multilingual text correctly only as long as it never uses
+ * a Unicode space, reports word lengths in bytes, and splits multi-byte
+ * characters when reversing.  The kernels below work on code points
+ * instead.  Real text is mostly ASCII even when it is not all ASCII, so
+ * each of them first checks the high bits of the next 16 bytes and runs
+ * the plain byte loop when none is set.
+ */
+#define HIGH_BITS   0x8080808080808080ULL
+
+static inline int ascii_block16(const unsigned char *p) {
+    return ((load64((const char *)p) | load64((const char *)p + 8)) & HIGH_BITS) == 0;
+}
+
+// Length of the sequence led by *p, clamped to what is left of the input
+static inline size_t utf8_seq_len(const unsigned char *p, size_t left) {
+    size_t n = (*p < 0x80) ? 1 : (*p < 0xe0) ? 2 : (*p < 0xf0) ? 3 : 4;
+    return (n < left) ? n : left;
+}
+
+/*
+ * Returns the length of the whitespace code point at p, or 0.  Besides
+ * the ASCII set these are the White_Space characters of Unicode: NEL,
+ * NBSP, the ogham space mark, U+2000-U+200A, the line and paragraph
+ * separators, the narrow and medium math spaces and the ideographic space.
+ */
+static size_t utf8_ws_len(const unsigned char *p, size_t left) {
+    if (p[0] < 0x80) {
+        return is_ws[p[0]];
+    }
+    if (p[0] == 0xc2 && left >= 2) {
+        return (p[1] == 0x85 || p[1] == 0xa0) ? 2 : 0;
+    }
+    if (left < 3) {
+        return 0;
+    }
+    switch (p[0]) {
+        case 0xe1:
+            return (p[1] == 0x9a && p[2] == 0x80) ? 3 : 0;
+        case 0xe2:
+            if (p[1] == 0x80) {
+                return (p[2] <= 0x8a || p[2] == 0xa8 || p[2] == 0xa9 || p[2] == 0xaf) ? 3 : 0;
+            }
+            return (p[1] == 0x81 && p[2] == 0x9f) ? 3 : 0;
+        case 0xe3:
+            return (p[1] == 0x80 && p[2] == 0x80) ? 3 : 0;
+        default:
+            return 0;
+    }
+}
+
+static int utf8_validate_scalar(const unsigned char *s, size_t len) {
+    size_t i = 0;
+
+    while (i < len) {
+        if (len - i >= 16 && ascii_block16(s + i)) {
+            i += 16;
+            continue;
+        }
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t n;
+        uint32_t cp, min;
+        if ((c & 0xe0) == 0xc0) {
+            n = 2, cp = c & 0x1f, min = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            n = 3, cp = c & 0x0f, min = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            n = 4, cp = c & 0x07, min = 0x10000;
+        } else {
+            return 0;
+        }
+        if (len - i < n) {
+            return 0;
+        }
+        for (size_t k = 1; k < n; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return 0;
+            }
+            cp = (cp << 6) | (s[i + k] & 0x3f);
+        }
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return 0;
+        }
+        i += n;
+    }
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Vector validation after Keiser and Lemire, "Validating UTF-8 In Less
+ * Than One Instruction Per Byte".  Every error that involves two adjacent
+ * bytes is a combination of the high nibble of the first byte, its low
+ * nibble and the high nibble of the second, so three pshufb lookups whose
+ * results are ANDed find them all at once.  The one error that needs a
+ * third byte (a missing or extra continuation after a 3 or 4 byte lead)
+ * is checked with two saturating subtracts.
+ */
+#define U8_TOO_SHORT        (1 << 0)    // lead byte not followed by a continuation
+#define U8_TOO_LONG         (1 << 1)    // continuation after an ASCII byte
+#define U8_OVERLONG_3       (1 << 2)
+#define U8_TOO_LARGE        (1 << 3)    // above U+10FFFF
+#define U8_SURROGATE        (1 << 4)
+#define U8_OVERLONG_2       (1 << 5)
+#define U8_TOO_LARGE_1000   (1 << 6)
+#define U8_OVERLONG_4       (1 << 6)
+#define U8_TWO_CONTS        (1 << 7)    // continuation that may need a 3/4 byte lead
+#define U8_CARRY            (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+__attribute__((target("ssse3")))
+static inline __m128i utf8_block_errors(__m128i in, __m128i prev) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i byte_1_high_tbl = _mm_setr_epi8(
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+    const __m128i byte_1_low_tbl = _mm_setr_epi8(
+        U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+        U8_CARRY | U8_OVERLONG_2,
+        U8_CARRY,
+        U8_CARRY,
+        U8_CARRY | U8_TOO_LARGE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+    const __m128i byte_2_high_tbl = _mm_setr_epi8(
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+
+    __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+    __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_tbl,
+                                           _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_tbl, _mm_and_si128(prev1, nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_tbl,
+                                           _mm_and_si128(_mm_srli_epi16(in, 4), nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // Bytes two after a 3 byte lead or three after a 4 byte lead must be
+    // continuations, which is exactly where TWO_CONTS is expected
+    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0xe0 - 0x80));
+    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8((char)(0xf0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, special);
+}
+
+__attribute__((target("ssse3")))
+static int utf8_validate_ssse3(const unsigned char *s, size_t len) {
+    // Nonzero where a lead byte in the last three positions is cut off
+    const __m128i max_complete = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                               -1, -1, -1, -1, -1, (char)0xef, (char)0xdf, (char)0xbf);
+    __m128i prev = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+
+    for (size_t i = 0; i < len; i += 16) {
+        __m128i in;
+        if (len - i >= 16) {
+            in = _mm_loadu_si128((const __m128i *)(s + i));
+        } else {
+            // Zero padding is ASCII, so a truncated sequence shows up as TOO_SHORT
+            unsigned char tail[16] = { 0 };
+            memcpy(tail, s + i, len - i);
+            in = _mm_loadu_si128((const __m128i *)tail);
+        }
+
+        if (_mm_movemask_epi8(in) == 0) {
+            error = _mm_or_si128(error, incomplete);
+            incomplete = _mm_setzero_si128();
+        } else {
+            error = _mm_or_si128(error, utf8_block_errors(in, prev));
+            incomplete = _mm_subs_epu8(in, max_complete);
+        }
+        prev = in;
+    }
+    error = _mm_or_si128(error, incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+#endif
+
+static int (*utf8_validate_fn)(const unsigned char *, size_t);
+static pthread_once_t utf8_once = PTHREAD_ONCE_INIT;
+
+// Runs once, through pthread_once, before the first validate call
+static void pick_utf8_kernel(void) {
+    int (*fn)(const unsigned char *, size_t) = utf8_validate_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        fn = utf8_validate_ssse3;
+    }
+#endif
+    utf8_validate_fn = fn;
+}
+
+/*
+ * sf_utf8_validate
+ *
+ * Checks that src is well-formed UTF-8: no stray continuation bytes, no
+ * truncated or overlong sequences, no surrogates and nothing above
+ * U+10FFFF.  The other sf_*_utf8 kernels assume input that passed.
+ *
+ * returns:  SF_OK or SF_ERR_ENCODING
+ */
+int sf_utf8_validate(const char *src, size_t len) {
+    pthread_once(&utf8_once, pick_utf8_kernel);
+    return utf8_validate_fn((const unsigned char *)src, len) ? SF_OK : SF_ERR_ENCODING;
+}
+
+int sf_count_words_utf8(const char *src, size_t len, size_t *count) {
+    const unsigned char *p = (const unsigned char *)src;
+    const unsigned char *end = p + len;
+    size_t total = 0;
+    int prev_ws = 1;
+
+    while (p < end) {
+        if (end - p >= 16 && ascii_block16(p)) {
+            for (int k = 0; k < 16; k++) {
+                int ws = is_ws[p[k]];
+                total += (size_t)(prev_ws & !ws);
+                prev_ws = ws;
+            }
+            p += 16;
+            continue;
+        }
+        size_t n = utf8_ws_len(p, end - p);
+        int ws = n != 0;
+        total += (size_t)(prev_ws & !ws);
+        prev_ws = ws;
+        p += ws ? n : utf8_seq_len(p, end - p);
+    }
+
+    *count = total;
+    return SF_OK;
+}
+
+/*
+ * sf_print_words_utf8
+ *
+ * Same listing as sf_print_words, with Unicode spaces separating words
+ * and each length given in code points.
+ */
+typedef struct {
+    const unsigned char *word;
+    size_t               chars;
+    size_t               total;
+    int                  prev_ws;
+} utf8_words_t;
+
+static inline void utf8_word_step(utf8_words_t *w, const unsigned char *p, int ws,
+                                  sf_out_buff_t *out) {
+    if (!ws && w->prev_ws) {
+        w->word = p;
+        w->chars = 0;
+    } else if (ws && !w->prev_ws) {
+        print_word(out, ++w->total, (const char *)w->word, p - w->word, w->chars);
+    }
+    w->chars += (size_t)!ws;
+    w->prev_ws = ws;
+}
+
+int sf_print_words_utf8(const char *src, size_t len, sf_out_buff_t *out, size_t *nwords) {
+    const unsigned char *p = (const unsigned char *)src;
+    const unsigned char *end = p + len;
+    utf8_words_t w = { p, 0, 0, 1 };
+
+    while (p < end) {
+        if (end - p >= 16 && ascii_block16(p)) {
+            for (int k = 0; k < 16; k++) {
+                utf8_word_step(&w, p + k, is_ws[p[k]], out);
+            }
+            p += 16;
+            continue;
+        }
+        size_t n = utf8_ws_len(p, end - p);
+        utf8_word_step(&w, p, n != 0, out);
+        p += n ? n : utf8_seq_len(p, end - p);
+    }
+    utf8_word_step(&w, end, 1, out);
+
+    *nwords = w.total;
+    return out->err;
+}
+
+/*
+ * sf_reverse_utf8
+ *
+ * Reverses buf by code point.  The bytes are reversed with the vector
+ * kernel first, which leaves each multi-byte character as its
+ * continuation bytes followed by its lead byte; a second pass that skips
+ * ASCII blocks turns those runs back around.
+ */
+void sf_reverse_utf8(char *buf, size_t len) {
+    unsigned char *p = (unsigned char *)buf;
+    unsigned char *end = p + len;
+
+    sf_reverse(buf, len);
+    while (p < end) {
+        if (end - p >= 16 && ascii_block16(p)) {
+            p += 16;
+            continue;
+        }
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+        unsigned char *q = p;
+        while (q < end && (*q & 0xc0) == 0x80) {
+            q++;
+        }
+        q += (q < end);
+        reverse_inplace_word((char *)p, q - p);
+        p = q;
+    }
+}
+
+/*
+ * sf_find
+ *
+ * Returns the first occurrence of needle in hay, or NULL.  Candidates are
+ * filtered 16 positions at a time by comparing both the first and the last
+ * byte of the needle, so memcmp only runs where both ends already agree.
+ * That keeps the inner loop branch free on ordinary text.  On repetitive
+ * input both ends can agree nearly everywhere, so the bytes spent in
+ * failed memcmps are counted and once they outgrow the bytes scanned the
+ * rest of the search goes to memmem, whose Two-Way search is linear.
+ */
+#define SF_FIND_SLACK   2       // failed memcmp bytes allowed per byte scanned
+#define SF_FIND_BUDGET  4096    // ...plus this much before switching to memmem
+
+const char *sf_find(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    if (needle_len == 0 || needle_len > hay_len) {
+        return NULL;
+    }
+    if (needle_len == 1) {
+        return memchr(hay, needle[0], hay_len);
+    }
+
+    size_t last = needle_len - 1;
+    size_t limit = hay_len - needle_len;    // last valid start position
+    size_t i = 0;
+    size_t wasted = 0;                      // bytes compared by failed memcmps
+
+#ifdef __SSE2__
+    const __m128i first_v = _mm_set1_epi8(needle[0]);
+    const __m128i last_v = _mm_set1_epi8(needle[last]);
+
+    for (; i + 16 <= limit + 1; i += 16) {
+        __m128i block_f = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_l = _mm_loadu_si128((const __m128i *)(hay + i + last));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(block_f, first_v),
+                          _mm_cmpeq_epi8(block_l, last_v)));
+
+        while (mask != 0) {
+            size_t pos = i + (size_t)__builtin_ctz(mask);
+            if (memcmp(hay + pos + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + pos;
+            }
+            mask &= mask - 1;
+            wasted += needle_len;
+        }
+        if (wasted > SF_FIND_SLACK * i + SF_FIND_BUDGET) {
+            return memmem(hay + i + 16, hay_len - i - 16, needle, needle_len);
+        }
+    }
+#endif
+
+    for (; i <= limit; i++) {
+        if (hay[i] == needle[0] && hay[i + last] == needle[last]) {
+            if (memcmp(hay + i + 1, needle + 1, needle_len - 2) == 0) {
+                return hay + i;
+            }
+            wasted += needle_len;
+            if (wasted > SF_FIND_SLACK * i + SF_FIND_BUDGET) {
+                return memmem(hay + i + 1, hay_len - i - 1, needle, needle_len);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Shared body of sf_replace and sf_replace_all
+static int replace_span(const char *src, size_t len, const char *find, size_t find_len,
+                        const char *repl, size_t repl_len, char *dst, size_t cap,
+                        size_t *out_len, int max_matches) {
+    const char *end = src + len;
+    const char *match;
+    size_t n = 0;
+    int matches = 0;
+
+    if (find_len == 0) {
+        return SF_ERR_ARGS;
+    }
+
+    while (matches != max_matches &&
+           (match = sf_find(src, end - src, find, find_len)) != NULL) {
+        size_t keep = match - src;
+
+        if (n + keep + repl_len > cap) {
+            return SF_ERR_NO_SPACE;
+        }
+        memcpy(dst + n, src, keep);
+        n += keep;
+        memcpy(dst + n, repl, repl_len);
+        n += repl_len;
+        src = match + find_len;
+        matches++;
+    }
+
+    if (matches == 0) {
+        return SF_ERR_NOT_FOUND;
+    }
+    if (n + (size_t)(end - src) > cap) {
+        return SF_ERR_NO_SPACE;
+    }
+    memcpy(dst + n, src, end - src);
+    *out_len = n + (end - src);
+    return matches;
+}
+
+/*
+ * sf_replace, sf_replace_all
+ *
+ * Write src into dst with the first (or every non-overlapping) occurrence
+ * of find replaced, one memcpy per unchanged segment and per replacement.
+ * dst must not overlap src.
+ *
+ * returns:  number of replacements made
+ *           SF_ERR_NOT_FOUND  find does not occur in src
+ *           SF_ERR_NO_SPACE   the result needs more than cap bytes
+ *           SF_ERR_ARGS       find is empty
+ */
+int sf_replace(const char *src, size_t len, const char *find, size_t find_len,
+               const char *repl, size_t repl_len, char *dst, size_t cap, size_t *out_len) {
+    return replace_span(src, len, find, find_len, repl, repl_len, dst, cap, out_len, 1);
+}
+
+int sf_replace_all(const char *src, size_t len, const char *find, size_t find_len,
+                   const char *repl, size_t repl_len, char *dst, size_t cap, size_t *out_len) {
+    return replace_span(src, len, find, find_len, repl, repl_len, dst, cap, out_len, -1);
+}
+
+/*
+ * sf_map_file
+ *
+ * Maps a whole file read-only.  Empty files succeed with *map == NULL
+ * since mmap refuses zero length mappings.
+ *
+ * returns:  SF_OK, or SF_ERR_IO if the file cannot be opened or mapped
+ */
+int sf_map_file(const char *path, char **map, size_t *size) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    *map = NULL;
+    *size = 0;
+    if (fd < 0) {
+        return SF_ERR_IO;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return SF_ERR_IO;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return SF_OK;
+    }
+
+    char *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        return SF_ERR_IO;
+    }
+    madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *map = m;
+    *size = (size_t)st.st_size;
+    return SF_OK;
+}
+
+void sf_unmap_file(char *map, size_t size) {
+    if (map != NULL) {
+        munmap(map, size);
+    }
+}
+
+// Small inputs are not worth the thread startup cost
+static int clamp_threads(int nthreads, size_t size) {
+    if (nthreads > SF_MAX_THREADS) nthreads = SF_MAX_THREADS;
+    if ((size_t)nthreads > size / SF_MIN_RANGE_SZ) {
+        nthreads = (int)(size / SF_MIN_RANGE_SZ);
+    }
+    return (nthreads < 1) ? 1 : nthreads;
+}
+
+/*
+ * sf_count_words_mt
+ *
+ * Splits src into equal ranges, counts them on nthreads threads (the
+ * caller's thread takes the first one) and fixes up the boundaries.
+ *
+ * returns:  SF_OK, or SF_ERR_THREAD
+ */
+int sf_count_words_mt(const char *src, size_t len, int nthreads, size_t *count) {
+    count_range_t ranges[SF_MAX_THREADS];
+    pthread_t tids[SF_MAX_THREADS];
+    int rc = SF_OK;
+
+    nthreads = clamp_threads(nthreads, len);
+    size_t chunk = len / nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        ranges[i].start = src + chunk * i;
+        ranges[i].len = (i == nthreads - 1) ? len - chunk * i : chunk;
+    }
+
+    int started = 1;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, count_range, &ranges[i]) != 0) {
+            rc = SF_ERR_THREAD;
+            break;
+        }
+        started++;
+    }
+    count_range(&ranges[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (rc != SF_OK) {
+        return rc;
+    }
+
+    size_t total = ranges[0].count;
+    for (int i = 1; i < nthreads; i++) {
+        total += ranges[i].count;
+        if (ranges[i - 1].ends_in_word && ranges[i].starts_in_word) {
+            total--;        // same word counted on both sides
+        }
+    }
+    *count = total;
+    return SF_OK;
+}
+
+int sf_count_words_file(const char *path, int nthreads, size_t *count) {
+    char *map;
+    size_t size;
+
+    *count = 0;
+    if (sf_map_file(path, &map, &size) < 0) {
+        return SF_ERR_IO;
+    }
+    int rc = sf_count_words_mt(map, size, nthreads, count);
+    sf_unmap_file(map, size);
+    return rc;
+}
+
+/*
+ * ac_load_rules
+ *
+ * Reads a rules file with one "find<TAB>replace" pair per line.  Blank
+ * lines are skipped; the replacement may be empty.
+ *
+ * returns:  SF_OK on success
+ *           SF_ERR_IO      the file could not be read
+ *           SF_ERR_ARGS    a line has no tab or an empty find string
+ *           SF_ERR_MEMORY  out of memory
+ */
+int ac_load_rules(ac_automaton_t *ac, const char *path) {
+    memset(ac, 0, sizeof(*ac));
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return SF_ERR_IO;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    if (size < 0) {
+        fclose(fp);
+        return SF_ERR_IO;
+    }
+
+    ac->rules_text = malloc(size + 1);
+    if (ac->rules_text == NULL) {
+        fclose(fp);
+        return SF_ERR_MEMORY;
+    }
+    size_t got = fread(ac->rules_text, 1, size, fp);
+    fclose(fp);
+    ac->rules_text[got] = '\0';
+
+    int max_rules = 1;
+    for (size_t i = 0; i < got; i++) {
+        if (ac->rules_text[i] == '\n') max_rules++;
+    }
+    ac->find = malloc(max_rules * sizeof(char *));
+    ac->replace = malloc(max_rules * sizeof(char *));
+    ac->find_len = malloc(max_rules * sizeof(size_t));
+    ac->replace_len = malloc(max_rules * sizeof(size_t));
+    if (!ac->find || !ac->replace || !ac->find_len || !ac->replace_len) {
+        return SF_ERR_MEMORY;
+    }
+
+    char *line = ac->rules_text;
+    while (line != NULL && *line != '\0') {
+        char *eol = strchr(line, '\n');
+        if (eol != NULL) {
+            *eol = '\0';
+        }
+        size_t line_len = strlen(line);
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line[--line_len] = '\0';
+        }
+
+        if (line_len > 0) {
+            char *tab = strchr(line, '\t');
+            if (tab == NULL || tab == line) {
+                return SF_ERR_ARGS;
+            }
+            *tab = '\0';
+            ac->find[ac->nrules] = line;
+            ac->find_len[ac->nrules] = tab - line;
+            ac->replace[ac->nrules] = tab + 1;
+            ac->replace_len[ac->nrules] = strlen(tab + 1);
+            if (ac->find_len[ac->nrules] > ac->max_find_len) {
+                ac->max_find_len = ac->find_len[ac->nrules];
+            }
+            ac->nrules++;
+        }
+        line = (eol != NULL) ? eol + 1 : NULL;
+    }
+    return SF_OK;
+}
+
+/*
+ * ac_compile
+ *
+ * Builds the trie over the loaded rules, then fills in failure
+ * transitions breadth first so every state has a defined move on every
+ * byte class.  If two rules share a find string the first one wins.
+ *
+ * returns:  SF_OK, or SF_ERR_MEMORY
+ */
+int ac_compile(ac_automaton_t *ac) {
+    int max_states = 1;
+    uint8_t used[256] = {0};
+
+    for (int r = 0; r < ac->nrules; r++) {
+        max_states += (int)ac->find_len[r];
+        for (size_t i = 0; i < ac->find_len[r]; i++) {
+            used[(unsigned char)ac->find[r][i]] = 1;
+        }
+    }
+
+    ac->nclasses = 1;       // class 0 holds every byte not in a pattern
+    for (int b = 0; b < 256; b++) {
+        ac->class_of[b] = used[b] ? (uint8_t)ac->nclasses++ : 0;
+    }
+
+    ac->next = malloc((size_t)max_states * ac->nclasses * sizeof(int32_t));
+    ac->depth = malloc(max_states * sizeof(int32_t));
+    ac->out_rule = malloc(max_states * sizeof(int32_t));
+    int32_t *fail = malloc(max_states * sizeof(int32_t));
+    int32_t *queue = malloc(max_states * sizeof(int32_t));
+    if (!ac->next || !ac->depth || !ac->out_rule || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return SF_ERR_MEMORY;
+    }
+
+    // Trie: -1 marks a missing edge until the BFS below fills it in
+    memset(ac->next, 0xff, (size_t)max_states * ac->nclasses * sizeof(int32_t));
+    ac->nstates = 1;
+    ac->depth[0] = 0;
+    ac->out_rule[0] = -1;
+    for (int r = 0; r < ac->nrules; r++) {
+        int state = 0;
+        for (size_t i = 0; i < ac->find_len[r]; i++) {
+            int32_t *edge = &ac->next[state * ac->nclasses +
+                                      ac->class_of[(unsigned char)ac->find[r][i]]];
+            if (*edge < 0) {
+                *edge = ac->nstates;
+                ac->depth[ac->nstates] = (int32_t)i + 1;
+                ac->out_rule[ac->nstates] = -1;
+                ac->nstates++;
+            }
+            state = *edge;
+        }
+        if (ac->out_rule[state] < 0) {
+            ac->out_rule[state] = r;
+        }
+    }
+
+    // BFS: a state's own rule is always its longest; otherwise inherit
+    // the longest rule along the failure chain
+    int head = 0, tail = 0;
+    fail[0] = 0;
+    for (int c = 0; c < ac->nclasses; c++) {
+        int32_t *edge = &ac->next[c];
+        if (*edge < 0) {
+            *edge = 0;
+        } else {
+            fail[*edge] = 0;
+            queue[tail++] = *edge;
+        }
+    }
+    while (head < tail) {
+        int u = queue[head++];
+        int32_t *row = &ac->next[u * ac->nclasses];
+        const int32_t *fail_row = &ac->next[fail[u] * ac->nclasses];
+
+        for (int c = 0; c < ac->nclasses; c++) {
+            if (row[c] < 0) {
+                row[c] = fail_row[c];
+            } else {
+                int v = row[c];
+                fail[v] = fail_row[c];
+                if (ac->out_rule[v] < 0) {
+                    ac->out_rule[v] = ac->out_rule[fail[v]];
+                }
+                queue[tail++] = v;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return SF_OK;
+}
+
+/*
+ * ac_stream_init
+ *
+ * Prepares st for a rewrite fed through ac_stream_feed.  Must be closed
+ * with ac_stream_finish, which also releases the carry buffer.
+ *
+ * returns:  SF_OK, or SF_ERR_MEMORY
+ */
+int ac_stream_init(const ac_automaton_t *ac, ac_stream_t *st) {
+    st->state = 0;
+    st->carry_len = 0;
+    st->matches = 0;
+    st->carry = malloc(ac->max_find_len + 1);
+    return (st->carry == NULL) ? SF_ERR_MEMORY : SF_OK;
+}
+
+/*
+ * ac_stream_feed
+ *
+ * Runs the next piece of input through the automaton.  A match is
+ * replaced as soon as its last byte is seen; when more than one rule ends
+ * on the same byte the longest one wins.  Bytes that could still be the
+ * start of a match are held back in st->carry (never more than
+ * max_find_len - 1 of them) until a later piece decides them.
+ */
+void ac_stream_feed(const ac_automaton_t *ac, ac_stream_t *st,
+                    const char *src, size_t len, sf_out_buff_t *out) {
+    int32_t state = st->state;
+    size_t emit_from = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        state = ac->next[state * ac->nclasses + ac->class_of[(unsigned char)src[i]]];
+        int r = ac->out_rule[state];
+        if (r < 0) {
+            continue;
+        }
+
+        // The match may begin in bytes carried over from the last piece
+        ptrdiff_t start = (ptrdiff_t)(i + 1) - (ptrdiff_t)ac->find_len[r];
+        if (start < 0) {
+            sf_out_bytes(out, st->carry, st->carry_len + start);
+        } else {
+            sf_out_bytes(out, st->carry, st->carry_len);
+            sf_out_bytes(out, src + emit_from, start - emit_from);
+        }
+        sf_out_bytes(out, ac->replace[r], ac->replace_len[r]);
+        st->carry_len = 0;
+        st->matches++;
+        emit_from = i + 1;
+        state = 0;
+    }
+
+    // Flush everything except the bytes the current state still covers
+    size_t keep = (size_t)ac->depth[state];
+    size_t fresh = len - emit_from;
+    if (keep <= fresh) {
+        sf_out_bytes(out, st->carry, st->carry_len);
+        sf_out_bytes(out, src + emit_from, fresh - keep);
+        memcpy(st->carry, src + len - keep, keep);
+    } else {
+        size_t from_carry = keep - fresh;
+        sf_out_bytes(out, st->carry, st->carry_len - from_carry);
+        memmove(st->carry, st->carry + st->carry_len - from_carry, from_carry);
+        memcpy(st->carry + from_carry, src + emit_from, fresh);
+    }
+    st->carry_len = keep;
+    st->state = state;
+}
+
+void ac_stream_finish(ac_stream_t *st, sf_out_buff_t *out) {
+    sf_out_bytes(out, st->carry, st->carry_len);
+    free(st->carry);
+    st->carry = NULL;
+    st->carry_len = 0;
+}
+
+/*
+ * ac_rewrite
+ *
+ * Rewrites a whole span in one call.
+ *
+ * returns:  number of replacements made, SF_ERR_MEMORY, or the output's
+ *           error
+ */
+int ac_rewrite(const ac_automaton_t *ac, const char *src, size_t len, sf_out_buff_t *out) {
+    ac_stream_t st;
+
+    if (ac_stream_init(ac, &st) < 0) {
+        return SF_ERR_MEMORY;
+    }
+    ac_stream_feed(ac, &st, src, len, out);
+    ac_stream_finish(&st, out);
+    return out->err ? out->err : (int)st.matches;
+}
+
+/*
+ * ac_rewrite_fd
+ *
+ * Streams in_fd through the automaton in SF_STREAM_CHUNK_SZ reads.
+ *
+ * returns:  number of replacements made, SF_ERR_IO on a read error,
+ *           SF_ERR_MEMORY, or the output's error
+ */
+int ac_rewrite_fd(const ac_automaton_t *ac, int in_fd, sf_out_buff_t *out) {
+    char *buf = malloc(SF_STREAM_CHUNK_SZ);
+    ac_stream_t st;
+    ssize_t n;
+
+    if (buf == NULL || ac_stream_init(ac, &st) < 0) {
+        free(buf);
+        return SF_ERR_MEMORY;
+    }
+    while ((n = read(in_fd, buf, SF_STREAM_CHUNK_SZ)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        ac_stream_feed(ac, &st, buf, (size_t)n, out);
+    }
+    ac_stream_finish(&st, out);
+    free(buf);
+    if (n < 0) {
+        return SF_ERR_IO;
+    }
+    return out->err ? out->err : (int)st.matches;
+}
+
+void ac_free(ac_automaton_t *ac) {
+    free(ac->find);
+    free(ac->find_len);
+    free(ac->replace);
+    free(ac->replace_len);
+    free(ac->rules_text);
+    free(ac->next);
+    free(ac->depth);
+    free(ac->out_rule);
+    memset(ac, 0, sizeof(*ac));
+}
+
+
+void *sf_arena_alloc(sf_arena_t *arena, size_t n) {
+    if (n > arena->left) {
+        size_t block_sz = (n > SF_ARENA_BLOCK_SZ) ? n : SF_ARENA_BLOCK_SZ;
+        sf_arena_block_t *block = malloc(sizeof(sf_arena_block_t) + block_sz);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->head;
+        arena->head = block;
+        arena->ptr = block->data;
+        arena->left = block_sz;
+    }
+    void *p = arena->ptr;
+    arena->ptr += n;
+    arena->left -= n;
+    return p;
+}
+
+void sf_arena_free(sf_arena_t *arena) {
+    while (arena->head != NULL) {
+        sf_arena_block_t *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->ptr = NULL;
+    arena->left = 0;
+}
+
+// FNV-1a, 64 bit
+static uint64_t hash_bytes(const char *p, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int sf_freq_init(sf_freq_table_t *t) {
+    memset(t, 0, sizeof(*t));
+    t->slots = calloc(SF_FREQ_INIT_SLOTS, sizeof(sf_freq_entry_t));
+    if (t->slots == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    t->cap = SF_FREQ_INIT_SLOTS;
+    return SF_OK;
+}
+
+void sf_freq_free(sf_freq_table_t *t) {
+    free(t->slots);
+    sf_arena_free(&t->arena);
+    memset(t, 0, sizeof(*t));
+}
+
+// Doubles the slot array; keys stay where they are in the arena
+static int freq_grow(sf_freq_table_t *t) {
+    size_t cap = t->cap * 2;
+    sf_freq_entry_t *slots = calloc(cap, sizeof(sf_freq_entry_t));
+    if (slots == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].key == NULL) {
+            continue;
+        }
+        size_t j = t->slots[i].hash & (cap - 1);
+        while (slots[j].key != NULL) {
+            j = (j + 1) & (cap - 1);
+        }
+        slots[j] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return SF_OK;
+}
+
+/*
+ * sf_freq_add
+ *
+ * Adds count to word, interning the word in the arena the first time it
+ * is seen.
+ *
+ * returns:  SF_OK, or SF_ERR_MEMORY
+ */
+int sf_freq_add(sf_freq_table_t *t, const char *word, size_t len, size_t count) {
+    uint64_t hash = hash_bytes(word, len);
+    size_t mask = t->cap - 1;
+    size_t i = hash & mask;
+
+    while (t->slots[i].key != NULL) {
+        sf_freq_entry_t *e = &t->slots[i];
+        if (e->hash == hash && e->len == len && memcmp(e->key, word, len) == 0) {
+            e->count += count;
+            return SF_OK;
+        }
+        i = (i + 1) & mask;
+    }
+
+    char *key = sf_arena_alloc(&t->arena, len);
+    if (key == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    memcpy(key, word, len);
+    t->slots[i].hash = hash;
+    t->slots[i].key = key;
+    t->slots[i].len = len;
+    t->slots[i].count = count;
+    t->used++;
+
+    // Keep the load factor under 0.7 so probe runs stay short
+    if (t->used * 10 >= t->cap * 7) {
+        return freq_grow(t);
+    }
+    return SF_OK;
+}
+
+typedef struct {
+    const char  *start;
+    size_t       len;
+    sf_freq_table_t table;
+    int          rc;
+} freq_range_t;
+
+static void *freq_range(void *arg) {
+    freq_range_t *r = (freq_range_t *)arg;
+    const char *ptr = r->start;
+    const char *end = r->start + r->len;
+
+    r->rc = sf_freq_init(&r->table);
+    while (r->rc == 0 && ptr < end) {
+        while (ptr < end && is_ws[(unsigned char)*ptr]) {
+            ptr++;
+        }
+        const char *word = ptr;
+        while (ptr < end && !is_ws[(unsigned char)*ptr]) {
+            ptr++;
+        }
+        if (ptr > word) {
+            r->rc = sf_freq_add(&r->table, word, ptr - word, 1);
+        }
+    }
+    return NULL;
+}
+
+// Higher count first, ties broken by byte order of the word
+static int freq_cmp(const sf_freq_entry_t *a, const sf_freq_entry_t *b) {
+    if (a->count != b->count) {
+        return (a->count > b->count) ? -1 : 1;
+    }
+    size_t n = (a->len < b->len) ? a->len : b->len;
+    int c = memcmp(a->key, b->key, n);
+    if (c != 0) {
+        return c;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+static int freq_qsort_cmp(const void *a, const void *b) {
+    return freq_cmp(*(const sf_freq_entry_t * const *)a, *(const sf_freq_entry_t * const *)b);
+}
+
+// Restores the heap below i; the root is the entry that ranks lowest
+static void freq_sift_down(sf_freq_entry_t **heap, size_t n, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, low = i;
+        if (l < n && freq_cmp(heap[l], heap[low]) > 0) low = l;
+        if (r < n && freq_cmp(heap[r], heap[low]) > 0) low = r;
+        if (low == i) {
+            return;
+        }
+        sf_freq_entry_t *tmp = heap[i];
+        heap[i] = heap[low];
+        heap[low] = tmp;
+        i = low;
+    }
+}
+
+/*
+ * sf_word_freq
+ *
+ * Prints "count word" lines in the style of uniq -c, most frequent first,
+ * for the top k words of src (all of them when k is 0).  Each thread
+ * builds its own table over a range that ends on whitespace and the
+ * tables are merged into the first one.  Selection uses a k-entry heap,
+ * so only the winners are sorted.
+ *
+ * returns:  SF_OK, SF_ERR_THREAD, SF_ERR_MEMORY or the output's error
+ */
+int sf_word_freq(const char *src, size_t len, int nthreads, size_t k, sf_out_buff_t *out) {
+    nthreads = clamp_threads(nthreads, len);
+
+    freq_range_t ranges[SF_MAX_THREADS];
+    pthread_t tids[SF_MAX_THREADS];
+    size_t chunk = len / nthreads;
+    size_t begin = 0;
+    int rc = SF_OK;
+
+    // Push each cut forward to a whitespace byte so no word is split
+    for (int i = 0; i < nthreads; i++) {
+        size_t cut = (i == nthreads - 1) ? len : chunk * (i + 1);
+        if (cut < begin) {
+            cut = begin;
+        }
+        while (cut < len && !is_ws[(unsigned char)src[cut]]) {
+            cut++;
+        }
+        ranges[i].start = src + begin;
+        ranges[i].len = cut - begin;
+        begin = cut;
+    }
+
+    int started = 1;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, freq_range, &ranges[i]) != 0) {
+            rc = SF_ERR_THREAD;
+            break;
+        }
+        started++;
+    }
+    freq_range(&ranges[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    sf_freq_table_t *total = &ranges[0].table;
+    for (int i = 0; i < started; i++) {
+        if (rc == SF_OK) {
+            rc = ranges[i].rc;
+        }
+    }
+    for (int i = 1; i < started; i++) {
+        sf_freq_table_t *t = &ranges[i].table;
+        for (size_t s = 0; rc == SF_OK && s < t->cap; s++) {
+            if (t->slots[s].key != NULL) {
+                rc = sf_freq_add(total, t->slots[s].key, t->slots[s].len, t->slots[s].count);
+            }
+        }
+        sf_freq_free(t);
+    }
+
+    sf_freq_entry_t **top = NULL;
+    size_t ntop = 0;
+    if (rc == SF_OK && total->used > 0) {
+        if (k == 0 || k > total->used) {
+            k = total->used;
+        }
+        top = malloc(k * sizeof(sf_freq_entry_t *));
+        if (top == NULL) {
+            rc = SF_ERR_MEMORY;
+        }
+    }
+
+    for (size_t s = 0; top != NULL && s < total->cap; s++) {
+        sf_freq_entry_t *e = &total->slots[s];
+        if (e->key == NULL) {
+            continue;
+        }
+        if (ntop < k) {
+            top[ntop++] = e;
+            if (ntop == k) {
+                for (size_t i = k / 2; i-- > 0; ) {
+                    freq_sift_down(top, k, i);
+                }
+            }
+        } else if (freq_cmp(e, top[0]) < 0) {
+            top[0] = e;
+            freq_sift_down(top, k, 0);
+        }
+    }
+
+    if (top != NULL) {
+        qsort(top, ntop, sizeof(sf_freq_entry_t *), freq_qsort_cmp);
+        for (size_t i = 0; i < ntop; i++) {
+            // Right align the count in 7 columns like uniq -c
+            size_t digits = 1;
+            for (size_t v = top[i]->count; v >= 10; v /= 10) {
+                digits++;
+            }
+            for (; digits < 7; digits++) {
+                sf_out_char(out, ' ');
+            }
+            sf_out_uint(out, top[i]->count);
+            sf_out_char(out, ' ');
+            sf_out_bytes(out, top[i]->key, top[i]->len);
+            sf_out_char(out, '\n');
+        }
+        free(top);
+    }
+
+    sf_freq_free(total);
+    return (rc == SF_OK) ? out->err : rc;
+}
+
+int sf_word_freq_file(const char *path, int nthreads, size_t k, sf_out_buff_t *out) {
+    char *map;
+    size_t size;
+
+    if (sf_map_file(path, &map, &size) < 0) {
+        return SF_ERR_IO;
+    }
+    int rc = sf_word_freq(map, size, nthreads, k, out);
+    sf_unmap_file(map, size);
+    return rc;
+}
+
+/*
+ * Parallel replace-all of a stream.
+ *
+ * The caller's thread reads the input into a fixed ring of chunks, a pool
+ * of workers rewrites chunks as soon as they are complete, and a writer
+ * thread emits the results in input order.  Each chunk also carries a
+ * copy of the first find_len - 1 bytes of the next one, so a worker sees
+ * every match that starts in its own bytes.  What no worker can know is
+ * whether a match from the previous chunk runs into its bytes; that is
+ * left to the writer, which knows how far every match spilled over.
+ */
+enum { CHUNK_FREE, CHUNK_READ, CHUNK_BUSY, CHUNK_DONE };
+
+typedef struct {
+    int           state;
+    char         *data;         // own bytes followed by the overlap
+    size_t        own;
+    size_t        len;
+    sf_out_buff_t res;
+    size_t        first;        // offset of the first match, or own
+    size_t        spill;        // bytes of the next chunk the last match used
+    size_t        matches;
+    int           failed;
+} pipe_chunk_t;
+
+typedef struct {
+    const char     *find;
+    size_t          find_len;
+    const char     *repl;
+    size_t          repl_len;
+    pipe_chunk_t   *chunks;
+    size_t          nchunks;
+    size_t          next_job;   // sequence numbers, chunk = seq % nchunks
+    size_t          next_write;
+    size_t          nread;      // chunks handed to the workers so far
+    int             eof;
+    int             failed;
+    size_t          matches;
+    sf_out_buff_t  *out;
+    pthread_mutex_t lock;
+    pthread_cond_t  readable;   // a chunk became CHUNK_READ, or eof
+    pthread_cond_t  done;       // a chunk became CHUNK_DONE, or eof
+    pthread_cond_t  freed;      // a chunk became CHUNK_FREE
+} replace_pipe_t;
+
+/*
+ * Replaces the matches that start in src[0, own), where src[own, len) is
+ * lookahead that only a match straddling the end may use.  Returns the
+ * input offset the scan stopped at, past own when a match spilled.
+ */
+static size_t rewrite_span(const replace_pipe_t *p, const char *src, size_t own, size_t len,
+                           sf_out_buff_t *out, size_t *first, size_t *matches) {
+    size_t pos = 0;
+    const char *hit;
+
+    *first = own;
+    *matches = 0;
+    while (pos < own && (hit = sf_find(src + pos, len - pos, p->find, p->find_len)) != NULL &&
+           (size_t)(hit - src) < own) {
+        size_t at = hit - src;
+        if (*matches == 0) {
+            *first = at;
+        }
+        sf_out_bytes(out, src + pos, at - pos);
+        sf_out_bytes(out, p->repl, p->repl_len);
+        pos = at + p->find_len;
+        (*matches)++;
+    }
+    if (pos < own) {
+        sf_out_bytes(out, src + pos, own - pos);
+        pos = own;
+    }
+    return pos;
+}
+
+static void *replace_worker(void *arg) {
+    replace_pipe_t *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->next_job == p->nread && !p->eof) {
+            pthread_cond_wait(&p->readable, &p->lock);
+        }
+        if (p->next_job == p->nread) {
+            break;
+        }
+        pipe_chunk_t *c = &p->chunks[p->next_job++ % p->nchunks];
+        c->state = CHUNK_BUSY;
+        pthread_mutex_unlock(&p->lock);
+
+        c->res.len = 0;
+        size_t used = rewrite_span(p, c->data, c->own, c->len, &c->res, &c->first, &c->matches);
+        c->spill = used - c->own;
+        c->failed = (c->res.err != SF_OK);      // the in-memory result failed to grow
+
+        pthread_mutex_lock(&p->lock);
+        c->state = CHUNK_DONE;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void *replace_writer(void *arg) {
+    replace_pipe_t *p = arg;
+    size_t spill = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        pipe_chunk_t *c = &p->chunks[p->next_write % p->nchunks];
+        while ((p->next_write == p->nread || c->state != CHUNK_DONE) &&
+               !(p->eof && p->next_write == p->nread)) {
+            pthread_cond_wait(&p->done, &p->lock);
+        }
+        if (p->next_write == p->nread) {
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        /*
+         * The worker started at the chunk's first byte.  If the previous
+         * match used the first spill bytes and the worker found nothing
+         * in them, its output is still right minus that literal prefix;
+         * otherwise the matches shifted and the chunk is redone here.
+         */
+        size_t drop = spill;
+        if (spill > 0 && c->first < spill) {
+            c->res.len = 0;
+            size_t used = rewrite_span(p, c->data + spill, c->own - spill, c->len - spill,
+                                       &c->res, &c->first, &c->matches);
+            c->failed = (c->res.err != SF_OK);
+            spill = used + spill - c->own;
+            drop = 0;
+        } else {
+            spill = c->spill;
+        }
+        if (!c->failed) {
+            sf_out_bytes(p->out, c->res.data + drop, c->res.len - drop);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->failed |= c->failed;
+        p->matches += c->matches;
+        p->next_write++;
+        c->state = CHUNK_FREE;
+        pthread_cond_signal(&p->freed);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * Fills buf from fd until it is full or the input ends.
+ */
+static ssize_t read_full(int fd, char *buf, size_t cap) {
+    size_t n = 0;
+
+    while (n < cap) {
+        ssize_t got = read(fd, buf + n, cap - n);
+        if (got == 0) {
+            break;
+        }
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        n += (size_t)got;
+    }
+    return (ssize_t)n;
+}
+
+/*
+ * sf_replace_all_fd
+ *
+ * Writes everything readable from fd to out with every non-overlapping
+ * occurrence of find replaced, leftmost first, using nthreads workers.
+ * Memory stays at SF_PIPE_CHUNKS_PER_THREAD chunks of SF_PIPE_CHUNK_SZ
+ * per worker (plus their results) however large the input is.
+ *
+ * returns:  SF_OK, SF_ERR_ARGS for an empty or over-long find string,
+ *           SF_ERR_MEMORY, SF_ERR_IO, SF_ERR_THREAD or SF_ERR_WRITE
+ */
+int sf_replace_all_fd(int fd, const char *find, size_t find_len, const char *repl,
+                      size_t repl_len, int nthreads, sf_out_buff_t *out, size_t *nmatches) {
+    replace_pipe_t p = { find, find_len, repl, repl_len, NULL, 0, 0, 0, 0, 0, 0, 0, out,
+                         PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                         PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    size_t overlap = find_len - 1;
+    pthread_t tids[SF_MAX_THREADS];
+    pthread_t writer;
+    int started = 0;
+    int rc = SF_OK;
+
+    if (find_len == 0 || find_len > SF_PIPE_CHUNK_SZ) {
+        return SF_ERR_ARGS;
+    }
+    if (nthreads > SF_MAX_THREADS) nthreads = SF_MAX_THREADS;
+    if (nthreads < 1) nthreads = 1;
+
+    p.nchunks = (size_t)nthreads * SF_PIPE_CHUNKS_PER_THREAD + 1;
+    p.chunks = calloc(p.nchunks, sizeof(pipe_chunk_t));
+    if (p.chunks == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    for (size_t i = 0; i < p.nchunks; i++) {
+        p.chunks[i].data = malloc(SF_PIPE_CHUNK_SZ + overlap);
+        if (p.chunks[i].data == NULL ||
+            sf_out_init(&p.chunks[i].res, SF_OUT_MEMORY, SF_PIPE_CHUNK_SZ) < 0) {
+            rc = SF_ERR_MEMORY;
+            goto done;
+        }
+    }
+
+    if (pthread_create(&writer, NULL, replace_writer, &p) != 0) {
+        rc = SF_ERR_THREAD;
+        goto done;
+    }
+    for (; started < nthreads; started++) {
+        if (pthread_create(&tids[started], NULL, replace_worker, &p) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        rc = SF_ERR_THREAD;
+    }
+
+    /*
+     * Reader.  Chunk seq is only handed to the workers once chunk seq + 1
+     * has been read and its head copied in as seq's overlap, so at most
+     * one chunk is held back.
+     */
+    pipe_chunk_t *prev = NULL;
+    for (size_t seq = 0; rc == SF_OK; seq++) {
+        pipe_chunk_t *c = &p.chunks[seq % p.nchunks];
+
+        pthread_mutex_lock(&p.lock);
+        while (c->state != CHUNK_FREE) {
+            pthread_cond_wait(&p.freed, &p.lock);
+        }
+        c->state = CHUNK_BUSY;      // held by the reader until published
+        pthread_mutex_unlock(&p.lock);
+
+        ssize_t got = read_full(fd, c->data, SF_PIPE_CHUNK_SZ);
+        if (got < 0) {
+            rc = SF_ERR_IO;     // a chunk held back as prev is dropped
+            break;
+        }
+        c->own = c->len = (size_t)got;
+        if (prev != NULL) {
+            size_t n = (c->own < overlap) ? c->own : overlap;
+            memcpy(prev->data + prev->own, c->data, n);
+            prev->len = prev->own + n;
+            pthread_mutex_lock(&p.lock);
+            prev->state = CHUNK_READ;
+            p.nread++;
+            pthread_cond_signal(&p.readable);
+            pthread_mutex_unlock(&p.lock);
+            prev = NULL;
+        }
+        if (got == 0) {
+            break;
+        }
+        prev = c;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.eof = 1;
+    pthread_cond_broadcast(&p.readable);
+    pthread_cond_broadcast(&p.done);
+    pthread_mutex_unlock(&p.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_join(writer, NULL);
+    if (rc == SF_OK && p.failed) {
+        rc = SF_ERR_MEMORY;
+    }
+    if (rc == SF_OK) {
+        rc = out->err;
+    }
+    *nmatches = p.matches;
+
+done:
+    for (size_t i = 0; i < p.nchunks; i++) {
+        free(p.chunks[i].data);
+        sf_out_free(&p.chunks[i].res);
+    }
+    free(p.chunks);
+    return rc;
+}
@@ -0,0 +1,265 @@
+#ifndef __SFLIB_H__
+    #define __SFLIB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libstringfun - the text kernels behind stringfun.
+ *
+ * Every kernel takes its input as a (pointer, length) span, never depends
+ * on BUFFER_SZ or on NUL termination, and reports problems through the
+ * return codes below instead of printing or exiting.  Output goes either
+ * into a caller supplied buffer (dst, cap) or into a sf_out_buff_t, which
+ * can write to an fd or grow in memory.
+ */
+
+//Standard Return Codes
+#define SF_OK                0
+#define SF_ERR_NOT_FOUND    -1      //search string was not found
+#define SF_ERR_NO_SPACE     -2      //result does not fit the output buffer
+#define SF_ERR_MEMORY       -3
+#define SF_ERR_IO           -4      //file could not be opened, mapped or read
+#define SF_ERR_THREAD       -5      //worker thread could not be started
+#define SF_ERR_ARGS         -6      //empty pattern, malformed rules file...
+#define SF_ERR_ENCODING     -7      //input is not valid UTF-8
+#define SF_ERR_WRITE        -8      //output could not be written
+
+//Tuning constants
+#define SF_MAX_THREADS      256
+#define SF_MIN_RANGE_SZ     (64 * 1024)     //don't split below 64K per thread
+#define SF_STREAM_CHUNK_SZ  (64 * 1024)     //read size for fd based streams
+#define SF_LINES_BUFF_SZ    (1024 * 1024)   //read buffer of the line reader
+#define SF_PIPE_CHUNK_SZ    (1024 * 1024)   //input chunk of the parallel replace
+#define SF_PIPE_CHUNKS_PER_THREAD 2         //chunks in flight per worker
+#define SF_OUT_BUFF_SZ      (64 * 1024)
+#define SF_ARENA_BLOCK_SZ   (1024 * 1024)
+#define SF_FREQ_INIT_SLOTS  4096            //must be a power of two
+#define SF_RX_MAX_REPEAT    1000            //largest count in x{m,n}
+#define SF_RX_MAX_INST      100000          //NFA size limit for one pattern
+#define SF_RX_CACHE_STATES  4096            //DFA states kept before a flush
+
+#define SF_OUT_MEMORY       -1              //sf_out_buff_t fd for an in-memory sink
+
+/*
+ * Output buffer.  With a real fd the buffer is a fixed block that is
+ * handed to write() once it fills up; with SF_OUT_MEMORY it grows instead so
+ * callers can collect the output from data/len.  The first write or grow
+ * failure is kept in err; sf_out_flush and the kernels writing to the buffer
+ * return it.
+ */
+typedef struct {
+    int     fd;
+    char   *data;
+    size_t  len;
+    size_t  cap;
+    int     err;        //SF_OK, SF_ERR_WRITE or SF_ERR_MEMORY, sticky
+} sf_out_buff_t;
+
+/*
+ * Bump allocator.  Memory comes from 1M blocks that are only released all
+ * at once by sf_arena_free, so interning a word is a pointer increment.
+ */
+typedef struct sf_arena_block {
+    struct sf_arena_block *next;
+    char                   data[];
+} sf_arena_block_t;
+
+typedef struct {
+    sf_arena_block_t *head;
+    char             *ptr;
+    size_t            left;
+} sf_arena_t;
+
+/*
+ * Word -> count table with open addressing and linear probing.  Keys live
+ * in the table's arena and the full hash is kept in each slot so probes
+ * and rehashes rarely touch the key bytes.
+ */
+typedef struct {
+    uint64_t    hash;
+    const char *key;            // NULL marks an empty slot
+    size_t      len;
+    size_t      count;
+} sf_freq_entry_t;
+
+typedef struct {
+    sf_freq_entry_t *slots;
+    size_t           cap;
+    size_t           used;
+    sf_arena_t       arena;
+} sf_freq_table_t;
+
+/*
+ * Aho-Corasick automaton for multi-pattern find/replace.  Bytes are mapped
+ * to a compact class id (one per byte that appears in any pattern, plus a
+ * shared class for everything else) and next[] is a dense
+ * nstates x nclasses table with the failure links already folded in, so
+ * each input byte costs exactly one table lookup.
+ */
+typedef struct {
+    int       nrules;
+    char    **find;
+    size_t   *find_len;
+    char    **replace;
+    size_t   *replace_len;
+    size_t    max_find_len;
+    char     *rules_text;       // owns the strings find/replace point into
+
+    int       nstates;
+    int       nclasses;
+    uint8_t   class_of[256];
+    int32_t  *next;
+    int32_t  *depth;
+    int32_t  *out_rule;         // longest rule ending in this state, or -1
+} ac_automaton_t;
+
+/*
+ * Position of a rewrite that is fed its input in pieces.  carry holds the
+ * bytes that may still turn out to be the start of a match.
+ */
+typedef struct {
+    int32_t  state;
+    char    *carry;
+    size_t   carry_len;
+    size_t   matches;
+} ac_stream_t;
+
+/*
+ * Per-line callback for sf_lines_fd.  line excludes the newline and nl
+ * says whether there was one; a nonzero return stops the reader.
+ */
+typedef int (*sf_line_fn)(const char *line, size_t len, int nl, void *arg);
+
+/*
+ * Regular expression compiled for find/replace.  The pattern becomes a
+ * Thompson NFA that is run as two DFAs whose states are built on first
+ * use and cached: the usual forward one, and a backward one whose states
+ * are the sets of NFA instructions that can still complete a match from a
+ * given position.  Bytes that no part of the pattern tells apart share a
+ * class, so a DFA state's row in trans[] has nclasses entries, not 256.
+ */
+typedef struct {
+    uint8_t   op;
+    int32_t   out;
+    int32_t   out1;
+    uint64_t  set[4];           // bytes an RX_BYTE instruction accepts
+} rx_inst_t;
+
+typedef struct {
+    rx_inst_t *inst;
+    int32_t    ninst;
+    int32_t    cap;
+    int32_t    start;
+    int32_t   *pred_off;        // RX_SPLIT instructions leading to each
+    int32_t   *pred;            // instruction, for walking back
+} rx_nfa_t;
+
+typedef struct {
+    const rx_nfa_t *nfa;
+    int        live;            // the backward liveness DFA
+    int32_t    nstates;
+    int32_t    cap;
+    int32_t   *trans;           // nstates x nclasses, -1 until computed
+    uint8_t   *flags;           // RX_ACCEPT / RX_DEAD per state
+    int32_t   *set_off;         // each state's sorted NFA set in pool[]
+    int32_t   *set_len;
+    int32_t   *pool;
+    size_t     pool_len;
+    size_t     pool_cap;
+    int32_t   *slots;           // set -> state hash table, -1 when empty
+    size_t     nslots;
+    uint32_t  *mark;            // scratch, one per NFA instruction
+    uint32_t   gen;
+    int32_t   *stack;
+    int32_t   *scratch;
+    size_t     flushes;
+} rx_dfa_t;
+
+typedef struct {
+    int        nclasses;
+    uint8_t    class_of[256];
+    uint8_t    class_rep[256];  // one byte of each class
+    rx_nfa_t   nfa;
+    rx_dfa_t   fwd;
+    rx_dfa_t   live;
+} rx_t;
+
+//output buffer
+int  sf_out_init(sf_out_buff_t *out, int fd, size_t cap);
+int  sf_out_flush(sf_out_buff_t *out);
+void sf_out_free(sf_out_buff_t *out);
+void sf_out_bytes(sf_out_buff_t *out, const char *src, size_t n);
+void sf_out_str(sf_out_buff_t *out, const char *str);
+void sf_out_char(sf_out_buff_t *out, char c);
+void sf_out_uint(sf_out_buff_t *out, size_t value);
+void sf_out_int(sf_out_buff_t *out, long long value);
+char *sf_out_claim(sf_out_buff_t *out, size_t n);
+
+//arena
+void *sf_arena_alloc(sf_arena_t *arena, size_t n);
+void sf_arena_free(sf_arena_t *arena);
+
+//single span kernels
+int  sf_normalize(const char *src, size_t len, char *dst, size_t cap, size_t *out_len);
+size_t sf_normalize_block(const char *src, size_t n, int next, int *lead, char *dst);
+int  sf_count_words(const char *src, size_t len, size_t *count);
+int  sf_print_words(const char *src, size_t len, sf_out_buff_t *out, size_t *nwords);
+void sf_reverse(char *buf, size_t len);
+void sf_reverse_copy(const char *src, size_t len, char *dst);
+int  sf_reverse_out(const char *src, size_t len, sf_out_buff_t *out);
+size_t sf_reverse_lines(const char *src, size_t len, int final, sf_out_buff_t *out);
+const char *sf_find(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+int  sf_replace(const char *src, size_t len, const char *find, size_t find_len,
+                const char *repl, size_t repl_len, char *dst, size_t cap, size_t *out_len);
+int  sf_replace_all(const char *src, size_t len, const char *find, size_t find_len,
+                    const char *repl, size_t repl_len, char *dst, size_t cap, size_t *out_len);
+
+//UTF-8 kernels, by code point instead of by byte
+int  sf_utf8_validate(const char *src, size_t len);
+int  sf_count_words_utf8(const char *src, size_t len, size_t *count);
+int  sf_print_words_utf8(const char *src, size_t len, sf_out_buff_t *out, size_t *nwords);
+void sf_reverse_utf8(char *buf, size_t len);
+
+//multi-threaded kernels and their file wrappers
+int  sf_map_file(const char *path, char **map, size_t *size);
+void sf_unmap_file(char *map, size_t size);
+int  sf_read_fd(int fd, char **data, size_t *len);
+int  sf_count_words_mt(const char *src, size_t len, int nthreads, size_t *count);
+int  sf_count_words_file(const char *path, int nthreads, size_t *count);
+int  sf_word_freq(const char *src, size_t len, int nthreads, size_t k, sf_out_buff_t *out);
+int  sf_word_freq_file(const char *path, int nthreads, size_t k, sf_out_buff_t *out);
+int  sf_replace_all_fd(int fd, const char *find, size_t find_len, const char *repl,
+                       size_t repl_len, int nthreads, sf_out_buff_t *out, size_t *nmatches);
+
+//fd based streaming kernels
+int  sf_normalize_fd(int fd, sf_out_buff_t *out);
+int  sf_reverse_fd(int fd, sf_out_buff_t *out);
+int  sf_reverse_lines_fd(int fd, sf_out_buff_t *out);
+int  sf_lines_fd(int fd, sf_line_fn fn, void *arg);
+
+//word frequency table
+int  sf_freq_init(sf_freq_table_t *t);
+int  sf_freq_add(sf_freq_table_t *t, const char *word, size_t len, size_t count);
+void sf_freq_free(sf_freq_table_t *t);
+
+//multi-pattern rewriting
+int  ac_load_rules(ac_automaton_t *ac, const char *path);
+int  ac_compile(ac_automaton_t *ac);
+int  ac_stream_init(const ac_automaton_t *ac, ac_stream_t *st);
+void ac_stream_feed(const ac_automaton_t *ac, ac_stream_t *st,
+                    const char *src, size_t len, sf_out_buff_t *out);
+void ac_stream_finish(ac_stream_t *st, sf_out_buff_t *out);
+int  ac_rewrite(const ac_automaton_t *ac, const char *src, size_t len, sf_out_buff_t *out);
+int  ac_rewrite_fd(const ac_automaton_t *ac, int in_fd, sf_out_buff_t *out);
+void ac_free(ac_automaton_t *ac);
+
+//regular expression find/replace
+int  rx_compile(rx_t *rx, const char *pattern, size_t len);
+int  rx_replace(rx_t *rx, const char *src, size_t len, const char *repl, size_t repl_len,
+                sf_out_buff_t *out, size_t *nmatches);
+int  rx_replace_fd(rx_t *rx, int fd, const char *repl, size_t repl_len, sf_out_buff_t *out,
+                   size_t *nmatches);
+void rx_free(rx_t *rx);
+
+#endif
@@ -0,0 +1,1142 @@
+/*
+ * sfregex.c
+ *
+ * Regular expression find/replace for libstringfun, in time linear in the
+ * input no matter what the pattern is.
+ *
+ * Syntax (bytes, not code points): literals, ".", [...] and [^...] with
+ * ranges, \d \w \s and their negations, \n \t \r \f \v \xHH, grouping with
+ * (), alternation with |, and the repeats * + ? {m} {m,} {m,n}.  There is
+ * no backtracking construct to support: no backreferences, no anchors,
+ * and since nothing is captured the replacement can only refer to the
+ * whole match, as &.
+ *
+ * Matches are leftmost-longest, like sed.  A backward pass over the text
+ * marks every position where a match starts; the forward DFA then only
+ * ever runs anchored, from the next marked position, and stops as soon
+ * as no longer match is possible (see "Matching" below).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sflib.h"
+
+//NFA instructions
+#define RX_BYTE     1       //consume one byte in set, go to out
+#define RX_SPLIT    2       //go to out and out1
+#define RX_MATCH    3
+
+//DFA state flags
+#define RX_ACCEPT   1
+#define RX_DEAD     2
+
+#define RX_UNKNOWN  -1      //transition not computed yet
+#define RX_FULL     -2      //state cache has to be flushed first
+#define RX_NONE     ((size_t)-1)
+
+/*
+ * Parsing
+ */
+#define RX_EMPTY    0
+#define RX_SET      1
+#define RX_CAT      2
+#define RX_ALT      3
+#define RX_REPEAT   4
+
+typedef struct rx_node {
+    int             kind;
+    int             min;
+    int             max;        //-1 for no upper bound
+    struct rx_node *l;
+    struct rx_node *r;
+    uint64_t        set[4];
+} rx_node_t;
+
+#define RX_MAX_DEPTH    256     //nesting limit for ( )
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    sf_arena_t           arena;
+    int                  depth;
+    int                  err;
+} rx_parser_t;
+
+static inline void set_add(uint64_t *set, int b) {
+    set[b >> 6] |= 1ULL << (b & 63);
+}
+
+static inline int set_has(const uint64_t *set, int b) {
+    return (int)(set[b >> 6] >> (b & 63)) & 1;
+}
+
+static void set_range(uint64_t *set, int lo, int hi) {
+    for (int b = lo; b <= hi; b++) {
+        set_add(set, b);
+    }
+}
+
+static rx_node_t *rx_node(rx_parser_t *ps, int kind, rx_node_t *l, rx_node_t *r) {
+    rx_node_t *n = sf_arena_alloc(&ps->arena, sizeof(rx_node_t));
+
+    if (n == NULL) {
+        ps->err = SF_ERR_MEMORY;
+        return NULL;
+    }
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->l = l;
+    n->r = r;
+    return n;
+}
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Parses the escape after a backslash into set.  Returns the byte for a
+ * single byte escape, or -1 for a class such as \d.
+ */
+static int parse_escape(rx_parser_t *ps, uint64_t *set) {
+    uint64_t cls[4] = { 0 };
+    int negate = 0;
+
+    if (ps->p >= ps->end) {
+        ps->err = SF_ERR_ARGS;
+        return -1;
+    }
+    int c = *ps->p++;
+    switch (c) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        case 'x':
+            if (ps->end - ps->p < 2 || hex_digit(ps->p[0]) < 0 || hex_digit(ps->p[1]) < 0) {
+                ps->err = SF_ERR_ARGS;
+                return -1;
+            }
+            c = hex_digit(ps->p[0]) * 16 + hex_digit(ps->p[1]);
+            ps->p += 2;
+            break;
+        case 'D': negate = 1; /* fall through */
+        case 'd':
+            set_range(cls, '0', '9');
+            break;
+        case 'W': negate = 1; /* fall through */
+        case 'w':
+            set_range(cls, '0', '9');
+            set_range(cls, 'a', 'z');
+            set_range(cls, 'A', 'Z');
+            set_add(cls, '_');
+            break;
+        case 'S': negate = 1; /* fall through */
+        case 's':
+            set_range(cls, '\t', '\r');
+            set_add(cls, ' ');
+            break;
+        default:
+            break;      //any other escaped byte stands for itself
+    }
+
+    if (cls[0] | cls[1] | cls[2] | cls[3]) {
+        for (int k = 0; k < 4; k++) {
+            set[k] |= negate ? ~cls[k] : cls[k];
+        }
+        return -1;
+    }
+    set_add(set, c);
+    return c;
+}
+
+static rx_node_t *parse_class(rx_parser_t *ps) {
+    rx_node_t *n = rx_node(ps, RX_SET, NULL, NULL);
+    int negate = 0;
+    int first = 1;
+
+    if (n == NULL) {
+        return NULL;
+    }
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        int lo, hi;
+
+        first = 0;
+        if (*ps->p == '\\') {
+            ps->p++;
+            if ((lo = parse_escape(ps, n->set)) < 0) {
+                if (ps->err) return NULL;
+                continue;
+            }
+        } else {
+            lo = *ps->p++;
+        }
+
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\') {
+                uint64_t tmp[4] = { 0 };
+                ps->p++;
+                hi = parse_escape(ps, tmp);
+            } else {
+                hi = *ps->p++;
+            }
+            if (hi < lo) {
+                ps->err = SF_ERR_ARGS;
+                return NULL;
+            }
+            set_range(n->set, lo, hi);
+        } else {
+            set_add(n->set, lo);
+        }
+    }
+    if (ps->p >= ps->end) {
+        ps->err = SF_ERR_ARGS;      //no closing ]
+        return NULL;
+    }
+    ps->p++;
+
+    if (negate) {
+        for (int k = 0; k < 4; k++) {
+            n->set[k] = ~n->set[k];
+        }
+    }
+    return n;
+}
+
+static rx_node_t *parse_alt(rx_parser_t *ps);
+
+static rx_node_t *parse_atom(rx_parser_t *ps) {
+    int c = *ps->p++;
+    rx_node_t *n;
+
+    switch (c) {
+        case '(':
+            if (++ps->depth > RX_MAX_DEPTH) {
+                ps->err = SF_ERR_ARGS;
+                return NULL;
+            }
+            n = parse_alt(ps);
+            ps->depth--;
+            if (ps->err) {
+                return NULL;
+            }
+            if (ps->p >= ps->end || *ps->p != ')') {
+                ps->err = SF_ERR_ARGS;
+                return NULL;
+            }
+            ps->p++;
+            return n;
+        case '[':
+            return parse_class(ps);
+        case '*': case '+': case '?':       //nothing to repeat
+        case '^': case '$':                 //anchors are not supported
+            ps->err = SF_ERR_ARGS;
+            return NULL;
+        default:
+            break;
+    }
+
+    if ((n = rx_node(ps, RX_SET, NULL, NULL)) == NULL) {
+        return NULL;
+    }
+    if (c == '.') {
+        set_range(n->set, 0, 255);
+        n->set['\n' >> 6] &= ~(1ULL << '\n');
+    } else if (c == '\\') {
+        parse_escape(ps, n->set);
+    } else {
+        set_add(n->set, c);
+    }
+    return ps->err ? NULL : n;
+}
+
+// Parses {m}, {m,} or {m,n}.  Anything else leaves the '{' as a literal.
+static int parse_count(rx_parser_t *ps, int *min, int *max) {
+    const unsigned char *p = ps->p + 1;
+    long lo = 0, hi;
+
+    if (p >= ps->end || *p < '0' || *p > '9') {
+        return 0;
+    }
+    while (p < ps->end && *p >= '0' && *p <= '9' && lo <= SF_RX_MAX_REPEAT) {
+        lo = lo * 10 + (*p++ - '0');
+    }
+    hi = lo;
+    if (p < ps->end && *p == ',') {
+        p++;
+        hi = -1;
+        if (p < ps->end && *p >= '0' && *p <= '9') {
+            hi = 0;
+            while (p < ps->end && *p >= '0' && *p <= '9' && hi <= SF_RX_MAX_REPEAT) {
+                hi = hi * 10 + (*p++ - '0');
+            }
+        }
+    }
+    if (p >= ps->end || *p != '}') {
+        return 0;
+    }
+    if (lo > SF_RX_MAX_REPEAT || hi > SF_RX_MAX_REPEAT || (hi >= 0 && hi < lo)) {
+        ps->err = SF_ERR_ARGS;
+        return 0;
+    }
+    ps->p = p + 1;
+    *min = (int)lo;
+    *max = (int)hi;
+    return 1;
+}
+
+static rx_node_t *parse_repeat(rx_parser_t *ps) {
+    rx_node_t *n = parse_atom(ps);
+
+    while (n != NULL && ps->p < ps->end) {
+        int min, max;
+
+        switch (*ps->p) {
+            case '*': min = 0, max = -1; ps->p++; break;
+            case '+': min = 1, max = -1; ps->p++; break;
+            case '?': min = 0, max = 1; ps->p++; break;
+            case '{':
+                if (parse_count(ps, &min, &max)) {
+                    break;
+                }
+                return ps->err ? NULL : n;
+            default:
+                return n;
+        }
+        if ((n = rx_node(ps, RX_REPEAT, n, NULL)) != NULL) {
+            n->min = min;
+            n->max = max;
+        }
+    }
+    return n;
+}
+
+static rx_node_t *parse_cat(rx_parser_t *ps) {
+    rx_node_t *left = NULL;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        rx_node_t *n = parse_repeat(ps);
+        if (n == NULL) {
+            return NULL;
+        }
+        left = (left == NULL) ? n : rx_node(ps, RX_CAT, left, n);
+        if (left == NULL) {
+            return NULL;
+        }
+    }
+    return (left != NULL) ? left : rx_node(ps, RX_EMPTY, NULL, NULL);
+}
+
+static rx_node_t *parse_alt(rx_parser_t *ps) {
+    rx_node_t *left = parse_cat(ps);
+
+    while (left != NULL && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        rx_node_t *right = parse_cat(ps);
+        left = (right == NULL) ? NULL : rx_node(ps, RX_ALT, left, right);
+    }
+    return left;
+}
+
+/*
+ * NFA construction.  Each node is compiled with the instruction that
+ * follows it already known, so fragments never need patching.
+ */
+static int32_t nfa_add(rx_nfa_t *nfa, int op, int32_t out, int32_t out1) {
+    if (nfa->ninst == nfa->cap) {
+        if (nfa->cap >= SF_RX_MAX_INST) {
+            return SF_ERR_ARGS;
+        }
+        int32_t cap = nfa->cap ? nfa->cap * 2 : 64;
+        rx_inst_t *inst = realloc(nfa->inst, cap * sizeof(rx_inst_t));
+        if (inst == NULL) {
+            return SF_ERR_MEMORY;
+        }
+        nfa->inst = inst;
+        nfa->cap = cap;
+    }
+    rx_inst_t *in = &nfa->inst[nfa->ninst];
+    memset(in, 0, sizeof(*in));
+    in->op = (uint8_t)op;
+    in->out = out;
+    in->out1 = out1;
+    return nfa->ninst++;
+}
+
+/*
+ * The parser builds concatenations and alternations as left-leaning
+ * chains as long as the pattern, so they are flattened and compiled in a
+ * loop; only ( ) nesting, which the parser limits, is left to recursion.
+ */
+static int32_t nfa_compile(rx_nfa_t *nfa, const rx_node_t *n, int32_t next);
+
+static int32_t nfa_compile_chain(rx_nfa_t *nfa, const rx_node_t *n, int32_t next) {
+    size_t count = 1;
+    int32_t s = next;
+
+    for (const rx_node_t *c = n; c->kind == n->kind; c = c->l) {
+        count++;
+    }
+    const rx_node_t **items = malloc(count * sizeof(*items));
+    if (items == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    // items[0] is the leftmost operand
+    size_t k = count;
+    for (const rx_node_t *c = n; c->kind == n->kind; c = c->l) {
+        items[--k] = c->r;
+        if (c->l->kind != n->kind) {
+            items[--k] = c->l;
+        }
+    }
+
+    if (n->kind == RX_ALT) {
+        int32_t alt = -1;
+        for (k = 0; k < count && s >= 0; k++) {
+            if ((s = nfa_compile(nfa, items[k], next)) >= 0) {
+                alt = (alt < 0) ? s : nfa_add(nfa, RX_SPLIT, alt, s);
+                s = alt;
+            }
+        }
+    } else {
+        // Right to left, so each operand knows its successor
+        for (k = count; k-- > 0 && s >= 0;) {
+            s = nfa_compile(nfa, items[k], s);
+        }
+    }
+    free(items);
+    return s;
+}
+
+// Returns the first instruction of n, or a negative SF_ERR_* code
+static int32_t nfa_compile(rx_nfa_t *nfa, const rx_node_t *n, int32_t next) {
+    int32_t a, s;
+
+    switch (n->kind) {
+        case RX_EMPTY:
+            return next;
+
+        case RX_SET:
+            if ((s = nfa_add(nfa, RX_BYTE, next, -1)) >= 0) {
+                memcpy(nfa->inst[s].set, n->set, sizeof(n->set));
+            }
+            return s;
+
+        case RX_CAT:
+        case RX_ALT:
+            return nfa_compile_chain(nfa, n, next);
+
+        case RX_REPEAT:
+            s = next;
+            if (n->max < 0) {
+                // The loop instruction is created first so the body can
+                // jump back to it
+                if ((s = nfa_add(nfa, RX_SPLIT, -1, next)) < 0 ||
+                    (a = nfa_compile(nfa, n->l, s)) < 0) {
+                    return (s < 0) ? s : a;
+                }
+                nfa->inst[s].out = a;
+            } else {
+                for (int k = n->min; k < n->max; k++) {
+                    if ((a = nfa_compile(nfa, n->l, s)) < 0 ||
+                        (s = nfa_add(nfa, RX_SPLIT, a, next)) < 0) {
+                        return (a < 0) ? a : s;
+                    }
+                }
+            }
+            for (int k = 0; k < n->min; k++) {
+                if ((s = nfa_compile(nfa, n->l, s)) < 0) {
+                    return s;
+                }
+            }
+            return s;
+
+        default:
+            return SF_ERR_ARGS;
+    }
+}
+
+// Instruction 0 is always the RX_MATCH every path ends in
+static int nfa_build(rx_nfa_t *nfa, const rx_node_t *root) {
+    int32_t match = nfa_add(nfa, RX_MATCH, -1, -1);
+
+    if (match < 0) {
+        return match;
+    }
+    if ((nfa->start = nfa_compile(nfa, root, match)) < 0) {
+        return nfa->start;
+    }
+
+    // Reverse the split edges, counting sort style
+    int32_t *fill = malloc((size_t)nfa->ninst * sizeof(int32_t));
+    nfa->pred_off = calloc((size_t)nfa->ninst + 1, sizeof(int32_t));
+    nfa->pred = malloc(2 * (size_t)nfa->ninst * sizeof(int32_t));
+    if (fill == NULL || nfa->pred_off == NULL || nfa->pred == NULL) {
+        free(fill);
+        return SF_ERR_MEMORY;
+    }
+    for (int32_t i = 0; i < nfa->ninst; i++) {
+        if (nfa->inst[i].op == RX_SPLIT) {
+            nfa->pred_off[nfa->inst[i].out + 1]++;
+            nfa->pred_off[nfa->inst[i].out1 + 1]++;
+        }
+    }
+    for (int32_t i = 0; i < nfa->ninst; i++) {
+        nfa->pred_off[i + 1] += nfa->pred_off[i];
+        fill[i] = nfa->pred_off[i];
+    }
+    for (int32_t i = 0; i < nfa->ninst; i++) {
+        if (nfa->inst[i].op == RX_SPLIT) {
+            nfa->pred[fill[nfa->inst[i].out]++] = i;
+            nfa->pred[fill[nfa->inst[i].out1]++] = i;
+        }
+    }
+    free(fill);
+    return SF_OK;
+}
+
+/*
+ * Byte classes: every place where some instruction's byte set changes
+ * from b - 1 to b starts a new class, so bytes in one class are accepted
+ * by exactly the same instructions.
+ */
+static void build_classes(rx_t *rx) {
+    uint8_t boundary[256] = { 0 };
+    int cls = 0;
+
+    for (int32_t i = 0; i < rx->nfa.ninst; i++) {
+        const rx_inst_t *in = &rx->nfa.inst[i];
+        if (in->op != RX_BYTE) {
+            continue;
+        }
+        for (int b = 1; b < 256; b++) {
+            if (set_has(in->set, b) != set_has(in->set, b - 1)) {
+                boundary[b] = 1;
+            }
+        }
+    }
+    for (int b = 0; b < 256; b++) {
+        if (b > 0 && boundary[b]) {
+            cls++;
+            rx->class_rep[cls] = (uint8_t)b;
+        }
+        rx->class_of[b] = (uint8_t)cls;
+    }
+    rx->class_rep[0] = 0;
+    rx->nclasses = cls + 1;
+}
+
+/*
+ * Lazy DFAs.  A state is a sorted set of RX_BYTE and RX_MATCH
+ * instructions (splits are followed while the set is built), and a
+ * transition is computed the first time it is taken.
+ *
+ *   forward: the instructions the threads started at the match start are
+ *            waiting on.  Empty means no match can be longer.
+ *   live:    run backwards from the end of the text, the instructions
+ *            from which the rest of the text starts with a match.  A
+ *            match starts wherever the start instruction reaches one.
+ *
+ * Once SF_RX_CACHE_STATES states exist the whole cache is dropped and
+ * rebuilt from the current state on, so memory stays bounded and every
+ * byte still costs at most one set computation.
+ */
+static int dfa_init(rx_dfa_t *d, const rx_nfa_t *nfa, int live) {
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->live = live;
+    d->nslots = 2 * SF_RX_CACHE_STATES;
+    d->slots = malloc(d->nslots * sizeof(int32_t));
+    d->mark = calloc(nfa->ninst, sizeof(uint32_t));
+    d->stack = malloc((2 * (size_t)nfa->ninst + 1) * sizeof(int32_t));
+    d->scratch = malloc((size_t)nfa->ninst * sizeof(int32_t));
+    if (d->slots == NULL || d->mark == NULL || d->stack == NULL || d->scratch == NULL) {
+        return SF_ERR_MEMORY;
+    }
+    memset(d->slots, 0xff, d->nslots * sizeof(int32_t));
+    return SF_OK;
+}
+
+static void dfa_free(rx_dfa_t *d) {
+    free(d->trans);
+    free(d->flags);
+    free(d->set_off);
+    free(d->set_len);
+    free(d->pool);
+    free(d->slots);
+    free(d->mark);
+    free(d->stack);
+    free(d->scratch);
+    memset(d, 0, sizeof(*d));
+}
+
+static void dfa_flush(rx_dfa_t *d) {
+    d->nstates = 0;
+    d->pool_len = 0;
+    memset(d->slots, 0xff, d->nslots * sizeof(int32_t));
+    d->flushes++;
+}
+
+// Adds the closure of instruction s to scratch[*n]
+static void dfa_closure(rx_dfa_t *d, int32_t s, size_t *n) {
+    const rx_inst_t *inst = d->nfa->inst;
+    size_t top = 0;
+
+    d->stack[top++] = s;
+    while (top > 0) {
+        int32_t i = d->stack[--top];
+        if (i < 0 || d->mark[i] == d->gen) {
+            continue;
+        }
+        d->mark[i] = d->gen;
+        if (inst[i].op == RX_SPLIT) {
+            d->stack[top++] = inst[i].out1;
+            d->stack[top++] = inst[i].out;
+        } else {
+            d->scratch[(*n)++] = i;
+        }
+    }
+}
+
+// Marks every instruction whose closure contains a member of set
+static void dfa_reach(rx_dfa_t *d, const int32_t *set, size_t n) {
+    const rx_nfa_t *nfa = d->nfa;
+    size_t top = 0;
+
+    d->gen++;
+    for (size_t i = 0; i < n; i++) {
+        d->mark[set[i]] = d->gen;
+        d->stack[top++] = set[i];
+    }
+    while (top > 0) {
+        int32_t x = d->stack[--top];
+        for (int32_t k = nfa->pred_off[x]; k < nfa->pred_off[x + 1]; k++) {
+            int32_t p = nfa->pred[k];
+            if (d->mark[p] != d->gen) {
+                d->mark[p] = d->gen;
+                d->stack[top++] = p;
+            }
+        }
+    }
+}
+
+static int cmp_int32(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t hash_set(const int32_t *set, size_t n) {
+    uint64_t h = 14695981039346656037ULL ^ n;
+
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (uint32_t)set[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Returns the state for the set in scratch[0..n), adding it if it is
+ * new, RX_FULL if the cache has no room left, or SF_ERR_MEMORY.
+ */
+static int32_t dfa_intern(rx_dfa_t *d, int nclasses, size_t n) {
+    size_t mask = d->nslots - 1;
+    size_t slot;
+
+    qsort(d->scratch, n, sizeof(int32_t), cmp_int32);
+    for (slot = hash_set(d->scratch, n) & mask; d->slots[slot] >= 0; slot = (slot + 1) & mask) {
+        int32_t s = d->slots[slot];
+        if ((size_t)d->set_len[s] == n &&
+            memcmp(d->pool + d->set_off[s], d->scratch, n * sizeof(int32_t)) == 0) {
+            return s;
+        }
+    }
+    if (d->nstates == SF_RX_CACHE_STATES) {
+        return RX_FULL;
+    }
+
+    if (d->nstates == d->cap) {
+        int32_t cap = d->cap ? d->cap * 2 : 64;
+        int32_t *trans = realloc(d->trans, (size_t)cap * nclasses * sizeof(int32_t));
+        if (trans != NULL) d->trans = trans;
+        uint8_t *flags = realloc(d->flags, cap);
+        if (flags != NULL) d->flags = flags;
+        int32_t *off = realloc(d->set_off, cap * sizeof(int32_t));
+        if (off != NULL) d->set_off = off;
+        int32_t *len = realloc(d->set_len, cap * sizeof(int32_t));
+        if (len != NULL) d->set_len = len;
+        if (trans == NULL || flags == NULL || off == NULL || len == NULL) {
+            return SF_ERR_MEMORY;
+        }
+        d->cap = cap;
+    }
+    if (d->pool_len + n > d->pool_cap) {
+        size_t cap = d->pool_cap ? d->pool_cap : 1024;
+        while (cap < d->pool_len + n) {
+            cap *= 2;
+        }
+        int32_t *pool = realloc(d->pool, cap * sizeof(int32_t));
+        if (pool == NULL) {
+            return SF_ERR_MEMORY;
+        }
+        d->pool = pool;
+        d->pool_cap = cap;
+    }
+
+    int32_t s = d->nstates++;
+    memcpy(d->pool + d->pool_len, d->scratch, n * sizeof(int32_t));
+    d->set_off[s] = (int32_t)d->pool_len;
+    d->set_len[s] = (int32_t)n;
+    d->pool_len += n;
+    d->slots[slot] = s;
+    for (int c = 0; c < nclasses; c++) {
+        d->trans[(size_t)s * nclasses + c] = RX_UNKNOWN;
+    }
+
+    if (d->live) {
+        dfa_reach(d, d->pool + d->set_off[s], n);
+        d->flags[s] = (d->mark[d->nfa->start] == d->gen) ? RX_ACCEPT : 0;
+    } else {
+        // Instruction 0 is the match, so it sorts first
+        d->flags[s] = (n == 0) ? RX_DEAD : (d->scratch[0] == 0) ? RX_ACCEPT : 0;
+    }
+    return s;
+}
+
+// Interns scratch[0..n), flushing the cache once if it is full
+static int32_t dfa_intern_or_flush(rx_dfa_t *d, int nclasses, size_t n) {
+    int32_t s = dfa_intern(d, nclasses, n);
+
+    if (s == RX_FULL) {
+        dfa_flush(d);
+        s = dfa_intern(d, nclasses, n);
+    }
+    return s;
+}
+
+/*
+ * The forward DFA starts from the pattern's start instruction; the live
+ * one, at the end of the text, from just the match.
+ */
+static int32_t dfa_start(const rx_t *rx, rx_dfa_t *d) {
+    size_t n = 0;
+
+    if (d->live) {
+        d->scratch[n++] = 0;
+    } else {
+        d->gen++;
+        dfa_closure(d, d->nfa->start, &n);
+    }
+    return dfa_intern_or_flush(d, rx->nclasses, n);
+}
+
+// Computes and records the transition of state s on byte class cls
+static int32_t dfa_step(const rx_t *rx, rx_dfa_t *d, int32_t s, int cls) {
+    const rx_inst_t *inst = d->nfa->inst;
+    const int32_t *set = d->pool + d->set_off[s];
+    int b = rx->class_rep[cls];
+    size_t n = 0;
+
+    if (d->live) {
+        // The match, plus every instruction on b whose successor leads
+        // into the live set of the next position
+        dfa_reach(d, set, d->set_len[s]);
+        d->scratch[n++] = 0;
+        for (int32_t q = 1; q < d->nfa->ninst; q++) {
+            if (inst[q].op == RX_BYTE && set_has(inst[q].set, b) &&
+                d->mark[inst[q].out] == d->gen) {
+                d->scratch[n++] = q;
+            }
+        }
+    } else {
+        d->gen++;
+        for (int32_t k = 0; k < d->set_len[s]; k++) {
+            const rx_inst_t *in = &inst[set[k]];
+            if (in->op == RX_BYTE && set_has(in->set, b)) {
+                dfa_closure(d, in->out, &n);
+            }
+        }
+    }
+
+    int32_t t = dfa_intern(d, rx->nclasses, n);
+    if (t == RX_FULL) {
+        // s is gone after the flush, so this transition is not recorded
+        dfa_flush(d);
+        return dfa_intern(d, rx->nclasses, n);
+    }
+    if (t >= 0) {
+        d->trans[(size_t)s * rx->nclasses + cls] = t;
+    }
+    return t;
+}
+
+static inline int32_t dfa_next(const rx_t *rx, rx_dfa_t *d, int32_t s, unsigned char c) {
+    int cls = rx->class_of[c];
+    int32_t t = d->trans[(size_t)s * rx->nclasses + cls];
+
+    return (t >= 0) ? t : dfa_step(rx, d, s, cls);
+}
+
+/*
+ * rx_compile
+ *
+ * Compiles pattern (len bytes, NUL bytes allowed) for rx_replace.
+ *
+ * returns:  SF_OK, SF_ERR_ARGS for a malformed or too large pattern, or
+ *           SF_ERR_MEMORY
+ */
+int rx_compile(rx_t *rx, const char *pattern, size_t len) {
+    rx_parser_t ps = { (const unsigned char *)pattern, (const unsigned char *)pattern + len,
+                       { NULL, NULL, 0 }, 0, SF_OK };
+    int rc;
+
+    memset(rx, 0, sizeof(*rx));
+    rx_node_t *root = parse_alt(&ps);
+    if (root != NULL && ps.p < ps.end) {
+        ps.err = SF_ERR_ARGS;       //unbalanced )
+    }
+    rc = (root == NULL || ps.err) ? (ps.err ? ps.err : SF_ERR_MEMORY) : SF_OK;
+
+    if (rc == SF_OK) {
+        rc = nfa_build(&rx->nfa, root);
+    }
+    sf_arena_free(&ps.arena);
+    if (rc == SF_OK) {
+        build_classes(rx);
+        rc = dfa_init(&rx->fwd, &rx->nfa, 0);
+    }
+    if (rc == SF_OK) {
+        rc = dfa_init(&rx->live, &rx->nfa, 1);
+    }
+    if (rc != SF_OK) {
+        rx_free(rx);
+    }
+    return rc;
+}
+
+void rx_free(rx_t *rx) {
+    dfa_free(&rx->fwd);
+    dfa_free(&rx->live);
+    free(rx->nfa.inst);
+    free(rx->nfa.pred_off);
+    free(rx->nfa.pred);
+    memset(rx, 0, sizeof(*rx));
+}
+
+/*
+ * Matching.
+ *
+ * The backward pass runs the live DFA from the end of the text to the
+ * start, setting a bit for every position a match starts at and saving
+ * the live set at every RX_BLOCK_SZ boundary.  Matches are then taken
+ * leftmost first: the forward DFA runs from the next start bit for as
+ * long as some of its threads are in the live set of the position they
+ * have reached, which is exactly as long as a longer match is still
+ * possible.  So the forward scans never read far past the end of the
+ * match they find, and a replace over the whole text is linear.
+ *
+ * The live set is only compared after 1, 2, 4... bytes without a new
+ * accept, and the live states of a block are recomputed from its saved
+ * set the first time a scan reaches it.
+ */
+#define RX_BLOCK_SZ     (64 * 1024)
+
+typedef struct {
+    const unsigned char *text;
+    size_t     len;
+    uint64_t  *starts;          //bit j set when a match starts at j
+    size_t    *cp_off;          //live set at each block boundary, in cp_pool
+    int32_t   *cp_len;
+    int32_t   *cp_pool;
+    size_t     cp_pool_len;
+    size_t     cp_pool_cap;
+    size_t     block;           //block whose live states are in ids
+    int32_t   *ids;             //-1 where the cache flushed under us
+} rx_scan_t;
+
+static void scan_free(rx_scan_t *sc) {
+    free(sc->starts);
+    free(sc->cp_off);
+    free(sc->cp_len);
+    free(sc->cp_pool);
+    free(sc->ids);
+}
+
+static int save_checkpoint(rx_scan_t *sc, const rx_dfa_t *d, int32_t s, size_t m) {
+    size_t n = (size_t)d->set_len[s];
+
+    if (sc->cp_pool_len + n > sc->cp_pool_cap) {
+        size_t cap = sc->cp_pool_cap ? sc->cp_pool_cap : 1024;
+        while (cap < sc->cp_pool_len + n) {
+            cap *= 2;
+        }
+        int32_t *pool = realloc(sc->cp_pool, cap * sizeof(int32_t));
+        if (pool == NULL) {
+            return SF_ERR_MEMORY;
+        }
+        sc->cp_pool = pool;
+        sc->cp_pool_cap = cap;
+    }
+    memcpy(sc->cp_pool + sc->cp_pool_len, d->pool + d->set_off[s], n * sizeof(int32_t));
+    sc->cp_off[m] = sc->cp_pool_len;
+    sc->cp_len[m] = (int32_t)n;
+    sc->cp_pool_len += n;
+    return SF_OK;
+}
+
+static int scan_init(rx_t *rx, rx_scan_t *sc, const unsigned char *text, size_t len) {
+    rx_dfa_t *d = &rx->live;
+    size_t ncp = len / RX_BLOCK_SZ + 2;
+    int32_t s;
+
+    memset(sc, 0, sizeof(*sc));
+    sc->text = text;
+    sc->len = len;
+    sc->block = RX_NONE;
+    sc->starts = calloc((len >> 6) + 1, sizeof(uint64_t));
+    sc->cp_off = malloc(ncp * sizeof(size_t));
+    sc->cp_len = malloc(ncp * sizeof(int32_t));
+    sc->ids = malloc((RX_BLOCK_SZ + 1) * sizeof(int32_t));
+    if (sc->starts == NULL || sc->cp_off == NULL || sc->cp_len == NULL || sc->ids == NULL ||
+        (s = dfa_start(rx, d)) < 0) {
+        return SF_ERR_MEMORY;
+    }
+
+    // The end of the text is the top of the last block
+    if (save_checkpoint(sc, d, s, ncp - 1) != SF_OK ||
+        (len % RX_BLOCK_SZ == 0 && save_checkpoint(sc, d, s, len / RX_BLOCK_SZ) != SF_OK)) {
+        return SF_ERR_MEMORY;
+    }
+    if (d->flags[s] & RX_ACCEPT) {
+        sc->starts[len >> 6] |= 1ULL << (len & 63);
+    }
+    for (size_t j = len; j-- > 0;) {
+        if ((s = dfa_next(rx, d, s, text[j])) < 0) {
+            return SF_ERR_MEMORY;
+        }
+        if (d->flags[s] & RX_ACCEPT) {
+            sc->starts[j >> 6] |= 1ULL << (j & 63);
+        }
+        if (j % RX_BLOCK_SZ == 0 && save_checkpoint(sc, d, s, j / RX_BLOCK_SZ) != SF_OK) {
+            return SF_ERR_MEMORY;
+        }
+    }
+    return SF_OK;
+}
+
+// Live state at position p, or -1 when it is not known
+static int32_t live_at(rx_t *rx, rx_scan_t *sc, size_t p) {
+    rx_dfa_t *d = &rx->live;
+    size_t m = p / RX_BLOCK_SZ;
+    size_t base = m * RX_BLOCK_SZ;
+
+    if (sc->block != m) {
+        size_t top = (base + RX_BLOCK_SZ < sc->len) ? base + RX_BLOCK_SZ : sc->len;
+        size_t flushes = d->flushes;
+        size_t n = (size_t)sc->cp_len[m + 1];
+        int32_t s;
+
+        memcpy(d->scratch, sc->cp_pool + sc->cp_off[m + 1], n * sizeof(int32_t));
+        s = dfa_intern_or_flush(d, rx->nclasses, n);
+        sc->ids[top - base] = s;
+        for (size_t j = top; j-- > base;) {
+            s = (s < 0) ? s : dfa_next(rx, d, s, sc->text[j]);
+            if (d->flushes != flushes) {
+                // The states stored so far belong to the old cache
+                for (size_t k = j + 1; k <= top; k++) {
+                    sc->ids[k - base] = -1;
+                }
+                flushes = d->flushes;
+            }
+            sc->ids[j - base] = s;
+        }
+        sc->block = m;
+    }
+    return sc->ids[p - base];
+}
+
+// Whether a thread of forward state s at position p can still finish
+static int can_extend(rx_t *rx, rx_scan_t *sc, int32_t s, size_t p) {
+    int32_t l = live_at(rx, sc, p);
+
+    if (l < 0) {
+        return 1;
+    }
+    const int32_t *a = rx->fwd.pool + rx->fwd.set_off[s];
+    const int32_t *b = rx->live.pool + rx->live.set_off[l];
+    const int32_t *a_end = a + rx->fwd.set_len[s];
+    const int32_t *b_end = b + rx->live.set_len[l];
+
+    while (a < a_end && b < b_end) {
+        if (*a == *b) {
+            return 1;
+        }
+        if (*a < *b) {
+            a++;
+        } else {
+            b++;
+        }
+    }
+    return 0;
+}
+
+// End of the longest match starting at i, which the start bits say exists
+static size_t longest_from(rx_t *rx, rx_scan_t *sc, size_t i) {
+    rx_dfa_t *d = &rx->fwd;
+    int32_t s = dfa_start(rx, d);
+    size_t end = i;
+    size_t since = i;           //last accept, or the start
+
+    if (s < 0) {
+        return RX_NONE;
+    }
+    for (size_t j = i; j < sc->len; j++) {
+        if ((s = dfa_next(rx, d, s, sc->text[j])) < 0) {
+            return RX_NONE;
+        }
+        if (d->flags[s] & RX_DEAD) {
+            break;
+        }
+        if (d->flags[s] & RX_ACCEPT) {
+            end = since = j + 1;
+            continue;
+        }
+        size_t gap = j + 1 - since;
+        if ((gap & (gap - 1)) == 0 && !can_extend(rx, sc, s, j + 1)) {
+            break;
+        }
+    }
+    return end;
+}
+
+static size_t next_start(const uint64_t *starts, size_t from, size_t limit) {
+    size_t nwords = (limit + 63) >> 6;
+    size_t w = from >> 6;
+
+    if (from >= limit) {
+        return RX_NONE;
+    }
+    uint64_t bits = starts[w] & (~0ULL << (from & 63));
+    while (bits == 0) {
+        if (++w >= nwords) {
+            return RX_NONE;
+        }
+        bits = starts[w];
+    }
+    size_t i = (w << 6) + (size_t)__builtin_ctzll(bits);
+    return (i < limit) ? i : RX_NONE;
+}
+
+// Writes repl with & standing for the match; \& and \\ are literal
+static void emit_replacement(const char *repl, size_t repl_len, const char *match,
+                             size_t match_len, sf_out_buff_t *out) {
+    for (size_t i = 0; i < repl_len; i++) {
+        if (repl[i] == '&') {
+            sf_out_bytes(out, match, match_len);
+        } else if (repl[i] == '\\' && i + 1 < repl_len) {
+            char c = repl[++i];
+            sf_out_char(out, c == 'n' ? '\n' : c == 't' ? '\t' : c);
+        } else {
+            sf_out_char(out, repl[i]);
+        }
+    }
+}
+
+/*
+ * rx_replace
+ *
+ * Writes src to out with every leftmost-longest match of rx replaced.
+ * As in sed, an empty match right after a previous match is skipped.
+ *
+ * returns:  SF_OK, SF_ERR_MEMORY or the output's error
+ */
+int rx_replace(rx_t *rx, const char *src, size_t len, const char *repl, size_t repl_len,
+               sf_out_buff_t *out, size_t *nmatches) {
+    rx_scan_t sc;
+    size_t copied = 0;
+    size_t prev_end = RX_NONE;
+    size_t count = 0;
+    size_t i;
+
+    if (scan_init(rx, &sc, (const unsigned char *)src, len) != SF_OK) {
+        scan_free(&sc);
+        return SF_ERR_MEMORY;
+    }
+
+    for (i = next_start(sc.starts, 0, len + 1); i != RX_NONE; ) {
+        size_t end = longest_from(rx, &sc, i);
+        if (end == RX_NONE) {
+            scan_free(&sc);
+            return SF_ERR_MEMORY;
+        }
+        if (end == i && i == prev_end) {
+            i = next_start(sc.starts, i + 1, len + 1);
+            continue;
+        }
+
+        sf_out_bytes(out, src + copied, i - copied);
+        emit_replacement(repl, repl_len, src + i, end - i, out);
+        count++;
+        prev_end = end;
+        copied = end;
+        if (end == i) {
+            // An empty match: the byte after it is kept and skipped
+            if (i == len) {
+                break;
+            }
+            sf_out_char(out, src[i]);
+            copied = i + 1;
+        }
+        i = next_start(sc.starts, copied, len + 1);
+    }
+    sf_out_bytes(out, src + copied, len - copied);
+
+    scan_free(&sc);
+    *nmatches = count;
+    return out->err;
+}
+
+/*
+ * rx_replace_fd
+ *
+ * rx_replace over everything readable from fd.  Matches may span lines,
+ * so the input is mapped, or read whole when it is not a regular file.
+ */
+int rx_replace_fd(rx_t *rx, int fd, const char *repl, size_t repl_len, sf_out_buff_t *out,
+                  size_t *nmatches) {
+    struct stat st;
+    char *data;
+    size_t len;
+    int rc;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            rc = rx_replace(rx, data, (size_t)st.st_size, repl, repl_len, out, nmatches);
+            munmap(data, (size_t)st.st_size);
+            return rc;
+        }
+    }
+
+    rc = sf_read_fd(fd, &data, &len);
+    if (rc != SF_OK) {
+        return rc;
+    }
+    rc = rx_replace(rx, data, len, repl, repl_len, out, nmatches);
+    free(data);
+    return rc;
+}
@@ -1,4 +1,3 @@
-
 /*
 Name: Arijit Chakma
 Homework 1: CS283
@@ -8,6 +7,10 @@ Purpose: Text Line Processor utiltiy using C.
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sflib.h"
 
 
 #define BUFFER_SZ 50
@@ -23,72 +26,69 @@ int  setup_buff(char *, char *, int);
 int  count_words(char *, int, int);
 //add additional prototypes here
 void reverse_string(char *, int, int);
-void replace_string(char *buff, int len, int str_len, char *find, char *replace);
+int  replace_string(char *buff, int len, int str_len, char *find, char *replace);
+int  replace_all_string(char *buff, int len, int str_len, char *find, char *replace);
 void word_print(char *, int, int);
+int  utf8_op(char opt, char *buff, int len, int str_len);
+int  line_op(const char *line, size_t len, int nl, void *arg);
 
+static sf_out_buff_t std_out;     // buffered stdout shared by every mode
 
-int setup_buff(char *buff, char *user_str, int len) {
-    if (user_str == NULL || *user_str == '\0') {
-        return -2;
+// A write that failed anywhere along the way (ENOSPC, EPIPE...) fails the run
+static void flush_std_out(void) {
+    if (sf_out_flush(&std_out) != SF_OK) {
+        _exit(3);
     }
+}
 
-    char *src = user_str;
-    char *dest = buff;
-    int count = 0;
-    int space_flag = 1;  // Start as 1 to handle leading spaces
-    int actual_length = 0;
+/*
+ * The functions below keep the original fixed-buffer interface: a
+ * BUFFER_SZ byte buffer holding str_len bytes of text padded with '.'.
+ * The real work is done by the span kernels in libstringfun.
+ */
 
-    // Skips leading spaces
-    while (*src == ' ' || *src == '\t') {
-        src++;
-    }
+int setup_buff(char *buff, char *user_str, int len) {
+    size_t n;
 
-    while (*src != '\0') {
-        if (*src == ' ' || *src == '\t') {
-            // Only adds space if next character is not space/tab/null
-            char *next = src + 1;
-            while (*next == ' ' || *next == '\t') next++;
-            if (!space_flag && *next != '\0') {
-                if (count >= len) return -1;
-                *dest = ' ';
-                dest++;
-                count++;
-                actual_length = count;
-                space_flag = 1;
-            }
-        } else {
-            if (count >= len) return -1;
-            *dest = *src;
-            dest++;
-            count++;
-            actual_length = count;
-            space_flag = 0;
-        }
-        src++;
+    if (user_str == NULL || *user_str == '\0') {
+        return -2;
     }
-
-    // Fills remainder with dots
-    while (count < len) {
-        *dest = '.';
-        dest++;
-        count++;
+    if (sf_normalize(user_str, strlen(user_str), buff, len, &n) != SF_OK) {
+        return -1;
     }
 
-    return actual_length;
+    // Fills remainder with dots
+    memset(buff + n, '.', len - n);
+    return (int)n;
 }
 
 void print_buff(char *buff, int len) {
-    printf("Buffer:  [");
-    for (int i = 0; i < len; i++) {
-        putchar(*(buff + i));
-    }
-    printf("]\n"); 
+    sf_out_str(&std_out, "Buffer:  [");
+    sf_out_bytes(&std_out, buff, len);
+    sf_out_str(&std_out, "]\n");
 }
 
 
 void usage(char *exename){
-    printf("usage: %s [-h|c|r|w|x] \"string\" [other args]\n", exename);
-
+    static const char *forms[] = {
+        " [-h|c|r|w|x] \"string\" [other args]\n",
+        " -cu|-ru|-wu \"string\"\n",
+        " -c -j N file\n",
+        " -X \"string\" find replace\n",
+        " -X -j N find replace [file]\n",
+        " -m rules_file [file]\n",
+        " -e regex replacement [file]\n",
+        " -f file [-k K] [-j N]\n",
+        " -r --file file | --stream | --lines [file]\n",
+        " --normalize [file]\n",
+        " --lines -c|-r|-w|-cu|-ru|-wu|-x|-X [find replace] [file]\n",
+    };
+
+    for (size_t i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) {
+        sf_out_str(&std_out, i == 0 ? "usage: " : "       ");
+        sf_out_str(&std_out, exename);
+        sf_out_str(&std_out, forms[i]);
+    }
 }
 
 int count_words(char *buff, int len, int str_len) {
@@ -118,150 +118,206 @@ int count_words(char *buff, int len, int str_len) {
 
 void reverse_string(char *buff, int len, int str_len) {
     (void)len;
-    char *start = buff;
-    char *end = buff + str_len - 1;
-    char temp;
-
-    while (start < end) {
-        temp = *start;
-        *start = *end;
-        *end = temp;
-        start++;
-        end--;
-    }
+    sf_reverse(buff, str_len);
 }
 
 
 void word_print(char *buff, int len, int str_len) {
     (void)len;
-    printf("Word Print\n----------\n");
+    sf_out_str(&std_out, "Word Print\n----------\n");
 
     char *ptr = buff;
-    int word_count = 1;
-    int char_count = 0;
+    char *end = buff + str_len;
     int total_words = 0;
 
-    while (ptr < buff + str_len) {
-        if (*ptr != ' ' && *ptr != '.') {
-            if (char_count == 0) {
-                printf("%d. ", word_count);
-                total_words++;
-            }
-            putchar(*ptr);
-            char_count++;
-        } else {
-            if (char_count > 0) {
-                printf("(%d)\n", char_count);  // Removes space before parenthesis
-                word_count++;
-                char_count = 0;
-            }
+    while (ptr < end) {
+        if (*ptr == ' ' || *ptr == '.') {
+            ptr++;
+            continue;
         }
-        ptr++;
-    }
 
-    if (char_count > 0) {
-        printf("(%d)\n", char_count);  // Removes space before parenthesis
+        // Emit the whole word in one copy once its extent is known
+        char *word = ptr;
+        while (ptr < end && *ptr != ' ' && *ptr != '.') {
+            ptr++;
+        }
+        total_words++;
+        sf_out_int(&std_out, total_words);
+        sf_out_str(&std_out, ". ");
+        sf_out_bytes(&std_out, word, ptr - word);
+        sf_out_char(&std_out, '(');
+        sf_out_int(&std_out, ptr - word);
+        sf_out_str(&std_out, ")\n");
     }
-    printf("\n");  
-    printf("Number of words returned: %d\n", total_words);
+
+    sf_out_str(&std_out, "\nNumber of words returned: ");
+    sf_out_int(&std_out, total_words);
+    sf_out_char(&std_out, '\n');
 }
 
 
-void replace_string(char *buff, int len, int str_len, char *find, char *replace) {
-    char *ptr;
-    int find_len = 0, replace_len = 0;
-    
-    // Calculates find length
-    ptr = find;
-    while (*ptr != '\0') {
-        find_len++;
-        ptr++;
+/*
+ * utf8_op
+ *
+ * -cu, -ru and -wu: the same operations by code point, for text that is
+ * not plain ASCII.  Words are separated by ASCII or Unicode whitespace
+ * here, not by the '.' padding.
+ *
+ * returns:  0, or SF_ERR_ENCODING if the string is not valid UTF-8
+ */
+int utf8_op(char opt, char *buff, int len, int str_len) {
+    (void)len;
+    size_t n;
+
+    if (sf_utf8_validate(buff, str_len) != SF_OK) {
+        return SF_ERR_ENCODING;
     }
-    
-    // Calculates replace length
-    ptr = replace;
-    while (*ptr != '\0') {
-        replace_len++;
-        ptr++;
+    if (opt == 'c') {
+        sf_count_words_utf8(buff, str_len, &n);
+        sf_out_str(&std_out, "Word Count: ");
+        sf_out_uint(&std_out, n);
+        sf_out_char(&std_out, '\n');
+    } else if (opt == 'r') {
+        sf_reverse_utf8(buff, str_len);
+    } else {
+        sf_out_str(&std_out, "Word Print\n----------\n");
+        sf_print_words_utf8(buff, str_len, &std_out, &n);
+        sf_out_str(&std_out, "\nNumber of words returned: ");
+        sf_out_uint(&std_out, n);
+        sf_out_char(&std_out, '\n');
     }
-    
-    // Finds substring in buffer
-    char *match_start = NULL;
-    ptr = buff;
-    
-    while (ptr < buff + str_len) {
-        if (*ptr == *find) {
-            char *temp_find = find;
-            char *check = ptr;
-            int matched = 1;
-            
-            while (*temp_find != '\0' && check < buff + str_len) {
-                if (*check != *temp_find) {
-                    matched = 0;
-                    break;
+    return 0;
+}
+
+
+/*
+ * --lines: one operation applied to every line of a stream, so a log
+ * pipeline can push millions of lines through one process instead of
+ * starting stringfun per line.  There is no BUFFER_SZ limit and no dot
+ * padding here; each line gives one result line (-c, -r, -x, -X) or one
+ * word list (-w).
+ */
+typedef struct {
+    char        op;
+    int         utf8;
+    int         all;
+    const char *find;
+    size_t      find_len;
+    const char *repl;
+    size_t      repl_len;
+} line_job_t;
+
+int line_op(const char *line, size_t len, int nl, void *arg) {
+    line_job_t *job = arg;
+    size_t n;
+    char *dst;
+
+    if (job->utf8 && sf_utf8_validate(line, len) != SF_OK) {
+        return SF_ERR_ENCODING;
+    }
+    switch (job->op) {
+        case 'c':
+            if (job->utf8) {
+                sf_count_words_utf8(line, len, &n);
+            } else {
+                sf_count_words(line, len, &n);
+            }
+            sf_out_uint(&std_out, n);
+            break;
+
+        case 'r':
+            dst = sf_out_claim(&std_out, len);
+            if (dst == NULL) {
+                // Longer than the output block, only the byte reverse streams
+                if (job->utf8) {
+                    char *tmp = malloc(len);
+                    if (tmp == NULL) {
+                        return SF_ERR_MEMORY;
+                    }
+                    memcpy(tmp, line, len);
+                    sf_reverse_utf8(tmp, len);
+                    sf_out_bytes(&std_out, tmp, len);
+                    free(tmp);
+                } else {
+                    sf_reverse_out(line, len, &std_out);
                 }
-                temp_find++;
-                check++;
+            } else if (job->utf8) {
+                memcpy(dst, line, len);
+                sf_reverse_utf8(dst, len);
+            } else {
+                sf_reverse_copy(line, len, dst);
             }
-            
-            if (matched) {
-                match_start = ptr;
-                break;
+            break;
+
+        case 'w':
+            if (job->utf8) {
+                sf_print_words_utf8(line, len, &std_out, &n);
+            } else {
+                sf_print_words(line, len, &std_out, &n);
             }
-        }
-        ptr++;
+            return 0;   //the word list already ends in a newline
+
+        default:        //'x' and 'X'
+            for (const char *hit; (hit = sf_find(line, len, job->find, job->find_len)) != NULL;) {
+                sf_out_bytes(&std_out, line, hit - line);
+                sf_out_bytes(&std_out, job->repl, job->repl_len);
+                len -= (hit - line) + job->find_len;
+                line = hit + job->find_len;
+                if (!job->all) {
+                    break;
+                }
+            }
+            sf_out_bytes(&std_out, line, len);
+            break;
     }
-
-    if (!match_start) {
-        printf("error: Search string not found\n");
-        exit(3);  
+    if (nl) {
+        sf_out_char(&std_out, '\n');
     }
+    return 0;
+}
 
-    int new_len = str_len - find_len + replace_len;
 
-    if (new_len > len) {
-        printf("error: Replacement would exceed buffer size\n");
-        exit(3);  
+/*
+ * replace_string, replace_all_string
+ *
+ * Replace the first (or every) occurrence of find in the buffer and pad
+ * the rest with dots.  The result is built in a scratch copy so the
+ * buffer is left untouched when the replacement fails.
+ *
+ * returns:  number of replacements made, or the SF_ERR_* code from
+ *           sf_replace / sf_replace_all
+ */
+static int replace_in_buff(char *buff, int len, int str_len, char *find, char *replace,
+                           int all) {
+    char *tmp = malloc(len);
+    size_t n;
+    int rc;
+
+    if (tmp == NULL) {
+        return SF_ERR_MEMORY;
     }
-
-    // Moves characters manually
-    char *src = match_start + find_len;
-    char *dest = match_start + replace_len;
-    int shift = replace_len - find_len;
-    
-    if (shift < 0) { // Shifts left
-        while (src < buff + str_len) {
-            *dest = *src;
-            dest++;
-            src++;
-        }
-    } else if (shift > 0) { // Shifts right
-        char *end = buff + str_len - 1;
-        char *new_end = buff + new_len - 1;
-        
-        while (end >= src) {
-            *new_end = *end;
-            new_end--;
-            end--;
-        }
+    if (all) {
+        rc = sf_replace_all(buff, str_len, find, strlen(find), replace, strlen(replace),
+                            tmp, len, &n);
+    } else {
+        rc = sf_replace(buff, str_len, find, strlen(find), replace, strlen(replace),
+                        tmp, len, &n);
     }
-
-    // Copies replacement string
-    char *replace_ptr = replace;
-    ptr = match_start;
-    while (*replace_ptr != '\0') {
-        *ptr = *replace_ptr;
-        ptr++;
-        replace_ptr++;
+    if (rc >= 0) {
+        memcpy(buff, tmp, n);
+        memset(buff + n, '.', len - n);
     }
+    free(tmp);
+    return rc;
+}
 
-    // Fills remainder with dots
-    while (ptr < buff + len) {
-        *ptr = '.';
-        ptr++;
-    }
+int replace_string(char *buff, int len, int str_len, char *find, char *replace) {
+    return replace_in_buff(buff, len, str_len, find, replace, 0);
 }
 
+int replace_all_string(char *buff, int len, int str_len, char *find, char *replace) {
+    return replace_in_buff(buff, len, str_len, find, replace, 1);
+}
 
 
 int main(int argc, char *argv[]){
@@ -282,11 +338,90 @@ int main(int argc, char *argv[]){
         then the program will print the usage message and exit.
     */
 
+    if (sf_out_init(&std_out, STDOUT_FILENO, SF_OUT_BUFF_SZ) < 0) {
+        exit(2);
+    }
+    atexit(flush_std_out);     //every exit() path below flushes the output
+
     if ((argc < 2) || (*argv[1] != '-')){
         usage(argv[0]);
         exit(1);
     }
 
+    //--normalize [file] squeezes blanks in a file or stdin, line by line
+    if (strcmp(argv[1], "--normalize") == 0) {
+        int in_fd = STDIN_FILENO;
+
+        if (argc > 3) {
+            usage(argv[0]);
+            exit(1);
+        }
+        if (argc == 3 && (in_fd = open(argv[2], O_RDONLY)) < 0) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[2]);
+            sf_out_char(&std_out, '\n');
+            exit(3);
+        }
+        rc = sf_normalize_fd(in_fd, &std_out);
+        if (rc == SF_ERR_MEMORY) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+            exit(2);
+        }
+        exit(rc == SF_OK ? 0 : 3);
+    }
+
+    //--lines op [find replace] [file] runs one operation on every line
+    if (strcmp(argv[1], "--lines") == 0) {
+        line_job_t job = { 0 };
+        int in_fd = STDIN_FILENO;
+        int nargs;
+
+        if (argc < 3 || argv[2][0] != '-' || argv[2][1] == '\0' ||
+            strchr("crwxX", argv[2][1]) == NULL ||
+            (argv[2][2] != '\0' && (strcmp(argv[2] + 2, "u") != 0 ||
+                                    strchr("crw", argv[2][1]) == NULL))) {
+            usage(argv[0]);
+            exit(1);
+        }
+        job.op = argv[2][1];
+        job.utf8 = argv[2][2] == 'u';
+        nargs = 3;
+        if (job.op == 'x' || job.op == 'X') {
+            if (argc < 5 || argv[3][0] == '\0') {
+                usage(argv[0]);
+                exit(1);
+            }
+            job.all = job.op == 'X';
+            job.find = argv[3];
+            job.find_len = strlen(argv[3]);
+            job.repl = argv[4];
+            job.repl_len = strlen(argv[4]);
+            nargs = 5;
+        }
+        if (argc > nargs + 1) {
+            usage(argv[0]);
+            exit(1);
+        }
+        if (argc == nargs + 1 && (in_fd = open(argv[nargs], O_RDONLY)) < 0) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[nargs]);
+            sf_out_char(&std_out, '\n');
+            exit(3);
+        }
+
+        rc = sf_lines_fd(in_fd, line_op, &job);
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (rc == SF_ERR_ENCODING) {
+            sf_out_str(&std_out, "error: input is not valid UTF-8\n");
+        } else if (rc == SF_ERR_MEMORY) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+            exit(2);
+        }
+        exit(rc == SF_OK ? 0 : 3);
+    }
+
     opt = (char)*(argv[1]+1);   //get the option flag
 
     //handle the help flag and then exit normally
@@ -308,6 +443,208 @@ int main(int argc, char *argv[]){
         exit(1);
     }
 
+    //-c -j N file counts the words of a whole file using N threads
+    if (opt == 'c' && strcmp(argv[2], "-j") == 0) {
+        size_t words;
+
+        if (argc != 5 || atoi(argv[3]) < 1) {
+            usage(argv[0]);
+            exit(1);
+        }
+        rc = sf_count_words_file(argv[4], atoi(argv[3]), &words);
+        if (rc == SF_ERR_IO) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[4]);
+            sf_out_char(&std_out, '\n');
+            exit(3);
+        } else if (rc < 0) {
+            sf_out_str(&std_out, "error: could not start counting threads\n");
+            exit(3);
+        }
+        sf_out_str(&std_out, "Word Count: ");
+        sf_out_uint(&std_out, words);
+        sf_out_char(&std_out, '\n');
+        exit(0);
+    }
+
+    //-X -j N find replace [file] replaces all matches in a stream on N threads
+    if (opt == 'X' && strcmp(argv[2], "-j") == 0) {
+        int in_fd = STDIN_FILENO;
+        size_t matches;
+
+        if (argc < 6 || argc > 7 || atoi(argv[3]) < 1 || argv[4][0] == '\0') {
+            usage(argv[0]);
+            exit(1);
+        }
+        if (argc == 7 && (in_fd = open(argv[6], O_RDONLY)) < 0) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[6]);
+            sf_out_char(&std_out, '\n');
+            exit(3);
+        }
+        rc = sf_replace_all_fd(in_fd, argv[4], strlen(argv[4]), argv[5], strlen(argv[5]),
+                               atoi(argv[3]), &std_out, &matches);
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (rc == SF_ERR_THREAD) {
+            sf_out_str(&std_out, "error: could not start replace threads\n");
+        } else if (rc == SF_ERR_MEMORY) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+            exit(2);
+        }
+        exit(rc == SF_OK ? 0 : 3);
+    }
+
+    //-m rules [file] streams a file (or stdin) through all rules at once
+    if (opt == 'm') {
+        ac_automaton_t ac;
+        int in_fd = STDIN_FILENO;
+
+        if (argc > 4) {
+            usage(argv[0]);
+            exit(1);
+        }
+        rc = ac_load_rules(&ac, argv[2]);
+        if (rc == 0) {
+            rc = ac_compile(&ac);
+        }
+        if (rc == SF_ERR_IO) {
+            sf_out_str(&std_out, "error: cannot read rules file ");
+            sf_out_str(&std_out, argv[2]);
+            sf_out_char(&std_out, '\n');
+        } else if (rc == SF_ERR_ARGS) {
+            sf_out_str(&std_out, "error: rules must be \"find<TAB>replace\" lines\n");
+        } else if (rc < 0) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+        }
+        if (rc < 0) {
+            ac_free(&ac);
+            exit(rc == SF_ERR_MEMORY ? 2 : 3);
+        }
+
+        if (argc == 4 && (in_fd = open(argv[3], O_RDONLY)) < 0) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[3]);
+            sf_out_char(&std_out, '\n');
+            ac_free(&ac);
+            exit(3);
+        }
+        rc = ac_rewrite_fd(&ac, in_fd, &std_out);
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        ac_free(&ac);
+        if (rc < 0) {
+            exit(3);
+        }
+        exit(0);
+    }
+
+    //-e regex replacement [file] is a sed style s/regex/replacement/g
+    if (opt == 'e') {
+        rx_t rx;
+        size_t matches;
+        int in_fd = STDIN_FILENO;
+
+        if (argc < 4 || argc > 5) {
+            usage(argv[0]);
+            exit(1);
+        }
+        rc = rx_compile(&rx, argv[2], strlen(argv[2]));
+        if (rc == SF_ERR_ARGS) {
+            sf_out_str(&std_out, "error: invalid regular expression\n");
+            exit(3);
+        } else if (rc < 0) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+            exit(2);
+        }
+
+        if (argc == 5 && (in_fd = open(argv[4], O_RDONLY)) < 0) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[4]);
+            sf_out_char(&std_out, '\n');
+            rx_free(&rx);
+            exit(3);
+        }
+        rc = rx_replace_fd(&rx, in_fd, argv[3], strlen(argv[3]), &std_out, &matches);
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        rx_free(&rx);
+        if (rc == SF_ERR_MEMORY) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+            exit(2);
+        }
+        exit(rc == SF_OK ? 0 : 3);
+    }
+
+    //-f file [-k K] [-j N] prints the word frequency histogram of a file
+    if (opt == 'f') {
+        size_t top_k = 0;
+        int nthreads = 1;
+
+        for (int i = 3; i < argc; i += 2) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+            if (strcmp(argv[i], "-k") == 0) {
+                top_k = (size_t)atoi(argv[i + 1]);
+            } else if (strcmp(argv[i], "-j") == 0) {
+                nthreads = atoi(argv[i + 1]);
+            } else {
+                usage(argv[0]);
+                exit(1);
+            }
+        }
+
+        rc = sf_word_freq_file(argv[2], nthreads, top_k, &std_out);
+        if (rc == SF_ERR_IO) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, argv[2]);
+            sf_out_char(&std_out, '\n');
+        } else if (rc == SF_ERR_THREAD) {
+            sf_out_str(&std_out, "error: could not start counting threads\n");
+        } else if (rc == SF_ERR_MEMORY) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+        }
+        exit(rc == SF_OK ? 0 : (rc == SF_ERR_MEMORY ? 2 : 3));
+    }
+
+    //-r --file/--stream/--lines reverses a whole file, all of stdin, or
+    //every line of a file or stdin
+    if (opt == 'r' && strncmp(argv[2], "--", 2) == 0) {
+        int in_fd = STDIN_FILENO;
+        const char *path = NULL;
+
+        if (strcmp(argv[2], "--file") == 0 && argc == 4) {
+            path = argv[3];
+        } else if (strcmp(argv[2], "--lines") == 0 && argc <= 4) {
+            path = (argc == 4) ? argv[3] : NULL;
+        } else if (strcmp(argv[2], "--stream") != 0 || argc != 3) {
+            usage(argv[0]);
+            exit(1);
+        }
+        if (path != NULL && (in_fd = open(path, O_RDONLY)) < 0) {
+            sf_out_str(&std_out, "error: cannot read file ");
+            sf_out_str(&std_out, path);
+            sf_out_char(&std_out, '\n');
+            exit(3);
+        }
+
+        if (strcmp(argv[2], "--lines") == 0) {
+            rc = sf_reverse_lines_fd(in_fd, &std_out);
+        } else {
+            rc = sf_reverse_fd(in_fd, &std_out);
+        }
+        if (rc == SF_ERR_MEMORY) {
+            sf_out_str(&std_out, "Memory allocation failed\n");
+            exit(2);
+        }
+        exit(rc == SF_OK ? 0 : 3);
+    }
+
     input_string = argv[2]; //capture the user input string
 
     //TODO:  #3 Allocate space for the buffer using malloc and
@@ -318,31 +655,46 @@ int main(int argc, char *argv[]){
     buff = (char *)malloc(BUFFER_SZ * sizeof(char));
 
     if (buff == NULL) {
-        printf("Memory allocation failed\n");
+        sf_out_str(&std_out, "Memory allocation failed\n");
         exit(2);
     }
 
     user_str_len = setup_buff(buff, input_string, BUFFER_SZ);     //see todos
     
     if (user_str_len == -1) {
-        printf("Error: Provided input string is too long\n");
+        sf_out_str(&std_out, "Error: Provided input string is too long\n");
         free(buff);
         exit(3);
     } else if (user_str_len == -2) {
-        printf("Error: Empty input string\n");
+        sf_out_str(&std_out, "Error: Empty input string\n");
         free(buff);
         exit(2);
     }
 
+    //-cu, -ru and -wu work by code point
+    if (opt != '\0' && strchr("crw", opt) != NULL && strcmp(argv[1] + 2, "u") == 0) {
+        if (utf8_op(opt, buff, BUFFER_SZ, user_str_len) < 0) {
+            sf_out_str(&std_out, "error: input is not valid UTF-8\n");
+            free(buff);
+            exit(3);
+        }
+        print_buff(buff, BUFFER_SZ);
+        free(buff);
+        exit(0);
+    }
+
     switch (opt) {
         case 'c':
             rc = count_words(buff, BUFFER_SZ, user_str_len);
             if (rc < 0) {
-                printf("Error counting words, rc = %d", rc);
+                sf_out_str(&std_out, "Error counting words, rc = ");
+                sf_out_int(&std_out, rc);
                 free(buff);
                 exit(3);
             }
-            printf("Word Count: %d\n", rc);
+            sf_out_str(&std_out, "Word Count: ");
+            sf_out_int(&std_out, rc);
+            sf_out_char(&std_out, '\n');
             print_buff(buff, BUFFER_SZ);
             free(buff);
             exit(0);
@@ -363,13 +715,37 @@ int main(int argc, char *argv[]){
             break;
 
         case 'x':
+        case 'X':
             if (argc != 5) {
-                printf("error: -x requires exactly 2 additional arguments\n");
-                printf("Usage: %s -x \"string\" \"find\" \"replace\"\n", argv[0]);
+                sf_out_str(&std_out, "error: -");
+                sf_out_char(&std_out, opt);
+                sf_out_str(&std_out, " requires exactly 2 additional arguments\n");
+                sf_out_str(&std_out, "Usage: ");
+                sf_out_str(&std_out, argv[0]);
+                sf_out_str(&std_out, " -");
+                sf_out_char(&std_out, opt);
+                sf_out_str(&std_out, " \"string\" \"find\" \"replace\"\n");
                 free(buff);
                 exit(1);
             }
-            replace_string(buff, BUFFER_SZ, user_str_len, argv[3], argv[4]);
+            if (opt == 'x') {
+                rc = replace_string(buff, BUFFER_SZ, user_str_len, argv[3], argv[4]);
+            } else {
+                rc = replace_all_string(buff, BUFFER_SZ, user_str_len, argv[3], argv[4]);
+            }
+            if (rc == SF_ERR_NOT_FOUND || rc == SF_ERR_ARGS) {
+                sf_out_str(&std_out, "error: Search string not found\n");
+                free(buff);
+                exit(3);
+            } else if (rc == SF_ERR_NO_SPACE) {
+                sf_out_str(&std_out, "error: Replacement would exceed buffer size\n");
+                free(buff);
+                exit(3);
+            } else if (rc < 0) {
+                sf_out_str(&std_out, "Memory allocation failed\n");
+                free(buff);
+                exit(2);
+            }
             print_buff(buff, BUFFER_SZ);
             free(buff);
             exit(0);
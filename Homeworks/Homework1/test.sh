@@ -32,6 +32,14 @@ Buffer:  [There should be eight words in this sentence......]" ]
 Buffer:  [The strange spaces should be removed from this....]" ]
 }
 
+@test "newlines next to blanks are left alone" {
+    run ./stringfun -c "$(printf 'a \n b')"
+    [ "$status" -eq 0 ]
+    [ "$output" = "Word Count: 3
+Buffer:  [a 
+ b.............................................]" ]
+}
+
 @test "reverse" {
     run ./stringfun -r "Reversed sentences look very weird"
     [ "$status" -eq 0 ]
@@ -97,4 +105,159 @@ Buffer:  [Lets get a lot of words to test...................]" ]
     run ./stringfun -x "This is a super long string for testing my program" program  app
     [ "$output" = "Buffer:  [This is a super long string for testing my app....]" ] || 
     [ "$output" = "Not Implemented!" ]
-}
\ No newline at end of file
+}
+
+@test "parallel wordcount over a file" {
+    tmpfile=$(mktemp)
+    printf 'There should be\n eight  words\tin this sentence\n' > "$tmpfile"
+    run ./stringfun -c -j 4 "$tmpfile"
+    rm -f "$tmpfile"
+    [ "$status" -eq 0 ]
+    [ "$output" = "Word Count: 8" ]
+}
+
+@test "parallel wordcount joins words split across ranges" {
+    tmpfile=$(mktemp)
+    # 100-byte lines cut into four 100010-byte ranges: every cut is mid-word
+    yes "$(printf 'a%.0s' $(seq 97)) b" | head -c 400040 > "$tmpfile"
+    expected=$(wc -w < "$tmpfile")
+    run ./stringfun -c -j 4 "$tmpfile"
+    rm -f "$tmpfile"
+    [ "$status" -eq 0 ]
+    [ "$output" = "Word Count: $expected" ]
+}
+
+@test "parallel wordcount missing file" {
+    run ./stringfun -c -j 4 /no/such/file
+    [ "$status" -eq 3 ]
+}
+
+@test "replace all occurrences" {
+    run ./stringfun -X "a cat and a cat and a cat" cat dog
+    [ "$status" -eq 0 ]
+    [ "$output" = "Buffer:  [a dog and a dog and a dog.........................]" ]
+}
+
+@test "replace all not found" {
+    run ./stringfun -X "This is a a long string for testing" bad great
+    [ "$status" -eq 3 ]
+}
+
+@test "multi-pattern replace from rules file" {
+    rules=$(mktemp)
+    printf 'cat\tdog\nhe\tHE\nshe\tSHE\n' > "$rules"
+    run bash -c "echo 'she said the cat sat' | ./stringfun -m $rules"
+    rm -f "$rules"
+    [ "$status" -eq 0 ]
+    [ "$output" = "SHE said tHE dog sat" ]
+}
+
+@test "multi-pattern replace bad rules file" {
+    rules=$(mktemp)
+    printf 'no tab here\n' > "$rules"
+    run ./stringfun -m "$rules" /dev/null
+    rm -f "$rules"
+    [ "$status" -eq 3 ]
+}
+
+@test "word frequency histogram" {
+    tmpfile=$(mktemp)
+    printf 'the cat the dog\nthe cat\n a\n' > "$tmpfile"
+    run ./stringfun -f "$tmpfile" -k 2 -j 2
+    rm -f "$tmpfile"
+    [ "$status" -eq 0 ]
+    [ "$output" = "      3 the
+      2 cat" ]
+}
+
+@test "reverse each line" {
+    run bash -c "printf 'abc\nhello world\n' | ./stringfun -r --lines"
+    [ "$status" -eq 0 ]
+    [ "$output" = "cba
+dlrow olleh" ]
+}
+
+@test "reverse a whole file" {
+    tmpfile=$(mktemp)
+    printf 'Reversed sentences look very weird' > "$tmpfile"
+    run ./stringfun -r --file "$tmpfile"
+    rm -f "$tmpfile"
+    [ "$status" -eq 0 ]
+    [ "$output" = "driew yrev kool secnetnes desreveR" ]
+}
+
+@test "normalize whitespace stream" {
+    run bash -c "printf '  The   strange\t\tspaces  \n   should   go \n' | ./stringfun --normalize"
+    [ "$status" -eq 0 ]
+    [ "$output" = "The strange spaces
+should go" ]
+}
+
+@test "utf-8 reverse and word count" {
+    run ./stringfun -ru "héllo wörld 😀"
+    [ "$status" -eq 0 ]
+    [ "$output" = "Buffer:  [😀 dlröw olléh................................]" ]
+    run ./stringfun -cu "日本　語 ok"
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Word Count: 3" ]
+    run ./stringfun -wu $'bad \xc3('
+    [ "$status" -eq 3 ]
+}
+
+@test "regex replace" {
+    run bash -c "printf 'id=42 name=bob\nbaaac' | ./stringfun -e '[0-9]+|a*' '<&>'"
+    [ "$status" -eq 0 ]
+    [ "$output" = "<>i<>d<>=<42> <>n<a>m<>e<>=<>b<>o<>b<>
+<>b<aaa>c<>" ]
+    run ./stringfun -e '(ab' x /dev/null
+    [ "$status" -eq 3 ]
+}
+
+@test "line batch mode" {
+    run bash -c "printf 'one two\n  a b  c\nxAyA' | ./stringfun --lines -c"
+    [ "$status" -eq 0 ]
+    [ "$output" = "2
+3
+1" ]
+    run bash -c "printf 'xAyA\nAA\n' | ./stringfun --lines -X A bb"
+    [ "$status" -eq 0 ]
+    [ "$output" = "xbbybb
+bbbb" ]
+    run bash -c "printf 'ok\n\377\n' | ./stringfun --lines -ru"
+    [ "$status" -eq 3 ]
+}
+
+@test "parallel replace all" {
+    run bash -c "printf 'aaaaaaa the cat\n' | ./stringfun -X -j 3 aa b"
+    [ "$status" -eq 0 ]
+    [ "$output" = "bbba the cat" ]
+    run ./stringfun -X -j 2 a b /nonexistent
+    [ "$status" -eq 3 ]
+}
+
+@test "parallel replace all across chunk boundaries" {
+    tmpfile=$(mktemp)
+    yes x | tr -d '\n' | head -c 3670016 > "$tmpfile"
+    # 1 MiB chunks: one match straddles the first cut, one ends exactly on
+    # the second, and "aaa" on the third makes the match before the cut
+    # shift where the next chunk's first match starts
+    printf 'abcdef' | dd of="$tmpfile" bs=1 seek=1048573 conv=notrunc 2>/dev/null
+    printf 'abcdef' | dd of="$tmpfile" bs=1 seek=2097146 conv=notrunc 2>/dev/null
+    printf 'aaa' | dd of="$tmpfile" bs=1 seek=3145727 conv=notrunc 2>/dev/null
+    expected=$(sed 's/abcdef/longer text/g' "$tmpfile" | cksum)
+    run bash -c "./stringfun -X -j 4 abcdef 'longer text' $tmpfile | cksum"
+    [ "$status" -eq 0 ]
+    [ "$output" = "$expected" ]
+    expected=$(sed 's/aa/b/g' "$tmpfile" | cksum)
+    run bash -c "./stringfun -X -j 4 aa b $tmpfile | cksum"
+    rm -f "$tmpfile"
+    [ "$status" -eq 0 ]
+    [ "$output" = "$expected" ]
+}
+
+@test "failed output writes fail the run" {
+    run bash -c "./stringfun -c 'hello world' > /dev/full"
+    [ "$status" -eq 3 ]
+    run bash -c "yes hello | head -c 200000 | ./stringfun -r --stream > /dev/full"
+    [ "$status" -eq 3 ]
+}
@@ -30,26 +30,33 @@ typedef struct cmd_args{
 //with passing optional connection parameters. 
 
 void print_usage(const char *progname) {
-  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-h]\n", progname);
+  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-z] [-h]\n", progname);
+  printf("       %s -f script | -e \"command\"\n", progname);
   printf("  Default is to run %s in local mode\n", progname);
   printf("  -c            Run as client\n");
   printf("  -s            Run as server\n");
   printf("  -i IP         Set IP/Interface address (only valid with -c or -s)\n");
   printf("  -p PORT       Set port number (only valid with -c or -s)\n");
   printf("  -x            Enable threaded mode (only valid with -s)\n");
+  printf("  -f SCRIPT     Run the lines of SCRIPT (- for stdin) without prompts\n");
+  printf("  -e COMMAND    Run one command line without prompts\n");
+  printf("  -z            Spawn commands through a pre-forked helper (not with -c)\n");
   printf("  -h            Show this help message\n");
   exit(0);
 }
 
 void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
   int opt;
+  char *script = NULL;
+  int script_is_file = 0;
+  int use_zygote = 0;
   memset(cargs, 0, sizeof(cmd_args_t));
 
   //defaults
   cargs->mode = MODE_LCLI;
   cargs->port = RDSH_DEF_PORT;
 
-  while ((opt = getopt(argc, argv, "csi:p:xh")) != -1) {
+  while ((opt = getopt(argc, argv, "csi:p:xhf:e:z")) != -1) {
       switch (opt) {
           case 'c':
               if (cargs->mode != MODE_LCLI) {
@@ -93,6 +100,18 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
               }
               cargs->threaded_server = 1;
               break;
+          case 'f':
+          case 'e':
+              if (cargs->mode != MODE_LCLI || script != NULL) {
+                  fprintf(stderr, "Error: -f and -e only run locally, and only one of them\n");
+                  exit(EXIT_FAILURE);
+              }
+              script = optarg;
+              script_is_file = (opt == 'f');
+              break;
+          case 'z':
+              use_zygote = 1;
+              break;
           case 'h':
               print_usage(argv[0]);
               break;
@@ -105,6 +124,27 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
       fprintf(stderr, "Error: -x can only be used with -s\n");
       exit(EXIT_FAILURE);
   }
+
+  //The spawn helper has to be forked before the server starts threads
+  if (use_zygote) {
+      if (cargs->mode == MODE_SCLI) {
+          fprintf(stderr, "Error: -z cannot be used with -c\n");
+          exit(EXIT_FAILURE);
+      }
+      if (zygote_start() != OK) {
+          fprintf(stderr, "warning: spawn helper not started, spawning directly\n");
+      }
+  }
+
+  //Script mode runs from here so main's banners stay out of its output
+  if (script != NULL) {
+      if (cargs->mode != MODE_LCLI) {
+          fprintf(stderr, "Error: -f and -e only run locally\n");
+          exit(EXIT_FAILURE);
+      }
+      //Like sh, exit with the status of the last command line
+      exit(script_is_file ? exec_script(script) : exec_cmd_string(script));
+  }
 }
 
 
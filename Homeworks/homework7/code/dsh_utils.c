@@ -0,0 +1,572 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "dshlib.h"
+
+/*
+ * Utilities built into dsh: echo, printf, pwd, test/[, true and false.
+ * A command line that is just one of them runs inside the shell; as a
+ * pipeline stage spawn_cmd forks and runs it without an exec.  They
+ * write through a small fd buffer instead of stdio and never allocate,
+ * so running them in a child forked from the threaded rsh server is
+ * safe.  Each returns the exit status the external command would.
+ */
+#define UTIL_BUFF_SZ 4096
+
+typedef struct util_out {
+    int    fd;
+    size_t len;
+    char   buf[UTIL_BUFF_SZ];
+} util_out_t;
+
+static void util_flush(util_out_t *o) {
+    size_t done = 0;
+
+    while (done < o->len) {
+        ssize_t n = write(o->fd, o->buf + done, o->len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    o->len = 0;
+}
+
+static void util_put(util_out_t *o, const char *s, size_t n) {
+    while (n > 0) {
+        if (o->len == UTIL_BUFF_SZ) {
+            util_flush(o);
+        }
+        size_t room = UTIL_BUFF_SZ - o->len;
+        size_t take = (n < room) ? n : room;
+        memcpy(o->buf + o->len, s, take);
+        o->len += take;
+        s += take;
+        n -= take;
+    }
+}
+
+static void util_puts(util_out_t *o, const char *s) {
+    util_put(o, s, strlen(s));
+}
+
+/*
+ * Writes s with backslash escapes expanded, as echo -e and printf do.
+ * Returns 1 if a \c asked for the output to stop there.
+ */
+static int put_escaped(util_out_t *o, const char *s, int octal_needs_zero) {
+    for (; *s; s++) {
+        char c = *s;
+        if (c != '\\' || s[1] == '\0') {
+            util_put(o, &c, 1);
+            continue;
+        }
+        switch (*++s) {
+            case 'a':  c = '\a'; break;
+            case 'b':  c = '\b'; break;
+            case 'e':  c = 27;   break;
+            case 'f':  c = '\f'; break;
+            case 'n':  c = '\n'; break;
+            case 'r':  c = '\r'; break;
+            case 't':  c = '\t'; break;
+            case 'v':  c = '\v'; break;
+            case '\\': c = '\\'; break;
+            case 'c':  return 1;
+            default:
+                if (*s >= '0' && *s <= '7' && (*s == '0' || !octal_needs_zero)) {
+                    // \0nnn for echo, \nnn for printf
+                    int digits = (*s == '0' && octal_needs_zero) ? 4 : 3;
+                    int v = 0;
+                    if (*s == '0' && octal_needs_zero) {
+                        s++;
+                        digits--;
+                    }
+                    for (; digits > 0 && *s >= '0' && *s <= '7'; digits--, s++) {
+                        v = v * 8 + (*s - '0');
+                    }
+                    s--;
+                    c = (char)v;
+                } else {
+                    util_put(o, "\\", 1);
+                    c = *s;
+                }
+                break;
+        }
+        util_put(o, &c, 1);
+    }
+    return 0;
+}
+
+static int util_true(cmd_buff_t *cmd, util_out_t *o, int err_fd) {
+    (void)cmd; (void)o; (void)err_fd;
+    return 0;
+}
+
+static int util_false(cmd_buff_t *cmd, util_out_t *o, int err_fd) {
+    (void)cmd; (void)o; (void)err_fd;
+    return 1;
+}
+
+static int util_pwd(cmd_buff_t *cmd, util_out_t *o, int err_fd) {
+    char cwd[PATH_MAX];
+
+    (void)cmd;
+    if (!getcwd(cwd, sizeof(cwd))) {
+        dprintf(err_fd, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    util_puts(o, cwd);
+    util_put(o, "\n", 1);
+    return 0;
+}
+
+// echo [-neE] args..., like bash's: no escapes unless -e
+static int util_echo(cmd_buff_t *cmd, util_out_t *o, int err_fd) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+
+    (void)err_fd;
+    for (; i < cmd->argc && cmd->argv[i][0] == '-' && cmd->argv[i][1]; i++) {
+        const char *f = cmd->argv[i] + 1;
+        if (strspn(f, "neE") != strlen(f)) {
+            break;
+        }
+        for (; *f; f++) {
+            newline &= (*f != 'n');
+            escapes = (*f == 'e') ? 1 : (*f == 'E') ? 0 : escapes;
+        }
+    }
+    for (int first = i; i < cmd->argc; i++) {
+        if (i > first) {
+            util_put(o, " ", 1);
+        }
+        if (!escapes) {
+            util_puts(o, cmd->argv[i]);
+        } else if (put_escaped(o, cmd->argv[i], 1)) {
+            return 0;
+        }
+    }
+    if (newline) {
+        util_put(o, "\n", 1);
+    }
+    return 0;
+}
+
+// Numeric printf argument; 'c gives the character's code like sh
+static int printf_number(const char *arg, long long *v, int err_fd) {
+    char *end;
+
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *v = (unsigned char)arg[1];
+        return 0;
+    }
+    errno = 0;
+    *v = strtoll(arg, &end, 0);
+    if (*arg == '\0') {
+        return 0;
+    }
+    if (*end != '\0' || errno) {
+        dprintf(err_fd, "printf: %s: invalid number\n", arg);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * One printf conversion through the scratch buffer, or straight to the
+ * fd when a wide field does not fit in it
+ */
+#define PUT_FORMATTED(o, num, spec, value)                              \
+    do {                                                                \
+        if ((size_t)snprintf(num, sizeof(num), spec, value) < sizeof(num)) { \
+            util_puts(o, num);                                          \
+        } else {                                                        \
+            util_flush(o);                                              \
+            dprintf((o)->fd, spec, value);                              \
+        }                                                               \
+    } while (0)
+
+/*
+ * printf format [args...].  The format is reused until every argument
+ * is consumed; missing arguments read as "" or 0.
+ */
+static int util_printf(cmd_buff_t *cmd, util_out_t *o, int err_fd) {
+    char spec[32];
+    char num[512];
+    char first[2] = { 0, 0 };       // %c's character
+    int status = 0;
+    int next = 2;
+
+    if (cmd->argc < 2) {
+        dprintf(err_fd, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *fmt = cmd->argv[1];
+
+    do {
+        int used = 0;
+        for (const char *p = fmt; *p; p++) {
+            if (*p == '\\') {
+                char esc[5] = { '\\', p[1], 0 };
+                if (p[1] >= '0' && p[1] <= '7') {
+                    // up to three octal digits
+                    int k = 1;
+                    while (k < 4 && p[k] >= '0' && p[k] <= '7') {
+                        esc[k] = p[k];
+                        k++;
+                    }
+                    esc[k] = '\0';
+                    p += k - 1;
+                } else if (p[1]) {
+                    p++;
+                }
+                if (put_escaped(o, esc, 0)) {
+                    return status;
+                }
+                continue;
+            }
+            if (*p != '%') {
+                util_put(o, p, 1);
+                continue;
+            }
+            if (p[1] == '%') {
+                util_put(o, "%", 1);
+                p++;
+                continue;
+            }
+
+            // %[flags][width][.precision]conversion
+            size_t n = strspn(p + 1, "-+ #0");
+            n += strspn(p + 1 + n, "0123456789");
+            if (p[1 + n] == '.') {
+                n++;
+                n += strspn(p + 1 + n, "0123456789");
+            }
+            char conv = p[1 + n];
+            if (conv == '\0' || n + 5 > sizeof(spec)) {
+                dprintf(err_fd, "printf: %s: invalid format\n", fmt);
+                return 1;
+            }
+            const char *arg = (next < cmd->argc) ? cmd->argv[next++] : "";
+            used = 1;
+            memcpy(spec, p, n + 1);
+
+            switch (conv) {
+                case 's':
+                case 'c':
+                    if (conv == 'c') {
+                        first[0] = arg[0];
+                        arg = first;
+                    }
+                    spec[n + 1] = 's';
+                    spec[n + 2] = '\0';
+                    if (n == 0) {
+                        util_puts(o, arg);      // no width: skip the copy
+                    } else {
+                        PUT_FORMATTED(o, num, spec, arg);
+                    }
+                    break;
+                case 'b':
+                    if (put_escaped(o, arg, 1)) {
+                        return status;
+                    }
+                    break;
+                case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': {
+                    long long v;
+                    status |= printf_number(arg, &v, err_fd);
+                    spec[n + 1] = 'l';
+                    spec[n + 2] = 'l';
+                    spec[n + 3] = conv;
+                    spec[n + 4] = '\0';
+                    PUT_FORMATTED(o, num, spec, v);
+                    break;
+                }
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+                    char *end;
+                    double v = strtod(arg, &end);
+                    if (*end != '\0') {
+                        dprintf(err_fd, "printf: %s: invalid number\n", arg);
+                        status = 1;
+                    }
+                    spec[n + 1] = conv;
+                    spec[n + 2] = '\0';
+                    PUT_FORMATTED(o, num, spec, v);
+                    break;
+                }
+                default:
+                    dprintf(err_fd, "printf: %%%c: invalid directive\n", conv);
+                    return 1;
+            }
+            p += n + 1;
+        }
+        if (!used) {
+            break;
+        }
+    } while (next < cmd->argc);
+    return status;
+}
+
+/*
+ * test / [.  A small recursive descent parser over the arguments:
+ *   expr    := and ( -o and )*
+ *   and     := not ( -a not )*
+ *   not     := ! not | primary
+ *   primary := ( expr ) | unary-op word | word binary-op word | word
+ * Exit status 0 is true, 1 false and 2 a syntax error.
+ */
+typedef struct test_parser {
+    char **args;
+    int    n;
+    int    pos;
+    int    err;
+    int    err_fd;
+} test_parser_t;
+
+static const char *test_peek(test_parser_t *t, int ahead) {
+    return (t->pos + ahead < t->n) ? t->args[t->pos + ahead] : NULL;
+}
+
+static int test_is_binary(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le",
+                                 "-gt", "-ge", "-nt", "-ot", NULL };
+    for (int i = 0; op && ops[i]; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test_is_unary(const char *op) {
+    return op && op[0] == '-' && op[1] && !op[2] && strchr("bcdefghLnprsSwxz", op[1]);
+}
+
+static long long test_int(test_parser_t *t, const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (*s == '\0' || *end != '\0') {
+        dprintf(t->err_fd, "test: %s: integer expression expected\n", s);
+        t->err = 1;
+    }
+    return v;
+}
+
+static int test_unary(char op, const char *arg) {
+    struct stat st;
+
+    switch (op) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        default: break;
+    }
+    if (stat(arg, &st) != 0) {
+        return 0;
+    }
+    switch (op) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'f': return S_ISREG(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        default:  return 1;        // -e
+    }
+}
+
+static int test_binary(test_parser_t *t, const char *l, const char *op, const char *r) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(l, r) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(l, r) != 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0) {
+        struct stat a, b;
+        int have_a = (stat(l, &a) == 0);
+        int have_b = (stat(r, &b) == 0);
+        if (op[1] == 'o') {
+            struct stat tmp = a;
+            int tmp_have = have_a;
+            a = b;
+            have_a = have_b;
+            b = tmp;
+            have_b = tmp_have;
+        }
+        if (!have_a || !have_b) {
+            return have_a && !have_b;
+        }
+        return a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+               (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+    }
+
+    long long a = test_int(t, l);
+    long long b = test_int(t, r);
+    switch (op[1] * 256 + op[2]) {
+        case 'e' * 256 + 'q': return a == b;
+        case 'n' * 256 + 'e': return a != b;
+        case 'l' * 256 + 't': return a < b;
+        case 'l' * 256 + 'e': return a <= b;
+        case 'g' * 256 + 't': return a > b;
+        default:              return a >= b;
+    }
+}
+
+static int test_expr(test_parser_t *t);
+
+static int test_primary(test_parser_t *t) {
+    const char *w = test_peek(t, 0);
+
+    if (!w) {
+        t->err = 1;
+        return 0;
+    }
+    // A word followed by a binary operator and another word
+    if (test_is_binary(test_peek(t, 1)) && test_peek(t, 2)) {
+        t->pos += 3;
+        return test_binary(t, w, t->args[t->pos - 2], t->args[t->pos - 1]);
+    }
+    if (strcmp(w, "(") == 0 && test_peek(t, 1)) {
+        t->pos++;
+        int v = test_expr(t);
+        const char *close = test_peek(t, 0);
+        if (!close || strcmp(close, ")") != 0) {
+            t->err = 1;
+            return 0;
+        }
+        t->pos++;
+        return v;
+    }
+    if (test_is_unary(w) && test_peek(t, 1)) {
+        t->pos += 2;
+        return test_unary(w[1], t->args[t->pos - 1]);
+    }
+    t->pos++;
+    return w[0] != '\0';
+}
+
+static int test_not(test_parser_t *t) {
+    const char *w = test_peek(t, 0);
+
+    if (w && strcmp(w, "!") == 0 && test_peek(t, 1)) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(test_parser_t *t) {
+    int v = test_not(t);
+
+    while (test_peek(t, 0) && strcmp(test_peek(t, 0), "-a") == 0) {
+        t->pos++;
+        v = test_not(t) && v;
+    }
+    return v;
+}
+
+static int test_expr(test_parser_t *t) {
+    int v = test_and(t);
+
+    while (test_peek(t, 0) && strcmp(test_peek(t, 0), "-o") == 0) {
+        t->pos++;
+        v = test_and(t) || v;
+    }
+    return v;
+}
+
+static int util_test(cmd_buff_t *cmd, util_out_t *o, int err_fd) {
+    test_parser_t t = { cmd->argv + 1, cmd->argc - 1, 0, 0, err_fd };
+
+    (void)o;
+    if (strcmp(cmd->argv[0], "[") == 0) {
+        if (t.n == 0 || strcmp(t.args[t.n - 1], "]") != 0) {
+            dprintf(err_fd, "[: missing ]\n");
+            return 2;
+        }
+        t.n--;
+    }
+    if (t.n == 0) {
+        return 1;
+    }
+    int v = test_expr(&t);
+    if (!t.err && t.pos != t.n) {
+        dprintf(err_fd, "%s: %s: unexpected argument\n", cmd->argv[0], t.args[t.pos]);
+        return 2;
+    }
+    if (t.err) {
+        return 2;
+    }
+    return v ? 0 : 1;
+}
+
+typedef int (*util_fn)(cmd_buff_t *cmd, util_out_t *o, int err_fd);
+
+static const struct {
+    const char *name;
+    util_fn     fn;
+} utils[] = {
+    { "echo",   util_echo },
+    { "printf", util_printf },
+    { "pwd",    util_pwd },
+    { "test",   util_test },
+    { "[",      util_test },
+    { "true",   util_true },
+    { "false",  util_false },
+    { NULL,     NULL },
+};
+
+/*
+ * is_util
+ *
+ * Tells whether name is one of the built-in utilities; a name with a /
+ * always means the program on disk
+ */
+int is_util(const char *name) {
+    for (int i = 0; utils[i].name; i++) {
+        if (strcmp(name, utils[i].name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * run_util
+ *
+ * Runs the utility cmd names with stdout on out_fd and diagnostics on
+ * err_fd, and returns its exit status
+ */
+int run_util(cmd_buff_t *cmd, int out_fd, int err_fd) {
+    util_out_t out;
+
+    out.fd = out_fd;
+    out.len = 0;
+    for (int i = 0; utils[i].name; i++) {
+        if (strcmp(cmd->argv[0], utils[i].name) == 0) {
+            int status = utils[i].fn(cmd, &out, err_fd);
+            util_flush(&out);
+            return status;
+        }
+    }
+    return 127;
+}
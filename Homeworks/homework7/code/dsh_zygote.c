@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "dshlib.h"
+
+/*
+ * Spawn server ("zygote").  A helper process, forked while the shell is
+ * still small and single threaded, keeps ZY_POOL idle children that are
+ * already forked and only wait to be told what to exec.  To run a
+ * command the shell sends the helper the resolved path, its cwd and the
+ * argv over a Unix socket, with the stage's stdin, stdout and stderr as
+ * SCM_RIGHTS descriptors; the helper hands all of it to an idle child,
+ * which dup2s the descriptors, chdirs and execs, and the pid comes back
+ * once the exec has happened.  The fork is off the shell's path, and
+ * the pool is refilled after the reply.
+ *
+ * The children are created with CLONE_PARENT, so their parent is the
+ * shell, not the helper: the shell waits for them, opens pidfds and
+ * collects rusage exactly as for children it spawned itself.  The
+ * helper and the children run only this file's code, which uses no
+ * stdio and no malloc, so starting it from the threaded rsh server is
+ * also safe.  The children see the environment of the moment the
+ * helper was started.
+ */
+#define ZY_POOL     4
+#define ZY_MSG_MAX  (64 * 1024)     // larger requests are spawned directly
+
+typedef struct zy_req {
+    uint32_t argc;
+    uint32_t len;                   // of the strings: path, cwd, argv...
+} zy_req_t;
+
+typedef struct zy_reply {
+    pid_t pid;
+    int   err;                      // errno of a failed exec
+} zy_reply_t;
+
+static struct {
+    pthread_mutex_t lock;
+    int             sock;           // -1 while not running
+    pid_t           pid;
+} zygote = { PTHREAD_MUTEX_INITIALIZER, -1, 0 };
+
+// One message with up to 3 descriptors attached
+static int send_msg(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+    struct iovec iov = { (void *)buf, len };
+    union {
+        char           data[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (nfds > 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        mh.msg_control = ctl.data;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    ssize_t n;
+    while ((n = sendmsg(sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    return (n == (ssize_t)len) ? 0 : -1;
+}
+
+static ssize_t recv_msg(int sock, void *buf, size_t cap, int *fds, int *nfds) {
+    struct iovec iov = { buf, cap };
+    union {
+        char           data[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = ctl.data, .msg_controllen = sizeof(ctl.data) };
+    ssize_t n;
+
+    while ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    *nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); n > 0 && cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+        }
+    }
+    return n;
+}
+
+// Closes every descriptor from lowfd up
+static void close_from(int lowfd) {
+    if (syscall(SYS_close_range, lowfd, ~0U, 0) < 0) {
+        for (int fd = lowfd; fd < 1024; fd++) {
+            close(fd);
+        }
+    }
+}
+
+/*
+ * An idle child: waits on ctl (fd 3) for one request, execs it, and
+ * reports errno back if the exec fails.  A successful exec closes ctl,
+ * which is what the helper waits for.
+ */
+static void zygote_child(void) {
+    static char msg[ZY_MSG_MAX];
+    int fds[3];
+    int nfds;
+
+    ssize_t n = recv_msg(3, msg, sizeof(msg), fds, &nfds);
+    if (n < (ssize_t)sizeof(zy_req_t)) {
+        _exit(0);                   // the helper went away
+    }
+    zy_req_t req;
+    memcpy(&req, msg, sizeof(req));
+    char *path = msg + sizeof(req);
+    char *cwd = path + strlen(path) + 1;
+    char *argv[req.argc + 1];
+    char *p = cwd + strlen(cwd) + 1;
+    for (uint32_t i = 0; i < req.argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[req.argc] = NULL;
+
+    for (int i = 0; i < nfds && i < 3; i++) {
+        dup2(fds[i], i);            // dup2 clears close-on-exec on 0..2
+    }
+    for (int i = 0; i < nfds; i++) {
+        if (fds[i] > 3) {
+            close(fds[i]);
+        }
+    }
+    int err = 0;
+    if (chdir(cwd) == 0) {
+        execve(path, argv, environ);
+    }
+    err = errno;
+    send(3, &err, sizeof(err), MSG_NOSIGNAL);
+    _exit(127);
+}
+
+// Forks one idle child; returns its end of the control socket
+static int zygote_fork_child(pid_t *pid) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        return -1;
+    }
+    *pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+    if (*pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (*pid == 0) {
+        if (sv[1] != 3) {
+            dup3(sv[1], 3, O_CLOEXEC);
+        }
+        close_from(4);
+        zygote_child();
+    }
+    close(sv[1]);
+    return sv[0];
+}
+
+/*
+ * The helper's loop: forward each request to an idle child, reply with
+ * its pid once it has exec'd, then top the pool up again.  When the
+ * shell closes its side, the pids of the still idle children are sent
+ * back so it can reap them.
+ */
+static void zygote_main(int sock) {
+    static char msg[ZY_MSG_MAX];
+    int idle_ctl[ZY_POOL];
+    pid_t idle_pid[ZY_POOL];
+    int nidle = 0;
+
+    for (;;) {
+        while (nidle < ZY_POOL) {
+            idle_ctl[nidle] = zygote_fork_child(&idle_pid[nidle]);
+            if (idle_ctl[nidle] < 0) {
+                break;
+            }
+            nidle++;
+        }
+
+        int fds[3];
+        int nfds;
+        ssize_t n = recv_msg(sock, msg, sizeof(msg), fds, &nfds);
+        if (n <= 0) {
+            break;
+        }
+
+        zy_reply_t rep = { 0, 0 };
+        int ctl = -1;
+        if (nidle == 0) {
+            ctl = zygote_fork_child(&rep.pid);
+            rep.err = (ctl < 0) ? EAGAIN : 0;
+        } else {
+            nidle--;
+            ctl = idle_ctl[nidle];
+            rep.pid = idle_pid[nidle];
+        }
+        if (ctl >= 0) {
+            if (send_msg(ctl, msg, n, fds, nfds) < 0) {
+                rep.err = EPIPE;
+            } else if (read(ctl, &rep.err, sizeof(rep.err)) != sizeof(rep.err)) {
+                rep.err = 0;        // closed by the exec
+            }
+            close(ctl);
+        }
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        if (send(sock, &rep, sizeof(rep), MSG_NOSIGNAL) != sizeof(rep)) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < nidle; i++) {
+        close(idle_ctl[i]);
+    }
+    if (nidle > 0) {
+        send(sock, idle_pid, nidle * sizeof(pid_t), MSG_NOSIGNAL);
+    }
+    _exit(0);
+}
+
+/*
+ * zygote_start
+ *
+ * Starts the spawn server if it is not running yet
+ */
+int zygote_start(void) {
+    int sv[2];
+    int rc = OK;
+
+    pthread_mutex_lock(&zygote.lock);
+    if (zygote.sock >= 0) {
+        pthread_mutex_unlock(&zygote.lock);
+        return OK;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        pthread_mutex_unlock(&zygote.lock);
+        return ERR_EXEC_CMD;
+    }
+    fflush(NULL);
+    zygote.pid = fork();
+    if (zygote.pid == 0) {
+        // Keep nothing of the shell's: the children get their fds per request
+        int null_fd = open("/dev/null", O_RDWR);
+        for (int fd = 0; fd < 3 && null_fd >= 0; fd++) {
+            dup2(null_fd, fd);
+        }
+        if (sv[1] != 3) {
+            dup3(sv[1], 3, O_CLOEXEC);
+        }
+        close_from(4);
+        zygote_main(3);
+    }
+    close(sv[1]);
+    if (zygote.pid < 0) {
+        close(sv[0]);
+        rc = ERR_EXEC_CMD;
+    } else {
+        zygote.sock = sv[0];
+    }
+    pthread_mutex_unlock(&zygote.lock);
+    return rc;
+}
+
+/*
+ * zygote_stop
+ *
+ * Shuts the spawn server down and reaps it and its idle children
+ */
+void zygote_stop(void) {
+    pid_t idle[ZY_POOL];
+
+    pthread_mutex_lock(&zygote.lock);
+    if (zygote.sock >= 0) {
+        shutdown(zygote.sock, SHUT_WR);
+        ssize_t n = read(zygote.sock, idle, sizeof(idle));
+        for (ssize_t i = 0; i < n / (ssize_t)sizeof(pid_t); i++) {
+            waitpid(idle[i], NULL, 0);
+        }
+        close(zygote.sock);
+        waitpid(zygote.pid, NULL, 0);
+        zygote.sock = -1;
+        zygote.pid = 0;
+    }
+    pthread_mutex_unlock(&zygote.lock);
+}
+
+int zygote_running(void) {
+    return zygote.sock >= 0;
+}
+
+/*
+ * zygote_spawn
+ *
+ * Runs path with argv through the spawn server, with in_fd, out_fd and
+ * err_fd (-1: the shell's own) as its stdio.  Returns 0 and sets *pid,
+ * an errno value like posix_spawn, or -1 when the request cannot go
+ * through the server and should be spawned directly.
+ */
+int zygote_spawn(const char *path, char **argv, int in_fd, int out_fd, int err_fd, pid_t *pid) {
+    char cwd[PATH_MAX];
+    zy_req_t req = { 0, 0 };
+    zy_reply_t rep;
+    int fds[3] = { in_fd >= 0 ? in_fd : STDIN_FILENO,
+                   out_fd >= 0 ? out_fd : STDOUT_FILENO,
+                   err_fd >= 0 ? err_fd : STDERR_FILENO };
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return -1;
+    }
+    req.len = strlen(path) + 1 + strlen(cwd) + 1;
+    for (; argv[req.argc]; req.argc++) {
+        req.len += strlen(argv[req.argc]) + 1;
+        if (req.len > ZY_MSG_MAX - sizeof(req)) {
+            return -1;
+        }
+    }
+
+    char *msg = malloc(sizeof(req) + req.len);
+    if (!msg) {
+        return -1;
+    }
+    memcpy(msg, &req, sizeof(req));
+    char *p = msg + sizeof(req);
+    p = stpcpy(p, path) + 1;
+    p = stpcpy(p, cwd) + 1;
+    for (uint32_t i = 0; i < req.argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+
+    pthread_mutex_lock(&zygote.lock);
+    int ok = zygote.sock >= 0 &&
+             send_msg(zygote.sock, msg, sizeof(req) + req.len, fds, 3) == 0 &&
+             read(zygote.sock, &rep, sizeof(rep)) == sizeof(rep);
+    pthread_mutex_unlock(&zygote.lock);
+    free(msg);
+
+    if (!ok) {
+        return -1;
+    }
+    if (rep.err != 0) {
+        if (rep.pid > 0) {
+            waitpid(rep.pid, NULL, 0);
+        }
+        return rep.err;
+    }
+    *pid = rep.pid;
+    return 0;
+}
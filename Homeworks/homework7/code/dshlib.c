@@ -1,14 +1,94 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>  
 #include "dshlib.h"
 #include <errno.h>
 
+extern char **environ;
+
 extern void print_dragon(void);
+
+/*
+ * cmd_arena_alloc
+ *
+ * Hands out n bytes from the current block, moving on to the next kept
+ * block or adding a new one when it runs out.  Pointers stay valid until
+ * the next cmd_arena_reset.
+ */
+void *cmd_arena_alloc(cmd_arena_t *arena, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    
+    while (arena->cur && arena->used + n > arena->cur->cap) {
+        if (!arena->cur->next) {
+            break;
+        }
+        arena->cur = arena->cur->next;
+        arena->used = 0;
+    }
+    if (!arena->cur || arena->used + n > arena->cur->cap) {
+        size_t cap = (n > CMD_ARENA_BLOCK) ? n : CMD_ARENA_BLOCK;
+        cmd_arena_block_t *blk = malloc(sizeof(cmd_arena_block_t) + cap);
+        if (!blk) {
+            return NULL;
+        }
+        blk->next = NULL;
+        blk->cap = cap;
+        if (arena->cur) {
+            arena->cur->next = blk;
+        } else {
+            arena->head = blk;
+        }
+        arena->cur = blk;
+        arena->used = 0;
+    }
+    
+    void *p = arena->cur->data + arena->used;
+    arena->used += n;
+    return p;
+}
+
+/*
+ * cmd_arena_reset
+ *
+ * Gives back everything allocated since the last reset, keeping the blocks
+ */
+void cmd_arena_reset(cmd_arena_t *arena) {
+    arena->cur = arena->head;
+    arena->used = 0;
+}
+
+/*
+ * cmd_arena_release
+ *
+ * Frees the arena's blocks for good
+ */
+void cmd_arena_release(cmd_arena_t *arena) {
+    cmd_arena_block_t *blk = arena->head;
+    while (blk) {
+        cmd_arena_block_t *next = blk->next;
+        free(blk);
+        blk = next;
+    }
+    arena->head = NULL;
+    arena->cur = NULL;
+    arena->used = 0;
+}
+
 /*
  * alloc_cmd_buff
  *
@@ -18,8 +98,10 @@ int alloc_cmd_buff(cmd_buff_t *cmd_buff) {
     cmd_buff->argc = 0;
     cmd_buff->_cmd_buffer = NULL;
     
-    // Initialize argv array to NULL
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
+    // Start on the inline argv array
+    cmd_buff->argv = cmd_buff->argv_inline;
+    cmd_buff->argv_cap = CMD_ARGV_INLINE;
+    for (int i = 0; i < CMD_ARGV_INLINE; i++) {
         cmd_buff->argv[i] = NULL;
     }
     
@@ -35,13 +117,11 @@ int alloc_cmd_buff(cmd_buff_t *cmd_buff) {
 /*
  * free_cmd_buff
  *
- * Frees memory allocated for the command buffer
+ * Forgets the parsed command; the text it points into belongs to the
+ * command list's arena
  */
 int free_cmd_buff(cmd_buff_t *cmd_buff) {
-    if (cmd_buff->_cmd_buffer) {
-        free(cmd_buff->_cmd_buffer);
-        cmd_buff->_cmd_buffer = NULL;
-    }
+    cmd_buff->_cmd_buffer = NULL;
     
     for (int i = 0; i < cmd_buff->argc; i++) {
         cmd_buff->argv[i] = NULL;
@@ -62,7 +142,7 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff) {
         cmd_buff->_cmd_buffer[0] = '\0';
     }
     
-    for (int i = 0; i < CMD_ARGV_MAX; i++) {
+    for (int i = 0; i < cmd_buff->argv_cap; i++) {
         cmd_buff->argv[i] = NULL;
     }
     
@@ -70,128 +150,317 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff) {
 }
 
 /*
- * build_cmd_buff
+ * Lexer.  One left to right pass over the line turns it into words,
+ * pipes and redirections.  Each byte's class and the current state pick
+ * the action from lex_table, so every byte is looked at once and long
+ * generated lines parse in linear time.  Word text is written back into
+ * the line itself: dropping quotes and backslashes only ever shortens a
+ * word, so the write position never passes the read position.
+ *
+ * A trailing & runs the whole line in the background.
  *
- * Builds a command buffer from a command line
- * Handles redirection operators for extra credit
+ * Quoting works like sh: '...' is literal, "..." is literal except that
+ * \" and \\ are escapes, and a backslash outside quotes makes the next
+ * character literal.  Quotes can be mixed inside one word (a"b c"'d').
  */
-int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
-    size_t cmd_len = strlen(cmd_line);
-    
-    // Initialize redirection fields
-    cmd_buff->in_redir_type = REDIR_NONE;
-    cmd_buff->in_redir_file = NULL;
-    cmd_buff->out_redir_type = REDIR_NONE;
-    cmd_buff->out_redir_file = NULL;
-    
-    // Allocate memory for the command buffer
-    cmd_buff->_cmd_buffer = (char *)malloc(cmd_len + 1);
-    if (!cmd_buff->_cmd_buffer) {
-        return ERR_MEMORY;
+typedef enum {
+    LC_OTHER, LC_SPACE, LC_PIPE, LC_LT, LC_GT, LC_AMP, LC_SQUOTE, LC_DQUOTE, LC_BSLASH,
+    LC_NUL,
+    LC_NCLASSES
+} lex_class_t;
+
+typedef enum { LS_BLANK, LS_WORD, LS_SQUOTE, LS_DQUOTE, LS_NSTATES } lex_state_t;
+
+typedef enum {
+    LA_SKIP,        // drop the byte
+    LA_COPY,        // append the byte to the word
+    LA_QUOTE,       // drop an opening or closing quote
+    LA_ESCAPE,      // backslash outside quotes: next byte is literal
+    LA_DQ_ESCAPE,   // backslash in "...": only \" and \\ are escapes
+    LA_OPERATOR,    // | < > >> (ends the word before it)
+    LA_SPACE,       // blank that ends a word
+    LA_END,         // end of line
+    LA_UNCLOSED,    // end of line inside quotes
+} lex_action_t;
+
+#define LA_BEGIN 0x80   // flag: this byte starts a new word
+
+static const struct {
+    unsigned char action;
+    unsigned char next;
+} lex_table[LS_NSTATES][LC_NCLASSES] = {
+    [LS_BLANK] = {
+        [LC_OTHER]  = { LA_COPY | LA_BEGIN,     LS_WORD },
+        [LC_SPACE]  = { LA_SKIP,                LS_BLANK },
+        [LC_PIPE]   = { LA_OPERATOR,            LS_BLANK },
+        [LC_LT]     = { LA_OPERATOR,            LS_BLANK },
+        [LC_GT]     = { LA_OPERATOR,            LS_BLANK },
+        [LC_AMP]    = { LA_OPERATOR,            LS_BLANK },
+        [LC_SQUOTE] = { LA_QUOTE | LA_BEGIN,    LS_SQUOTE },
+        [LC_DQUOTE] = { LA_QUOTE | LA_BEGIN,    LS_DQUOTE },
+        [LC_BSLASH] = { LA_ESCAPE | LA_BEGIN,   LS_WORD },
+        [LC_NUL]    = { LA_END,                 LS_BLANK },
+    },
+    [LS_WORD] = {
+        [LC_OTHER]  = { LA_COPY,                LS_WORD },
+        [LC_SPACE]  = { LA_SPACE,               LS_BLANK },
+        [LC_PIPE]   = { LA_OPERATOR,            LS_BLANK },
+        [LC_LT]     = { LA_OPERATOR,            LS_BLANK },
+        [LC_GT]     = { LA_OPERATOR,            LS_BLANK },
+        [LC_AMP]    = { LA_OPERATOR,            LS_BLANK },
+        [LC_SQUOTE] = { LA_QUOTE,               LS_SQUOTE },
+        [LC_DQUOTE] = { LA_QUOTE,               LS_DQUOTE },
+        [LC_BSLASH] = { LA_ESCAPE,              LS_WORD },
+        [LC_NUL]    = { LA_END,                 LS_BLANK },
+    },
+    [LS_SQUOTE] = {
+        [LC_OTHER]  = { LA_COPY,                LS_SQUOTE },
+        [LC_SPACE]  = { LA_COPY,                LS_SQUOTE },
+        [LC_PIPE]   = { LA_COPY,                LS_SQUOTE },
+        [LC_LT]     = { LA_COPY,                LS_SQUOTE },
+        [LC_GT]     = { LA_COPY,                LS_SQUOTE },
+        [LC_AMP]    = { LA_COPY,                LS_SQUOTE },
+        [LC_SQUOTE] = { LA_QUOTE,               LS_WORD },
+        [LC_DQUOTE] = { LA_COPY,                LS_SQUOTE },
+        [LC_BSLASH] = { LA_COPY,                LS_SQUOTE },
+        [LC_NUL]    = { LA_UNCLOSED,            LS_SQUOTE },
+    },
+    [LS_DQUOTE] = {
+        [LC_OTHER]  = { LA_COPY,                LS_DQUOTE },
+        [LC_SPACE]  = { LA_COPY,                LS_DQUOTE },
+        [LC_PIPE]   = { LA_COPY,                LS_DQUOTE },
+        [LC_LT]     = { LA_COPY,                LS_DQUOTE },
+        [LC_GT]     = { LA_COPY,                LS_DQUOTE },
+        [LC_AMP]    = { LA_COPY,                LS_DQUOTE },
+        [LC_SQUOTE] = { LA_COPY,                LS_DQUOTE },
+        [LC_DQUOTE] = { LA_QUOTE,               LS_WORD },
+        [LC_BSLASH] = { LA_DQ_ESCAPE,           LS_DQUOTE },
+        [LC_NUL]    = { LA_UNCLOSED,            LS_DQUOTE },
+    },
+};
+
+static const unsigned char lex_class[256] = {
+    ['\0'] = LC_NUL,
+    [' '] = LC_SPACE, ['\t'] = LC_SPACE, ['\n'] = LC_SPACE,
+    ['\r'] = LC_SPACE, ['\v'] = LC_SPACE, ['\f'] = LC_SPACE,
+    [PIPE_CHAR] = LC_PIPE,
+    [REDIR_IN_CHAR] = LC_LT,
+    [REDIR_OUT_CHAR] = LC_GT,
+    [BG_CHAR] = LC_AMP,
+    ['\''] = LC_SQUOTE,
+    ['"'] = LC_DQUOTE,
+    ['\\'] = LC_BSLASH,
+};
+
+typedef enum {
+    TOK_WORD, TOK_PIPE, TOK_IN, TOK_OUT, TOK_APPEND, TOK_BG, TOK_END, TOK_UNCLOSED
+} tok_type_t;
+
+typedef struct {
+    char *r;                // next byte to read
+    char *w;                // where the current word's next byte goes
+    tok_type_t pending;     // operator that ended the last word, or TOK_END
+} lexer_t;
+
+static void lex_init(lexer_t *lex, char *line) {
+    lex->r = line;
+    lex->w = line;
+    lex->pending = TOK_END;
+}
+
+/*
+ * Consumes the operator at lex->r
+ */
+static tok_type_t lex_operator(lexer_t *lex) {
+    char c = *lex->r++;
+    if (c == PIPE_CHAR) {
+        return TOK_PIPE;
     }
-    
-    // Copy the command line to the buffer
-    strcpy(cmd_buff->_cmd_buffer, cmd_line);
-    
-    // Handle redirection (for extra credit)
-    char *in_redir = strchr(cmd_buff->_cmd_buffer, REDIR_IN_CHAR);
-    char *out_redir = strchr(cmd_buff->_cmd_buffer, REDIR_OUT_CHAR);
-    char *append_redir = strstr(cmd_buff->_cmd_buffer, ">>");
-    
-    // Check for append redirection first (since it contains '>')
-    if (append_redir) {
-        *append_redir = '\0';  // Terminate string at '>>'
-        append_redir += 2;     // Move past '>>'
-        
-        // Skip leading spaces
-        while (*append_redir && isspace(*append_redir)) {
-            append_redir++;
+    if (c == REDIR_IN_CHAR) {
+        return TOK_IN;
+    }
+    if (c == BG_CHAR) {
+        return TOK_BG;
+    }
+    if (*lex->r == REDIR_OUT_CHAR) {
+        lex->r++;
+        return TOK_APPEND;
+    }
+    return TOK_OUT;
+}
+
+/*
+ * lex_next
+ *
+ * Returns the next token; for TOK_WORD, *text is the word, NUL
+ * terminated in place.  TOK_END repeats once the line is used up.
+ */
+static tok_type_t lex_next(lexer_t *lex, char **text) {
+    lex_state_t state = LS_BLANK;
+    char *start = NULL;
+
+    if (lex->pending != TOK_END) {
+        tok_type_t tok = lex->pending;
+        lex->pending = TOK_END;
+        return tok;
+    }
+
+    for (;;) {
+        unsigned char c = (unsigned char)*lex->r;
+        unsigned char action = lex_table[state][lex_class[c]].action;
+
+        if (action & LA_BEGIN) {
+            lex->w = lex->r;
+            start = lex->w;
         }
-        
-        if (*append_redir) {
-            cmd_buff->out_redir_type = REDIR_APPEND;
-            cmd_buff->out_redir_file = append_redir;
-            
-            // Remove trailing spaces from the filename
-            char *end = append_redir + strlen(append_redir) - 1;
-            while (end > append_redir && isspace(*end)) {
-                *end = '\0';
-                end--;
-            }
-        } else {
-            printf(CMD_ERR_REDIR);
-            return ERR_CMD_ARGS_BAD;
+        state = lex_table[state][lex_class[c]].next;
+
+        switch (action & ~LA_BEGIN) {
+            case LA_SKIP:
+            case LA_QUOTE:
+                lex->r++;
+                break;
+
+            case LA_COPY:
+                *lex->w++ = *lex->r++;
+                break;
+
+            case LA_ESCAPE:
+                lex->r++;
+                if (*lex->r != '\0') {     // a trailing backslash is dropped
+                    *lex->w++ = *lex->r++;
+                }
+                break;
+
+            case LA_DQ_ESCAPE:
+                if (lex->r[1] == '"' || lex->r[1] == '\\') {
+                    lex->r++;
+                }
+                *lex->w++ = *lex->r++;
+                break;
+
+            case LA_OPERATOR:
+                if (start == NULL) {
+                    return lex_operator(lex);
+                }
+                // Read the operator before the NUL below can land on it
+                lex->pending = lex_operator(lex);
+                *lex->w = '\0';
+                *text = start;
+                return TOK_WORD;
+
+            case LA_SPACE:
+                lex->r++;
+                *lex->w = '\0';
+                *text = start;
+                return TOK_WORD;
+
+            case LA_END:
+                if (start == NULL) {
+                    return TOK_END;
+                }
+                *lex->w = '\0';
+                *text = start;
+                return TOK_WORD;
+
+            default:
+                return TOK_UNCLOSED;
         }
-        
-        // Reset out_redir since we handled append
-        out_redir = NULL;
     }
-    
-    // Handle output redirection
-    if (out_redir && !append_redir) {
-        *out_redir = '\0';  // Terminate string at '>'
-        out_redir++;        // Move past '>'
-        
-        // Skip leading spaces
-        while (*out_redir && isspace(*out_redir)) {
-            out_redir++;
+}
+
+/*
+ * Doubles cmd's argv, moving it into the arena
+ */
+static int grow_argv(cmd_buff_t *cmd, cmd_arena_t *arena) {
+    if (!arena) {
+        return ERR_CMD_OR_ARGS_TOO_BIG;
+    }
+    char **argv = cmd_arena_alloc(arena, 2 * cmd->argv_cap * sizeof(char *));
+    if (!argv) {
+        return ERR_MEMORY;
+    }
+    memcpy(argv, cmd->argv, cmd->argc * sizeof(char *));
+    cmd->argv = argv;
+    cmd->argv_cap *= 2;
+    return OK;
+}
+
+/*
+ * parse_cmd
+ *
+ * Fills cmd from tokens up to the next pipe, & or the end of the line
+ * and reports which one ended it in *last.  Arguments that do not fit
+ * inline spill into arena; without one they are an error.
+ */
+static int parse_cmd(lexer_t *lex, cmd_buff_t *cmd, cmd_arena_t *arena, tok_type_t *last) {
+    char *text;
+    tok_type_t tok;
+
+    while ((tok = lex_next(lex, &text)) != TOK_PIPE && tok != TOK_END && tok != TOK_BG) {
+        if (tok == TOK_UNCLOSED) {
+            printf(CMD_ERR_QUOTE);
+            return ERR_CMD_ARGS_BAD;
         }
-        
-        if (*out_redir) {
-            cmd_buff->out_redir_type = REDIR_OUT;
-            cmd_buff->out_redir_file = out_redir;
-            
-            // Remove trailing spaces from the filename
-            char *end = out_redir + strlen(out_redir) - 1;
-            while (end > out_redir && isspace(*end)) {
-                *end = '\0';
-                end--;
+        if (tok == TOK_WORD) {
+            if (cmd->argc + 1 >= cmd->argv_cap) {
+                int rc = grow_argv(cmd, arena);
+                if (rc != OK) {
+                    return rc;
+                }
             }
-        } else {
+            cmd->argv[cmd->argc++] = text;
+            continue;
+        }
+
+        // A redirection takes the next word as its file
+        if (lex_next(lex, &text) != TOK_WORD) {
             printf(CMD_ERR_REDIR);
             return ERR_CMD_ARGS_BAD;
         }
-    }
-    
-    // Handle input redirection
-    if (in_redir) {
-        *in_redir = '\0';  // Terminate string at '<'
-        in_redir++;        // Move past '<'
-        
-        // Skip leading spaces
-        while (*in_redir && isspace(*in_redir)) {
-            in_redir++;
-        }
-        
-        if (*in_redir) {
-            cmd_buff->in_redir_type = REDIR_IN;
-            cmd_buff->in_redir_file = in_redir;
-            
-            // Remove trailing spaces from the filename
-            char *end = in_redir + strlen(in_redir) - 1;
-            while (end > in_redir && isspace(*end)) {
-                *end = '\0';
-                end--;
-            }
+        if (tok == TOK_IN) {
+            cmd->in_redir_type = REDIR_IN;
+            cmd->in_redir_file = text;
         } else {
-            printf(CMD_ERR_REDIR);
-            return ERR_CMD_ARGS_BAD;
+            cmd->out_redir_type = (tok == TOK_APPEND) ? REDIR_APPEND : REDIR_OUT;
+            cmd->out_redir_file = text;
         }
     }
-    
-    // Tokenize the command line (without redirection parts)
-    char *token = strtok(cmd_buff->_cmd_buffer, " \t");
-    while (token != NULL && cmd_buff->argc < CMD_ARGV_MAX - 1) {
-        cmd_buff->argv[cmd_buff->argc++] = token;
-        token = strtok(NULL, " \t");
+    cmd->argv[cmd->argc] = NULL;
+    *last = tok;
+
+    // Redirections with nothing to run
+    if (cmd->argc == 0 && (cmd->in_redir_type != REDIR_NONE ||
+                           cmd->out_redir_type != REDIR_NONE)) {
+        printf(CMD_ERR_REDIR);
+        return ERR_CMD_ARGS_BAD;
     }
-    
-    // Ensure the last element of argv is NULL
-    cmd_buff->argv[cmd_buff->argc] = NULL;
-    
     return OK;
 }
 
+/*
+ * build_cmd_buff
+ *
+ * Builds a command buffer from a single command (no pipes)
+ * Handles quoting and redirection operators
+ * The line is tokenized in place, so it has to outlive cmd_buff, and
+ * with no arena to spill to the arguments must fit argv_inline
+ */
+int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
+    lexer_t lex;
+    tok_type_t last;
+
+    alloc_cmd_buff(cmd_buff);
+    cmd_buff->_cmd_buffer = cmd_line;
+    lex_init(&lex, cmd_line);
+
+    int rc = parse_cmd(&lex, cmd_buff, NULL, &last);
+    if (rc == OK && last != TOK_END) {
+        return ERR_CMD_ARGS_BAD;
+    }
+    return rc;
+}
+
 /*
  * close_cmd_buff
  *
@@ -201,80 +470,97 @@ int close_cmd_buff(cmd_buff_t *cmd_buff) {
     return free_cmd_buff(cmd_buff);
 }
 
+/*
+ * Doubles the command list, moving it into the arena.  Commands still on
+ * their inline argv have to be pointed at the moved copy.
+ */
+static int grow_cmd_list(command_list_t *clist) {
+    cmd_buff_t *cmds = cmd_arena_alloc(&clist->arena, 2 * clist->cap * sizeof(cmd_buff_t));
+    if (!cmds) {
+        return ERR_MEMORY;
+    }
+    memcpy(cmds, clist->commands, clist->num * sizeof(cmd_buff_t));
+    for (int i = 0; i < clist->num; i++) {
+        if (clist->commands[i].argv == clist->commands[i].argv_inline) {
+            cmds[i].argv = cmds[i].argv_inline;
+        }
+    }
+    clist->commands = cmds;
+    clist->cap *= 2;
+    return OK;
+}
+
 /*
  * build_cmd_list
  *
- * Builds a command list from a command line split by pipes
+ * Builds a command list from a command line split by pipes, in one pass
+ * of the lexer.  All the parsed text lives in clist's arena, which is
+ * reset first.
  */
 int build_cmd_list(char *cmd_line, command_list_t *clist) {
-    clist->num = 0;
+    return build_cmd_list_len(cmd_line, cmd_line ? strlen(cmd_line) : 0, clist);
+}
+
+/*
+ * build_cmd_list_len
+ *
+ * build_cmd_list for a line that is not NUL terminated, such as one
+ * line of a mapped script
+ */
+int build_cmd_list_len(const char *cmd_line, size_t line_len, command_list_t *clist) {
+    free_cmd_list(clist);
     
     // Handle empty input
-    if (!cmd_line || strlen(cmd_line) == 0) {
+    if (!cmd_line || line_len == 0) {
         printf("%s", CMD_WARN_NO_CMD);
         return WARN_NO_CMDS;
     }
     
-    // Make a copy of the command line
-    char *cmd_copy = strdup(cmd_line);
+    // Make a copy of the command line for the commands to point into
+    char *cmd_copy = cmd_arena_alloc(&clist->arena, line_len + 1);
     if (!cmd_copy) {
         return ERR_MEMORY;
     }
+    memcpy(cmd_copy, cmd_line, line_len);
+    cmd_copy[line_len] = '\0';
     
-    // Split the command line by pipes
-    char *cmd_ptr = cmd_copy;
-    char *pipe_pos;
+    lexer_t lex;
+    tok_type_t last = TOK_PIPE;
+    char *text;
     
-    while (cmd_ptr && *cmd_ptr) {
-        // Check if we've reached the maximum number of commands
-        if (clist->num >= CMD_MAX) {
-            printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
-            free(cmd_copy);
-            return ERR_TOO_MANY_COMMANDS;
-        }
-        
-        // Find the next pipe
-        pipe_pos = strchr(cmd_ptr, PIPE_CHAR);
-        if (pipe_pos) {
-            *pipe_pos = '\0';
-        }
-        
-        // Skip leading whitespace
-        while (*cmd_ptr && isspace(*cmd_ptr)) {
-            cmd_ptr++;
+    clist->background = 0;
+    lex_init(&lex, cmd_copy);
+    while (last == TOK_PIPE) {
+        // Parse straight into the next slot, spilling the list if it is full
+        if (clist->num == clist->cap) {
+            int rc = grow_cmd_list(clist);
+            if (rc != OK) {
+                return rc;
+            }
         }
+        cmd_buff_t *cmd = &clist->commands[clist->num];
+        alloc_cmd_buff(cmd);
+        cmd->_cmd_buffer = cmd_copy;
         
-        // Skip trailing whitespace
-        char *end = cmd_ptr + strlen(cmd_ptr) - 1;
-        while (end > cmd_ptr && isspace(*end)) {
-            *end = '\0';
-            end--;
+        int rc = parse_cmd(&lex, cmd, &clist->arena, &last);
+        if (rc != OK) {
+            return rc;
         }
         
         // Skip empty commands
-        if (*cmd_ptr) {
-            // Initialize the command buffer
-            alloc_cmd_buff(&clist->commands[clist->num]);
-            
-            // Build the command buffer
-            int rc = build_cmd_buff(cmd_ptr, &clist->commands[clist->num]);
-            if (rc != OK) {
-                free(cmd_copy);
-                return rc;
-            }
-            
+        if (cmd->argc > 0) {
             clist->num++;
         }
-        
-        // Move to the next command after the pipe
-        if (pipe_pos) {
-            cmd_ptr = pipe_pos + 1;
-        } else {
-            cmd_ptr = NULL;
-        }
     }
     
-    free(cmd_copy);
+    // & has to end the line
+    if (last == TOK_BG) {
+        if (clist->num == 0 || lex_next(&lex, &text) != TOK_END) {
+            printf(CMD_ERR_BG);
+            return ERR_CMD_ARGS_BAD;
+        }
+        clist->background = 1;
+    }
     
     if (clist->num == 0) {
         printf("%s", CMD_WARN_NO_CMD);
@@ -287,17 +573,39 @@ int build_cmd_list(char *cmd_line, command_list_t *clist) {
 /*
  * free_cmd_list
  *
- * Frees memory allocated for the command list
+ * Empties the command list after a line ran; the arena keeps its blocks
+ * for the next line
  */
 int free_cmd_list(command_list_t *cmd_lst) {
-    for (int i = 0; i < cmd_lst->num; i++) {
-        free_cmd_buff(&cmd_lst->commands[i]);
-    }
-    
     cmd_lst->num = 0;
+    cmd_lst->cap = CMD_INLINE;
+    cmd_lst->commands = cmd_lst->commands_inline;
+    cmd_arena_reset(&cmd_lst->arena);
     return OK;
 }
 
+/*
+ * init_cmd_list
+ *
+ * Sets up an empty command list with an empty arena
+ */
+int init_cmd_list(command_list_t *clist) {
+    clist->arena.head = NULL;
+    clist->arena.cur = NULL;
+    clist->arena.used = 0;
+    return free_cmd_list(clist);
+}
+
+/*
+ * release_cmd_list
+ *
+ * Frees the command list's arena once the shell is done with it
+ */
+void release_cmd_list(command_list_t *clist) {
+    free_cmd_list(clist);
+    cmd_arena_release(&clist->arena);
+}
+
 /*
  * match_command
  *
@@ -320,13 +628,52 @@ Built_In_Cmds match_command(const char *input) {
         return BI_CMD_CD;
     }
     
+    if (strcmp(input, "hash") == 0) {
+        return BI_CMD_HASH;
+    }
+    
+    if (strcmp(input, "jobs") == 0) {
+        return BI_CMD_JOBS;
+    }
+    
+    if (strcmp(input, "wait") == 0) {
+        return BI_CMD_WAIT;
+    }
+    
+    if (strcmp(input, "fg") == 0) {
+        return BI_CMD_FG;
+    }
+    
+    if (strcmp(input, "parallel") == 0) {
+        return BI_CMD_PARALLEL;
+    }
+    
+    if (strcmp(input, "set") == 0) {
+        return BI_CMD_SET;
+    }
+    
+    if (is_util(input)) {
+        return BI_CMD_UTIL;
+    }
+    
     return BI_NOT_BI;
 }
 
+/*
+ * Exit status of the last foreground command line, as sh keeps in $?.
+ * Scripts and -e exit with it.
+ */
+static int last_status;
+
+// A wait status as a shell exit status: the exit code, or 128 + signal
+static int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
 /*
  * exec_built_in_cmd
  *
- * Executes a built-in command
+ * Executes a built-in command and sets last_status from it
  */
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
     if (!cmd || cmd->argc == 0) {
@@ -342,9 +689,11 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
         
         case BI_CMD_DRAGON:
             print_dragon();
+            last_status = 0;
             return BI_EXECUTED;
         
         case BI_CMD_CD:
+            last_status = 0;
             if (cmd->argc < 2) {
                 // No argument, change to home directory
                 char *home = getenv("HOME");
@@ -355,210 +704,1835 @@ Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
                 // Change to specified directory
                 if (chdir(cmd->argv[1]) != 0) {
                     perror("cd");
+                    last_status = 1;
                 }
             }
             return BI_EXECUTED;
         
+        case BI_CMD_HASH:
+            last_status = (exec_hash_cmd(cmd) == OK) ? 0 : 1;
+            return BI_EXECUTED;
+        
+        case BI_CMD_JOBS:
+        case BI_CMD_WAIT:
+            last_status = (exec_job_cmd(bi_cmd, cmd) == OK) ? 0 : 1;
+            return BI_EXECUTED;
+        
+        case BI_CMD_FG:
+            // On success fg leaves the job's own status
+            if (exec_job_cmd(bi_cmd, cmd) != OK) {
+                last_status = 1;
+            }
+            return BI_EXECUTED;
+        
+        case BI_CMD_PARALLEL:
+            last_status = (exec_parallel_cmd(cmd) == OK) ? 0 : 1;
+            return BI_EXECUTED;
+        
+        case BI_CMD_SET:
+            last_status = (exec_set_cmd(cmd) == OK) ? 0 : 1;
+            return BI_EXECUTED;
+        
+        case BI_CMD_UTIL:
+            last_status = exec_util_cmd(cmd);
+            return BI_EXECUTED;
+        
         default:
             return BI_NOT_BI;
     }
 }
 
 /*
- * exec_cmd
+ * exec_util_cmd
  *
- * Executes a single command
- * Handles input/output redirection for extra credit
+ * Runs a built-in utility inside the shell, honouring its redirects,
+ * and returns its exit status
  */
-int exec_cmd(cmd_buff_t *cmd) {
-    if (!cmd || cmd->argc == 0) {
-        return ERR_CMD_ARGS_BAD;
-    }
+int exec_util_cmd(cmd_buff_t *cmd) {
+    int out_fd = STDOUT_FILENO;
     
-    // Check if it's a built-in command
-    Built_In_Cmds bi_result = exec_built_in_cmd(cmd);
-    if (bi_result == BI_CMD_EXIT) {
-        return OK_EXIT;
-    } else if (bi_result == BI_EXECUTED) {
-        return OK;
+    if (cmd->in_redir_type == REDIR_IN && access(cmd->in_redir_file, R_OK) != 0) {
+        fprintf(stderr, "%s: %s\n", cmd->in_redir_file, strerror(errno));
+        return 1;
     }
-    
-    // Fork a child process
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        perror("fork");
-        return ERR_EXEC_CMD;
-    } else if (pid == 0) {
-        // Child process
-        
-        // Handle input redirection
-        if (cmd->in_redir_type == REDIR_IN) {
-            fprintf(stderr, "DEBUG: Opening input file: '%s'\n", cmd->in_redir_file);
-            int fd = open(cmd->in_redir_file, O_RDONLY);
-            if (fd < 0) {
-                fprintf(stderr, "DEBUG: Failed to open input file: %s\n", strerror(errno));
-                perror("open input");
-                exit(EXIT_FAILURE);
-            }
-            fprintf(stderr, "DEBUG: Successfully opened input file, fd=%d\n", fd);
-            if (dup2(fd, STDIN_FILENO) < 0) {
-                perror("dup2 input");
-                exit(EXIT_FAILURE);
-            }
-            close(fd);
-        }
-        
-        // Handle output redirection
-        if (cmd->out_redir_type != REDIR_NONE) {
-            fprintf(stderr, "DEBUG: Opening output file: '%s', mode: %s\n", 
-                cmd->out_redir_file, 
-                cmd->out_redir_type == REDIR_APPEND ? "append" : "truncate");
-
-            int flags = O_WRONLY | O_CREAT;
-            if (cmd->out_redir_type == REDIR_APPEND) {
-                flags |= O_APPEND;
-            } else {
-                flags |= O_TRUNC;
-            }
-            
-            int fd = open(cmd->out_redir_file, flags, 0644);
-            if (fd < 0) {
-                perror("open output");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fd, STDOUT_FILENO) < 0) {
-                perror("dup2 output");
-                exit(EXIT_FAILURE);
-            }
-            close(fd);
+    if (cmd->out_redir_type != REDIR_NONE) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= (cmd->out_redir_type == REDIR_APPEND) ? O_APPEND : O_TRUNC;
+        out_fd = open(cmd->out_redir_file, flags, 0644);
+        if (out_fd < 0) {
+            fprintf(stderr, "%s: %s\n", cmd->out_redir_file, strerror(errno));
+            return 1;
         }
-        
-        execvp(cmd->argv[0], cmd->argv);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
-        return OK;
     }
+    
+    // The utility writes to the fd directly, after whatever we printed
+    fflush(stdout);
+    int status = run_util(cmd, out_fd, STDERR_FILENO);
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+    return status;
 }
 
 /*
- * execute_pipeline
- *
- * Executes a pipeline of commands
- * Handles input/output redirection for extra credit
+ * Command hash.  Resolving a bare command name the way execvp does means
+ * a failing execve for every PATH directory before the right one, on
+ * every command.  Instead the resolved path is remembered by name and
+ * the shell spawns it directly.  An entry found in PATH directory n can
+ * only go stale if PATH itself or one of directories 0..n changes, so a
+ * hit costs a strcmp of PATH and n + 1 stat calls; any change empties
+ * the whole table.  The rsh server spawns from several threads, hence
+ * the lock.
  */
-int execute_pipeline(command_list_t *clist) {
-    if (!clist || clist->num == 0) {
-        return WARN_NO_CMDS;
-    }
-    
-    // Check if it's a single command
-    if (clist->num == 1) {
-        return exec_cmd(&clist->commands[0]);
+#define CMD_HASH_BUCKETS 64
+
+typedef struct hash_entry {
+    struct hash_entry *next;
+    char              *name;
+    char              *path;
+    int                dir;         // index in cmd_hash.dirs it was found in
+    unsigned           hits;
+} hash_entry_t;
+
+static struct {
+    pthread_mutex_t  lock;
+    char            *path_env;      // PATH the table was filled under
+    char           **dirs;
+    struct timespec *mtimes;        // of each dir when the table was filled
+    int              ndirs;
+    hash_entry_t    *buckets[CMD_HASH_BUCKETS];
+} cmd_hash = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned hash_name(const char *name) {
+    unsigned h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
     }
+    return h % CMD_HASH_BUCKETS;
+}
+
+static void dir_mtime(const char *dir, struct timespec *ts) {
+    struct stat st;
+    if (stat(dir, &st) == 0) {
+        *ts = st.st_mtim;
+    } else {
+        ts->tv_sec = -1;
+        ts->tv_nsec = 0;
+    }
+}
+
+static void hash_reset_locked(void) {
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++) {
+        hash_entry_t *e = cmd_hash.buckets[i];
+        while (e) {
+            hash_entry_t *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        cmd_hash.buckets[i] = NULL;
+    }
+    for (int i = 0; i < cmd_hash.ndirs; i++) {
+        free(cmd_hash.dirs[i]);
+    }
+    free(cmd_hash.dirs);
+    free(cmd_hash.mtimes);
+    free(cmd_hash.path_env);
+    cmd_hash.dirs = NULL;
+    cmd_hash.mtimes = NULL;
+    cmd_hash.path_env = NULL;
+    cmd_hash.ndirs = 0;
+}
+
+/*
+ * Splits PATH into cmd_hash.dirs and snapshots their mtimes.  An empty
+ * component means the current directory, as it does for execvp.
+ */
+static int hash_load_path_locked(const char *path_env) {
+    int n = 1;
+    for (const char *p = path_env; *p; p++) {
+        n += (*p == ':');
+    }
+    cmd_hash.path_env = strdup(path_env);
+    cmd_hash.dirs = calloc(n, sizeof(char *));
+    cmd_hash.mtimes = calloc(n, sizeof(struct timespec));
+    if (!cmd_hash.path_env || !cmd_hash.dirs || !cmd_hash.mtimes) {
+        return ERR_MEMORY;
+    }
+
+    const char *start = path_env;
+    for (int i = 0; i < n; i++) {
+        const char *end = strchr(start, ':');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        cmd_hash.dirs[i] = (len == 0) ? strdup(".") : strndup(start, len);
+        if (!cmd_hash.dirs[i]) {
+            return ERR_MEMORY;
+        }
+        cmd_hash.ndirs++;
+        dir_mtime(cmd_hash.dirs[i], &cmd_hash.mtimes[i]);
+        start = end ? end + 1 : start + len;
+    }
+    return OK;
+}
+
+/*
+ * True if the table no longer matches PATH or if any of the first
+ * upto + 1 directories changed since it was filled.
+ */
+static int hash_stale_locked(const char *path_env, int upto) {
+    if (!cmd_hash.path_env || strcmp(cmd_hash.path_env, path_env) != 0) {
+        return 1;
+    }
+    for (int i = 0; i <= upto && i < cmd_hash.ndirs; i++) {
+        struct timespec ts;
+        dir_mtime(cmd_hash.dirs[i], &ts);
+        if (ts.tv_sec != cmd_hash.mtimes[i].tv_sec ||
+            ts.tv_nsec != cmd_hash.mtimes[i].tv_nsec) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * lookup_cmd
+ *
+ * Resolves a command name without a '/' to the absolute path execvp
+ * would run, from the hash when possible.  Names with a '/' are used
+ * as they are.
+ *
+ * returns:  OK with the result in path, ERR_EXEC_CMD if no PATH
+ *           directory has such an executable, ERR_MEMORY
+ */
+int lookup_cmd(const char *name, char *path, size_t cap) {
+    const char *path_env = getenv("PATH");
+    unsigned b = hash_name(name);
+    int rc = ERR_EXEC_CMD;
+
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, cap, "%s", name);
+        return OK;
+    }
+    if (path_env == NULL) {
+        path_env = "/bin:/usr/bin";
+    }
+
+    pthread_mutex_lock(&cmd_hash.lock);
+    hash_entry_t *e = cmd_hash.buckets[b];
+    while (e && strcmp(e->name, name) != 0) {
+        e = e->next;
+    }
+    if (hash_stale_locked(path_env, e ? e->dir : -1)) {
+        hash_reset_locked();
+        e = NULL;
+        if (hash_load_path_locked(path_env) != OK) {
+            hash_reset_locked();
+            pthread_mutex_unlock(&cmd_hash.lock);
+            return ERR_MEMORY;
+        }
+    }
+
+    if (e == NULL) {
+        for (int i = 0; i < cmd_hash.ndirs; i++) {
+            struct stat st;
+            snprintf(path, cap, "%s/%s", cmd_hash.dirs[i], name);
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || access(path, X_OK) != 0) {
+                continue;
+            }
+            e = malloc(sizeof(hash_entry_t));
+            if (e) {
+                e->name = strdup(name);
+                e->path = strdup(path);
+            }
+            if (!e || !e->name || !e->path) {
+                if (e) {
+                    free(e->name);
+                    free(e->path);
+                    free(e);
+                }
+                pthread_mutex_unlock(&cmd_hash.lock);
+                return ERR_MEMORY;
+            }
+            e->dir = i;
+            e->hits = 0;
+            e->next = cmd_hash.buckets[b];
+            cmd_hash.buckets[b] = e;
+            break;
+        }
+    }
+    if (e) {
+        e->hits++;
+        snprintf(path, cap, "%s", e->path);
+        rc = OK;
+    }
+    pthread_mutex_unlock(&cmd_hash.lock);
+    return rc;
+}
+
+/*
+ * forget_cmd
+ *
+ * Drops one name from the hash, e.g. after its binary went away.
+ */
+void forget_cmd(const char *name) {
+    pthread_mutex_lock(&cmd_hash.lock);
+    hash_entry_t **link = &cmd_hash.buckets[hash_name(name)];
+    while (*link) {
+        hash_entry_t *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            break;
+        }
+        link = &e->next;
+    }
+    pthread_mutex_unlock(&cmd_hash.lock);
+}
+
+/*
+ * exec_hash_cmd
+ *
+ * The hash built-in: "hash" lists the remembered commands with their
+ * hit counts, "hash -r" forgets them all and "hash name..." looks the
+ * names up and remembers them without running anything.
+ */
+int exec_hash_cmd(cmd_buff_t *cmd) {
+    char path[PATH_MAX];
+    int rc = OK;
+
+    if (cmd->argc == 2 && strcmp(cmd->argv[1], "-r") == 0) {
+        pthread_mutex_lock(&cmd_hash.lock);
+        hash_reset_locked();
+        pthread_mutex_unlock(&cmd_hash.lock);
+        return OK;
+    }
+    if (cmd->argc > 1) {
+        for (int i = 1; i < cmd->argc; i++) {
+            if (lookup_cmd(cmd->argv[i], path, sizeof(path)) != OK) {
+                fprintf(stderr, "hash: %s: not found\n", cmd->argv[i]);
+                rc = ERR_EXEC_CMD;
+            }
+        }
+        return rc;
+    }
+
+    pthread_mutex_lock(&cmd_hash.lock);
+    int any = 0;
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++) {
+        for (hash_entry_t *e = cmd_hash.buckets[i]; e; e = e->next) {
+            if (!any) {
+                printf("hits\tcommand\n");
+                any = 1;
+            }
+            printf("%4u\t%s\n", e->hits, e->path);
+        }
+    }
+    if (!any) {
+        printf("hash: hash table empty\n");
+    }
+    pthread_mutex_unlock(&cmd_hash.lock);
+    fflush(stdout);
+    return OK;
+}
+
+/*
+ * Starts the program at path, through the spawn server when it runs
+ * (see dsh_zygote.c) and with posix_spawn otherwise
+ */
+static int spawn_path(const char *path, cmd_buff_t *cmd, posix_spawn_file_actions_t *fa,
+                      int in_fd, int out_fd, int err_fd, pid_t *pid) {
+    if (zygote_running()) {
+        int rc = zygote_spawn(path, cmd->argv, in_fd, out_fd, err_fd, pid);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
+    return posix_spawn(pid, path, fa, NULL, cmd->argv, environ);
+}
+
+/*
+ * Forks a pipeline stage that is a built-in utility.  There is no exec
+ * to drop the shell's close-on-exec descriptors, so the child closes
+ * everything past stderr itself; otherwise it would keep its own pipe's
+ * read end open and never see a broken pipe.
+ */
+static int spawn_util(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd, pid_t *pid) {
+    int fds[3] = { in_fd, out_fd, err_fd };
+    
+    *pid = fork();
+    if (*pid < 0) {
+        return errno;
+    }
+    if (*pid > 0) {
+        return 0;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0 && fds[i] != i) {
+            dup2(fds[i], i);
+        }
+    }
+    if (syscall(SYS_close_range, 3, ~0U, 0) < 0) {
+        for (int fd = 3; fd < 1024; fd++) {
+            close(fd);
+        }
+    }
+    _exit(run_util(cmd, STDOUT_FILENO, STDERR_FILENO));
+}
+
+/*
+ * spawn_cmd
+ *
+ * Starts cmd with posix_spawn instead of fork + exec.  glibc spawns
+ * with clone(CLONE_VM | CLONE_VFORK), so the parent's page tables are
+ * never copied and launching costs the same however big the shell (or
+ * the rsh server) has grown.  The child's stdio is set up by file
+ * actions: in_fd, out_fd and err_fd become its stdin, stdout and stderr
+ * (-1 inherits ours) and the command's own < > >> files override them.
+ * Those files are opened here rather than in the child so a bad path is
+ * told apart from a missing command.  Pipe ends must be O_CLOEXEC so
+ * they do not leak into the child.  Bare names are resolved through the
+ * command hash and spawned by absolute path.
+ *
+ * Failures are reported on err_fd (or our stderr) the way a shell would,
+ * e.g. "foo: command not found".
+ */
+int spawn_cmd(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd, pid_t *pid) {
+    int report_fd = (err_fd >= 0) ? err_fd : STDERR_FILENO;
+    int in_file = -1;
+    int out_file = -1;
+    posix_spawn_file_actions_t fa;
+    int rc;
+
+    if (cmd->in_redir_type == REDIR_IN) {
+        in_file = open(cmd->in_redir_file, O_RDONLY | O_CLOEXEC);
+        if (in_file < 0) {
+            dprintf(report_fd, "%s: %s\n", cmd->in_redir_file, strerror(errno));
+            return ERR_EXEC_CMD;
+        }
+        in_fd = in_file;
+    }
+    if (cmd->out_redir_type != REDIR_NONE) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= (cmd->out_redir_type == REDIR_APPEND) ? O_APPEND : O_TRUNC;
+        out_file = open(cmd->out_redir_file, flags, 0644);
+        if (out_file < 0) {
+            dprintf(report_fd, "%s: %s\n", cmd->out_redir_file, strerror(errno));
+            if (in_file >= 0) close(in_file);
+            return ERR_EXEC_CMD;
+        }
+        out_fd = out_file;
+    }
+
+    // Anything we printed has to reach the terminal or file before the child's output
+    fflush(stdout);
+    
+    if (is_util(cmd->argv[0])) {
+        rc = spawn_util(cmd, in_fd, out_fd, err_fd, pid);
+        if (in_file >= 0) close(in_file);
+        if (out_file >= 0) close(out_file);
+        if (rc != 0) {
+            dprintf(report_fd, "%s: %s\n", cmd->argv[0], strerror(rc));
+            return ERR_EXEC_CMD;
+        }
+        return OK;
+    }
+    
+    rc = posix_spawn_file_actions_init(&fa);
+    if (rc == 0) {
+        if (in_fd >= 0 && in_fd != STDIN_FILENO) {
+            posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+        }
+        if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+            posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+        }
+        if (err_fd >= 0 && err_fd != STDERR_FILENO) {
+            posix_spawn_file_actions_adddup2(&fa, err_fd, STDERR_FILENO);
+        }
+        char path[PATH_MAX];
+        rc = lookup_cmd(cmd->argv[0], path, sizeof(path));
+        if (rc == OK) {
+            rc = spawn_path(path, cmd, &fa, in_fd, out_fd, err_fd, pid);
+            if (rc == ENOENT && strchr(cmd->argv[0], '/') == NULL) {
+                // Removed since it was hashed: look it up once more
+                forget_cmd(cmd->argv[0]);
+                rc = lookup_cmd(cmd->argv[0], path, sizeof(path));
+                if (rc == OK) {
+                    rc = spawn_path(path, cmd, &fa, in_fd, out_fd, err_fd, pid);
+                }
+            }
+        }
+        rc = (rc == ERR_EXEC_CMD) ? ENOENT : (rc == ERR_MEMORY) ? ENOMEM : rc;
+        posix_spawn_file_actions_destroy(&fa);
+    }
+    if (in_file >= 0) close(in_file);
+    if (out_file >= 0) close(out_file);
+
+    if (rc != 0) {
+        if (rc == ENOENT && strchr(cmd->argv[0], '/') == NULL) {
+            dprintf(report_fd, "%s: command not found\n", cmd->argv[0]);
+        } else {
+            dprintf(report_fd, "%s: %s\n", cmd->argv[0], strerror(rc));
+        }
+        return ERR_EXEC_CMD;
+    }
+    return OK;
+}
+
+/*
+ * exec_cmd
+ *
+ * Executes a single command
+ * Handles input/output redirection for extra credit
+ */
+int exec_cmd(cmd_buff_t *cmd) {
+    if (!cmd || cmd->argc == 0) {
+        return ERR_CMD_ARGS_BAD;
+    }
+    
+    // Check if it's a built-in command
+    Built_In_Cmds bi_result = exec_built_in_cmd(cmd);
+    if (bi_result == BI_CMD_EXIT) {
+        return OK_EXIT;
+    } else if (bi_result == BI_EXECUTED) {
+        return OK;
+    }
+    
+    pid_t pid;
+    int rc = spawn_cmd(cmd, -1, -1, -1, &pid);
+    if (rc != OK) {
+        last_status = 127;
+        return rc;
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    last_status = exit_code(status);
+    return OK;
+}
+
+/*
+ * Pipe sizing.  Pipes start at 64K, so a stage streaming gigabytes
+ * through one stops every 64K to let the next stage catch up.  "set
+ * pipesize=N" has execute_pipeline resize every pipe between stages to N
+ * bytes with F_SETPIPE_SZ, and "set pipesize=auto" to the largest size
+ * an unprivileged process may use (/proc/sys/fs/pipe-max-size).  The
+ * kernel also caps the pipe memory of a user as a whole, so a size it
+ * refuses is halved until it fits.  "set pipestats=on" prints how many
+ * bytes each stage read and wrote, taken from /proc/<pid>/io while the
+ * stage is still a zombie, so counting costs the pipeline nothing.
+ */
+#define PIPE_SIZE_DEFAULT   0
+#define PIPE_SIZE_AUTO     -1
+#define PIPE_SIZE_MIN      (64 * 1024)
+
+static struct {
+    long size;              // bytes, or PIPE_SIZE_DEFAULT / PIPE_SIZE_AUTO
+    int  stats;
+    long max;               // pipe-max-size, read on first use
+    long last;              // size the last pipe really got
+} pipe_conf;
+
+static long pipe_max_size(void) {
+    if (pipe_conf.max == 0) {
+        FILE *fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (!fp || fscanf(fp, "%ld", &pipe_conf.max) != 1 || pipe_conf.max < PIPE_SIZE_MIN) {
+            pipe_conf.max = PIPE_SIZE_MIN;
+        }
+        if (fp) {
+            fclose(fp);
+        }
+    }
+    return pipe_conf.max;
+}
+
+// Grows a new pipe to the configured size, or as close to it as allowed
+static void size_pipe(int fd) {
+    long size = (pipe_conf.size == PIPE_SIZE_AUTO) ? pipe_max_size() : pipe_conf.size;
+    
+    if (size != PIPE_SIZE_DEFAULT) {
+        while (fcntl(fd, F_SETPIPE_SZ, (int)size) < 0 && size > PIPE_SIZE_MIN) {
+            size /= 2;
+        }
+    }
+    if (pipe_conf.stats) {
+        pipe_conf.last = fcntl(fd, F_GETPIPE_SZ);
+    }
+}
+
+// "64K", "1M", "1048576"
+static long parse_size(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    long unit = 1;
+    
+    if (end == s || n <= 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': unit = 1024; end++; break;
+        case 'm': case 'M': unit = 1024 * 1024; end++; break;
+        default: break;
+    }
+    // Checked before multiplying so huge values fail instead of wrapping
+    if (*end != '\0' || n > INT_MAX / unit) {
+        return -1;
+    }
+    return n * unit;
+}
+
+/*
+ * exec_set_cmd
+ *
+ * "set" shows the session settings, "set name=value" changes one:
+ * pipesize=default|auto|<bytes>[K|M], pipestats=on|off and
+ * spawn=direct|zygote.
+ */
+int exec_set_cmd(cmd_buff_t *cmd) {
+    if (cmd->argc == 1) {
+        if (pipe_conf.size == PIPE_SIZE_AUTO) {
+            printf("pipesize=auto\n");
+        } else if (pipe_conf.size == PIPE_SIZE_DEFAULT) {
+            printf("pipesize=default\n");
+        } else {
+            printf("pipesize=%ld\n", pipe_conf.size);
+        }
+        printf("pipestats=%s\n", pipe_conf.stats ? "on" : "off");
+        printf("spawn=%s\n", zygote_running() ? "zygote" : "direct");
+        return OK;
+    }
+    
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *arg = cmd->argv[i];
+        const char *value = strchr(arg, '=');
+        int ok = 0;
+        
+        if (value && strncmp(arg, "pipesize=", 9) == 0) {
+            value++;
+            ok = 1;
+            if (strcmp(value, "auto") == 0) {
+                pipe_conf.size = PIPE_SIZE_AUTO;
+            } else if (strcmp(value, "default") == 0) {
+                pipe_conf.size = PIPE_SIZE_DEFAULT;
+            } else if (parse_size(value) > 0) {
+                pipe_conf.size = parse_size(value);
+            } else {
+                ok = 0;
+            }
+        } else if (value && strncmp(arg, "spawn=", 6) == 0) {
+            value++;
+            if (strcmp(value, "zygote") == 0) {
+                ok = (zygote_start() == OK);
+            } else if (strcmp(value, "direct") == 0) {
+                zygote_stop();
+                ok = 1;
+            }
+        } else if (value && strncmp(arg, "pipestats=", 10) == 0) {
+            value++;
+            ok = (strcmp(value, "on") == 0 || strcmp(value, "off") == 0);
+            if (ok) {
+                pipe_conf.stats = (strcmp(value, "on") == 0);
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "set: %s: unknown setting or bad value\n", arg);
+            return ERR_CMD_ARGS_BAD;
+        }
+    }
+    return OK;
+}
+
+// One "pipestats" line per stage; pid must be exited but not yet reaped.
+// rchar/wchar cover all of the stage's I/O, not only its pipe ends.
+static void print_stage_stats(int stage, cmd_buff_t *cmd, pid_t pid) {
+    char path[64];
+    char line[128];
+    unsigned long long rchar = 0;
+    unsigned long long wchar = 0;
+    
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            sscanf(line, "rchar: %llu", &rchar);
+            sscanf(line, "wchar: %llu", &wchar);
+        }
+        fclose(fp);
+    }
+    fprintf(stderr, "pipestats: %d %s: total I/O read %llu wrote %llu\n", stage, cmd->argv[0], rchar, wchar);
+}
+
+/*
+ * Spawns every stage of clist, reading from in_fd and writing to out_fd
+ * (-1: the shell's own stdin/stdout) at the two ends.  The pids of the
+ * stage i goes to pids[i], 0 if it failed to start, and the number that
+ * did start to *started; the caller waits.
+ */
+static int start_pipeline(command_list_t *clist, int in_fd, int out_fd,
+                          pid_t *pids, int *started) {
+    int num_pipes = clist->num - 1;
+    int pipes[num_pipes > 0 ? num_pipes : 1][2];
+    int rc = OK;
+    
+    *started = 0;
+    
+    // Create all pipes, close-on-exec so each child only keeps its own ends
+    for (int i = 0; i < num_pipes; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            return ERR_EXEC_CMD;
+        }
+        size_pipe(pipes[i][1]);
+    }
+    
+    // Spawn each stage with its stdin/stdout wired to the neighbouring pipes
+    for (int i = 0; i < clist->num; i++) {
+        int stage_in = (i > 0) ? pipes[i-1][0] : in_fd;
+        int stage_out = (i < num_pipes) ? pipes[i][1] : out_fd;
+
+        if (spawn_cmd(&clist->commands[i], stage_in, stage_out, -1, &pids[i]) == OK) {
+            (*started)++;
+        } else {
+            pids[i] = 0;
+            rc = ERR_EXEC_CMD;
+        }
+    }
+    
+    // Parent process - close all pipe fds
+    for (int i = 0; i < num_pipes; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    return rc;
+}
+
+/*
+ * Jobs.  A line ending in & is spawned and handed to the job table
+ * instead of being waited for.  Each of its processes gets a pidfd, so
+ * finding out which jobs finished is one poll() over all of them rather
+ * than a waitpid per process; only pids that poll reports as exited are
+ * reaped.  Finished jobs are announced before the next prompt, the way
+ * sh does.  fg only waits: dsh does no terminal job control.
+ */
+typedef struct job {
+    int    id;
+    int    nprocs;
+    int    running;         // processes not reaped yet
+    pid_t *pids;            // 0 once reaped
+    int   *pidfds;          // -1 if pidfd_open is not available
+    int    status;          // wait status of the last process
+    char  *text;            // the command line, for jobs and fg
+} job_t;
+
+static job_t *jobs;
+static int    njobs;
+static int    jobs_cap;
+static int    jobs_notify = 1;  // announce finished jobs (interactive only)
+
+static void job_free(job_t *job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->pidfds[i] >= 0) {
+            close(job->pidfds[i]);
+        }
+    }
+    free(job->pids);
+    free(job->pidfds);
+    free(job->text);
+}
+
+static void job_remove(int idx) {
+    job_free(&jobs[idx]);
+    memmove(&jobs[idx], &jobs[idx + 1], (njobs - idx - 1) * sizeof(job_t));
+    njobs--;
+}
+
+static void job_reaped(job_t *job, int i, int status) {
+    if (i == job->nprocs - 1) {
+        job->status = status;
+    }
+    if (job->pidfds[i] >= 0) {
+        close(job->pidfds[i]);
+        job->pidfds[i] = -1;
+    }
+    job->pids[i] = 0;
+    job->running--;
+}
+
+/*
+ * Reaps whatever has exited in one job (only == NULL: every job),
+ * waiting up to timeout ms (-1: until something exits)
+ */
+static void poll_jobs(job_t *only, int timeout) {
+    int first = only ? (int)(only - jobs) : 0;
+    int last = only ? first + 1 : njobs;
+    int nfds = 0;
+    int fallback = 0;       // processes without a pidfd
+    
+    for (int j = first; j < last; j++) {
+        for (int i = 0; i < jobs[j].nprocs; i++) {
+            if (jobs[j].pids[i] > 0) {
+                nfds += (jobs[j].pidfds[i] >= 0);
+                fallback += (jobs[j].pidfds[i] < 0);
+            }
+        }
+    }
+    if (nfds + fallback == 0) {
+        return;
+    }
+    
+    struct pollfd *fds = calloc(nfds ? nfds : 1, sizeof(struct pollfd));
+    if (!fds) {
+        return;
+    }
+    int n = 0;
+    for (int j = first; j < last; j++) {
+        for (int i = 0; i < jobs[j].nprocs; i++) {
+            if (jobs[j].pids[i] > 0 && jobs[j].pidfds[i] >= 0) {
+                fds[n].fd = jobs[j].pidfds[i];
+                fds[n++].events = POLLIN;
+            }
+        }
+    }
+    if (fallback) {
+        // Without pidfds there is nothing to sleep on but waitpid
+        timeout = (timeout < 0 && nfds == 0) ? -1 : 0;
+    }
+    if (nfds) {
+        while (poll(fds, nfds, timeout) < 0 && errno == EINTR) {
+        }
+    }
+    
+    n = 0;
+    for (int j = first; j < last; j++) {
+        for (int i = 0; i < jobs[j].nprocs; i++) {
+            int status;
+            if (jobs[j].pids[i] <= 0) {
+                continue;
+            }
+            if (jobs[j].pidfds[i] >= 0) {
+                if (fds[n++].revents == 0) {
+                    continue;
+                }
+                waitpid(jobs[j].pids[i], &status, 0);
+            } else if (waitpid(jobs[j].pids[i], &status,
+                               (timeout < 0 && nfds == 0) ? 0 : WNOHANG) <= 0) {
+                continue;
+            }
+            job_reaped(&jobs[j], i, status);
+        }
+    }
+    free(fds);
+}
+
+static void print_job(const job_t *job, const char *state) {
+    printf("[%d]  %-8s%s\n", job->id, state, job->text);
+}
+
+static const char *job_state(const job_t *job, char *buf, size_t cap) {
+    if (job->running > 0) {
+        return "Running";
+    }
+    if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0) {
+        return "Done";
+    }
+    if (WIFEXITED(job->status)) {
+        snprintf(buf, cap, "Exit %d", WEXITSTATUS(job->status));
+    } else {
+        snprintf(buf, cap, "Signal %d", WTERMSIG(job->status));
+    }
+    return buf;
+}
+
+/*
+ * report_jobs
+ *
+ * Reaps finished background jobs without blocking, announces them
+ * (interactive only) and drops them from the table.  Scripts call it
+ * before every line so finished jobs never pile up as zombies.
+ */
+void report_jobs(void) {
+    char buf[32];
+    
+    if (njobs == 0) {
+        return;
+    }
+    poll_jobs(NULL, 0);
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].running == 0) {
+            if (jobs_notify) {
+                print_job(&jobs[j], job_state(&jobs[j], buf, sizeof(buf)));
+            }
+            job_remove(j--);
+        }
+    }
+    if (jobs_notify) {
+        fflush(stdout);
+    }
+}
+
+/*
+ * Adds a started background pipeline to the job table and prints its
+ * id and the pid of its last process
+ */
+static int add_job(command_list_t *clist, pid_t *pids, int started) {
+    if (started == 0) {
+        return ERR_EXEC_CMD;
+    }
+    if (njobs == jobs_cap) {
+        int cap = jobs_cap ? jobs_cap * 2 : 8;
+        job_t *bigger = realloc(jobs, cap * sizeof(job_t));
+        if (!bigger) {
+            return ERR_MEMORY;
+        }
+        jobs = bigger;
+        jobs_cap = cap;
+    }
+    
+    // The command line as the parser saw it, for jobs and fg
+    size_t len = 1;
+    for (int i = 0; i < clist->num; i++) {
+        for (int a = 0; a < clist->commands[i].argc; a++) {
+            len += strlen(clist->commands[i].argv[a]) + 3;
+        }
+    }
+    
+    job_t *job = &jobs[njobs];
+    job->id = njobs ? jobs[njobs - 1].id + 1 : 1;
+    job->nprocs = started;
+    job->running = started;
+    job->status = 0;
+    job->pids = malloc(started * sizeof(pid_t));
+    job->pidfds = malloc(started * sizeof(int));
+    job->text = malloc(len);
+    if (!job->pids || !job->pidfds || !job->text) {
+        free(job->pids);
+        free(job->pidfds);
+        free(job->text);
+        return ERR_MEMORY;
+    }
+    
+    char *p = job->text;
+    for (int i = 0; i < clist->num; i++) {
+        for (int a = 0; a < clist->commands[i].argc; a++) {
+            p += sprintf(p, "%s%s", (i || a) ? (a ? " " : " | ") : "",
+                         clist->commands[i].argv[a]);
+        }
+    }
+    for (int i = 0, n = 0; i < clist->num; i++) {
+        if (pids[i] > 0) {
+            job->pids[n] = pids[i];
+            job->pidfds[n++] = (int)syscall(SYS_pidfd_open, pids[i], 0);
+        }
+    }
+    njobs++;
+    
+    if (jobs_notify) {
+        printf("[%d] %d\n", job->id, (int)job->pids[started - 1]);
+        fflush(stdout);
+    }
+    return OK;
+}
+
+/*
+ * Finds a job from a "%n" or "n" argument, or the newest one for NULL
+ */
+static job_t *find_job(const char *spec) {
+    if (!spec) {
+        return njobs ? &jobs[njobs - 1] : NULL;
+    }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].id == id) {
+            return &jobs[j];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * exec_job_cmd
+ *
+ * The job built-ins: "jobs" lists background jobs, "wait [%n]" blocks
+ * until all of them (or job n) have finished, and "fg [%n]" waits for
+ * the newest job (or job n) in the foreground, echoing its command line.
+ */
+int exec_job_cmd(Built_In_Cmds which, cmd_buff_t *cmd) {
+    char buf[32];
+    
+    if (which == BI_CMD_JOBS) {
+        poll_jobs(NULL, 0);
+        for (int j = 0; j < njobs; j++) {
+            print_job(&jobs[j], job_state(&jobs[j], buf, sizeof(buf)));
+        }
+        fflush(stdout);
+        return OK;
+    }
+    
+    const char *spec = (cmd->argc > 1) ? cmd->argv[1] : NULL;
+    job_t *job = NULL;
+    if (which == BI_CMD_FG || spec) {
+        job = find_job(spec);
+        if (!job) {
+            fprintf(stderr, "%s: %s: no such job\n", cmd->argv[0], spec ? spec : "current");
+            return ERR_CMD_ARGS_BAD;
+        }
+    }
+    
+    if (which == BI_CMD_FG) {
+        printf("%s\n", job->text);
+        fflush(stdout);
+        while (job->running > 0) {
+            poll_jobs(job, -1);
+        }
+        last_status = exit_code(job->status);
+        job_remove((int)(job - jobs));
+        return OK;
+    }
+    
+    // wait: finished jobs are still announced at the next prompt
+    if (job) {
+        while (job->running > 0) {
+            poll_jobs(job, -1);
+        }
+    } else {
+        for (int j = 0; j < njobs; j++) {
+            while (jobs[j].running > 0) {
+                poll_jobs(NULL, -1);
+            }
+        }
+    }
+    return OK;
+}
+
+/*
+ * release_jobs
+ *
+ * Forgets the job table when the shell exits; the jobs keep running
+ */
+void release_jobs(void) {
+    while (njobs > 0) {
+        job_remove(njobs - 1);
+    }
+    free(jobs);
+    jobs = NULL;
+    jobs_cap = 0;
+}
+
+/*
+ * parallel.  "parallel [-j N] [-k] [-a file] command... [::: arg...]"
+ * runs the command once per argument, keeping up to N of them (default:
+ * one per CPU) in flight and starting the next one as soon as one exits.
+ * Arguments come from the words after :::, the lines of -a file or of a
+ * < redirect, or else the shell's stdin.  {} in the command is replaced
+ * by the argument, which is appended when there is no {}, and always
+ * stays one word.  A command given as a single quoted word is parsed as
+ * a command line, so it may be a whole pipeline: 'grep x {} | wc -l'.
+ *
+ * Each job's stdout is collected through a pipe and printed in one piece
+ * when the job ends, so outputs never interleave; -k prints them in
+ * argument order instead of completion order.  The collected output goes
+ * to the shell's stdout, or to the file of a > or >> redirect.  A job's
+ * stdin is /dev/null and its stderr is the shell's.
+ */
+#define PAR_READ_SZ (64 * 1024)
+
+typedef struct par_out {
+    long   seq;             // argument number, for -k
+    char  *data;
+    size_t len;
+    size_t cap;
+} par_out_t;
+
+typedef struct par_slot {
+    int            busy;
+    command_list_t clist;
+    pid_t         *pids;    // 0 once reaped
+    int           *pidfds;  // -1 once reaped, or if pidfd_open failed
+    int            npids;
+    int            pids_cap;
+    int            live;    // processes not reaped yet
+    int            status;  // wait status of the last stage
+    int            out_fd;  // read end of the job's stdout, -1 at EOF
+    par_out_t      out;
+} par_slot_t;
+
+typedef struct par_src {
+    char **words;           // the words after :::, or NULL
+    int    nwords;
+    FILE  *fp;              // otherwise one argument per line
+    char  *line;
+    size_t line_cap;
+} par_src_t;
+
+// Next argument, or NULL once the source runs dry
+static const char *par_next(par_src_t *src) {
+    if (src->words) {
+        return (src->nwords-- > 0) ? *src->words++ : NULL;
+    }
+    ssize_t n = getline(&src->line, &src->line_cap, src->fp);
+    if (n < 0) {
+        return NULL;
+    }
+    if (n > 0 && src->line[n - 1] == '\n') {
+        src->line[n - 1] = '\0';
+    }
+    return src->line;
+}
+
+// Growable command line for par_expand
+typedef struct par_line {
+    char  *buf;
+    size_t len;
+    size_t cap;
+} par_line_t;
+
+static int par_put(par_line_t *l, const char *src, size_t n, int quote) {
+    // Worst case every byte is a ' that becomes '\'' plus the outer quotes
+    size_t need = l->len + (quote ? 4 * n + 2 : n) + 1;
+    if (need > l->cap) {
+        size_t cap = (need > 2 * l->cap) ? need : 2 * l->cap;
+        char *bigger = realloc(l->buf, cap);
+        if (!bigger) {
+            return ERR_MEMORY;
+        }
+        l->buf = bigger;
+        l->cap = cap;
+    }
+    if (!quote) {
+        memcpy(l->buf + l->len, src, n);
+        l->len += n;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            if (src[i] == '\'') {
+                memcpy(l->buf + l->len, "'\\''", 4);
+                l->len += 4;
+            } else {
+                l->buf[l->len++] = src[i];
+            }
+        }
+    }
+    l->buf[l->len] = '\0';
+    return OK;
+}
+
+/*
+ * Builds the command line for one argument.  A template of one word is
+ * a command line of its own and {} becomes the quoted argument; with
+ * several words each one, {} replaced, is quoted into a single word.
+ */
+static int par_expand(char **words, int nwords, const char *arg, par_line_t *l) {
+    size_t arg_len = strlen(arg);
+    int holes = 0;
+    int rc = OK;
     
-    // Multiple commands - set up pipes
-    int num_pipes = clist->num - 1;
-    int pipes[num_pipes][2];
-    pid_t pids[clist->num];
+    l->len = 0;
+    for (int w = 0; w < nwords && rc == OK; w++) {
+        int whole = (nwords > 1);
+        const char *p = words[w];
+        const char *hole;
+        
+        if (w > 0) {
+            rc = par_put(l, " ", 1, 0);
+        }
+        if (whole) {
+            rc |= par_put(l, "'", 1, 0);
+        }
+        while (rc == OK && (hole = strstr(p, "{}")) != NULL) {
+            rc |= par_put(l, p, hole - p, whole);
+            rc |= par_put(l, "'", whole ? 0 : 1, 0);
+            rc |= par_put(l, arg, arg_len, 1);
+            rc |= par_put(l, "'", whole ? 0 : 1, 0);
+            p = hole + 2;
+            holes++;
+        }
+        rc |= par_put(l, p, strlen(p), whole);
+        if (whole) {
+            rc |= par_put(l, "'", 1, 0);
+        }
+    }
+    if (holes == 0 && rc == OK) {
+        rc |= par_put(l, " '", 2, 0);
+        rc |= par_put(l, arg, arg_len, 1);
+        rc |= par_put(l, "'", 1, 0);
+    }
+    return rc ? ERR_MEMORY : OK;
+}
+
+// Starts one job in a free slot; the slot stays idle if it cannot start
+static int par_start(par_slot_t *slot, const char *line, long seq, int null_fd) {
+    int out[2];
     
-    // Create all pipes
-    for (int i = 0; i < num_pipes; i++) {
-        if (pipe(pipes[i]) < 0) {
-            perror("pipe");
-            return ERR_EXEC_CMD;
+    free_cmd_list(&slot->clist);
+    if (build_cmd_list_len(line, strlen(line), &slot->clist) != OK) {
+        return ERR_CMD_ARGS_BAD;
+    }
+    if (slot->clist.num > slot->pids_cap) {
+        pid_t *pids = realloc(slot->pids, slot->clist.num * sizeof(pid_t));
+        if (pids) {
+            slot->pids = pids;
         }
+        int *pidfds = realloc(slot->pidfds, slot->clist.num * sizeof(int));
+        if (pidfds) {
+            slot->pidfds = pidfds;
+        }
+        if (!pids || !pidfds) {
+            return ERR_MEMORY;
+        }
+        slot->pids_cap = slot->clist.num;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return ERR_EXEC_CMD;
     }
     
-    // Create processes for each command
-    for (int i = 0; i < clist->num; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            perror("fork");
+    int started;
+    int rc = start_pipeline(&slot->clist, null_fd, out[1], slot->pids, &started);
+    close(out[1]);
+    if (started == 0) {
+        close(out[0]);
+        return rc;
+    }
+    slot->npids = slot->clist.num;
+    for (int p = 0; p < slot->npids; p++) {
+        slot->pidfds[p] = (slot->pids[p] > 0) ? (int)syscall(SYS_pidfd_open, slot->pids[p], 0) : -1;
+    }
+    slot->live = started;
+    slot->status = 0;
+    slot->out_fd = out[0];
+    slot->out.seq = seq;
+    slot->out.len = 0;
+    slot->busy = 1;
+    return rc;
+}
+
+// Reaps stage p of the job
+static void par_reap(par_slot_t *slot, int p) {
+    int status;
+    
+    waitpid(slot->pids[p], &status, 0);
+    if (p == slot->npids - 1) {
+        slot->status = status;
+    }
+    if (slot->pidfds[p] >= 0) {
+        close(slot->pidfds[p]);
+        slot->pidfds[p] = -1;
+    }
+    slot->pids[p] = 0;
+    slot->live--;
+}
+
+// Gives up on a running job: stops reading it and waits for it to exit
+static void par_abandon(par_slot_t *slot) {
+    if (slot->out_fd >= 0) {
+        close(slot->out_fd);
+        slot->out_fd = -1;
+    }
+    for (int p = 0; p < slot->npids; p++) {
+        if (slot->pids[p] > 0) {
+            par_reap(slot, p);
+        }
+    }
+    slot->busy = 0;
+}
+
+// Reads what the job wrote; returns 1 once its stdout is closed
+static int par_drain(par_slot_t *slot) {
+    par_out_t *o = &slot->out;
+    
+    if (o->cap - o->len < PAR_READ_SZ) {
+        size_t cap = o->cap ? o->cap * 2 : PAR_READ_SZ;
+        char *bigger = realloc(o->data, cap + PAR_READ_SZ);
+        if (!bigger) {
+            return 1;
+        }
+        o->data = bigger;
+        o->cap = cap + PAR_READ_SZ;
+    }
+    ssize_t n = read(slot->out_fd, o->data + o->len, o->cap - o->len);
+    if (n < 0 && errno == EINTR) {
+        return 0;
+    }
+    if (n <= 0) {
+        return 1;
+    }
+    o->len += n;
+    return 0;
+}
+
+/*
+ * Output order.  Without -k a finished job's output is printed at once;
+ * with -k it waits in held[] until every earlier argument's has been.
+ */
+typedef struct par_order {
+    FILE      *out;             // stdout, or the > / >> file
+    int        keep_order;
+    long       next_print;
+    par_out_t *held;
+    int        nheld;
+    int        held_cap;
+} par_order_t;
+
+// Takes over out's buffer; out is left empty for the slot's next job
+static void par_finish(par_order_t *ord, par_out_t *out) {
+    if (!ord->keep_order || out->seq == ord->next_print) {
+        if (out->len > 0) {
+            fwrite(out->data, 1, out->len, ord->out);
+        }
+        out->len = 0;
+        ord->next_print += ord->keep_order;
+    } else {
+        if (ord->nheld == ord->held_cap) {
+            int cap = ord->held_cap ? ord->held_cap * 2 : 16;
+            par_out_t *bigger = realloc(ord->held, cap * sizeof(par_out_t));
+            if (!bigger) {
+                return;
+            }
+            ord->held = bigger;
+            ord->held_cap = cap;
+        }
+        ord->held[ord->nheld++] = *out;
+        *out = (par_out_t){0};
+    }
+    
+    // Print whatever is now next in line
+    for (int h = 0; h < ord->nheld; ) {
+        if (ord->held[h].seq == ord->next_print) {
+            if (ord->held[h].len > 0) {
+                fwrite(ord->held[h].data, 1, ord->held[h].len, ord->out);
+            }
+            free(ord->held[h].data);
+            ord->held[h] = ord->held[--ord->nheld];
+            ord->next_print++;
+            h = 0;
+        } else {
+            h++;
+        }
+    }
+}
+
+/*
+ * exec_parallel_cmd
+ *
+ * The parallel built-in, see above.  Fails if any job did.
+ */
+int exec_parallel_cmd(cmd_buff_t *cmd) {
+    long nslots = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *arg_file = cmd->in_redir_file;
+    par_order_t ord = {0};
+    par_src_t src = {0};
+    int i = 1;
+    
+    // Options
+    for (; i < cmd->argc && cmd->argv[i][0] == '-'; i++) {
+        const char *opt = cmd->argv[i];
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(opt, "-k") == 0) {
+            ord.keep_order = 1;
+        } else if (strncmp(opt, "-j", 2) == 0 && (opt[2] || i + 1 < cmd->argc)) {
+            nslots = atol(opt[2] ? opt + 2 : cmd->argv[++i]);
+        } else if (strcmp(opt, "-a") == 0 && i + 1 < cmd->argc) {
+            arg_file = cmd->argv[++i];
+        } else {
+            break;
+        }
+    }
+    
+    // The template runs up to :::, the arguments after it
+    int tmpl_end = i;
+    while (tmpl_end < cmd->argc && strcmp(cmd->argv[tmpl_end], ":::") != 0) {
+        tmpl_end++;
+    }
+    if (tmpl_end == i || nslots < 1) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] [-a file] command... [::: arg...]\n");
+        return ERR_CMD_ARGS_BAD;
+    }
+    ord.out = stdout;
+    if (cmd->out_redir_type != REDIR_NONE) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        flags |= (cmd->out_redir_type == REDIR_APPEND) ? O_APPEND : O_TRUNC;
+        int out_fd = open(cmd->out_redir_file, flags, 0644);
+        if (out_fd < 0 || (ord.out = fdopen(out_fd, "w")) == NULL) {
+            fprintf(stderr, "%s: %s\n", cmd->out_redir_file, strerror(errno));
+            if (out_fd >= 0) {
+                close(out_fd);
+            }
+            return ERR_EXEC_CMD;
+        }
+    }
+    if (tmpl_end < cmd->argc) {
+        src.words = &cmd->argv[tmpl_end + 1];
+        src.nwords = cmd->argc - tmpl_end - 1;
+    } else if (arg_file) {
+        src.fp = fopen(arg_file, "r");
+        if (!src.fp) {
+            fprintf(stderr, "parallel: %s: %s\n", arg_file, strerror(errno));
+            if (ord.out != stdout) {
+                fclose(ord.out);
+            }
             return ERR_EXEC_CMD;
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // Handle input redirection for first command
-            if (i == 0 && clist->commands[i].in_redir_type == REDIR_IN) {
-                int fd = open(clist->commands[i].in_redir_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open input");
-                    exit(EXIT_FAILURE);
+        }
+    } else {
+        src.fp = stdin;
+    }
+    
+    par_slot_t *slots = calloc(nslots, sizeof(par_slot_t));
+    struct pollfd *fds = NULL;      // a job's stdout until EOF, then its pidfds
+    int *fd_slot = NULL;
+    int *fd_proc = NULL;            // stage a pidfd belongs to, -1 for stdout
+    int fds_cap = 0;
+    par_line_t line = {0};
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    long next_seq = 0;          // next argument to hand out
+    int running = 0;
+    int failed = 0;
+    int more = 1;
+    int rc = OK;
+    
+    if (!slots) {
+        rc = ERR_MEMORY;
+        more = 0;
+    } else {
+        for (long s = 0; s < nslots; s++) {
+            init_cmd_list(&slots[s].clist);
+        }
+    }
+    
+    fflush(stdout);
+    while (more || running > 0) {
+        // Refill every free slot
+        for (long s = 0; s < nslots && more; s++) {
+            par_slot_t *slot = &slots[s];
+            while (!slot->busy && more) {
+                const char *arg = par_next(&src);
+                if (!arg) {
+                    more = 0;
+                    break;
                 }
-                if (dup2(fd, STDIN_FILENO) < 0) {
-                    perror("dup2 input");
-                    exit(EXIT_FAILURE);
+                if (par_expand(&cmd->argv[i], tmpl_end - i, arg, &line) != OK ||
+                    par_start(slot, line.buf, next_seq, null_fd) != OK) {
+                    failed++;
                 }
-                close(fd);
-            } 
-            // Set up stdin from previous pipe (if not first command)
-            else if (i > 0) {
-                if (dup2(pipes[i-1][0], STDIN_FILENO) < 0) {
-                    perror("dup2 stdin");
-                    exit(EXIT_FAILURE);
+                if (slot->busy) {
+                    running++;
+                } else {
+                    // Never started: an empty output keeps -k in step
+                    slot->out.seq = next_seq;
+                    slot->out.len = 0;
+                    par_finish(&ord, &slot->out);
                 }
+                next_seq++;
             }
-            
-            // Handle output redirection for last command
-            if (i == clist->num - 1 && clist->commands[i].out_redir_type != REDIR_NONE) {
-                int flags = O_WRONLY | O_CREAT;
-                if (clist->commands[i].out_redir_type == REDIR_APPEND) {
-                    flags |= O_APPEND;
-                } else {
-                    flags |= O_TRUNC;
+        }
+        if (running == 0) {
+            break;
+        }
+        
+        // A job is done once its stdout is closed and all of it has exited
+        int nfds = 0;
+        for (long s = 0; s < nslots; s++) {
+            par_slot_t *slot = &slots[s];
+            if (!slot->busy) {
+                continue;
+            }
+            if (nfds + 1 + slot->npids > fds_cap) {
+                int cap = (nfds + 1 + slot->npids) * 2;
+                struct pollfd *new_fds = realloc(fds, cap * sizeof(struct pollfd));
+                fds = new_fds ? new_fds : fds;
+                int *new_slot = realloc(fd_slot, cap * sizeof(int));
+                fd_slot = new_slot ? new_slot : fd_slot;
+                int *new_proc = realloc(fd_proc, cap * sizeof(int));
+                fd_proc = new_proc ? new_proc : fd_proc;
+                if (!new_fds || !new_slot || !new_proc) {
+                    rc = ERR_MEMORY;
+                    break;
                 }
-                
-                int fd = open(clist->commands[i].out_redir_file, flags, 0644);
-                if (fd < 0) {
-                    perror("open output");
-                    exit(EXIT_FAILURE);
+                fds_cap = cap;
+            }
+            for (int p = -1; p < slot->npids; p++) {
+                int fd = (p < 0) ? slot->out_fd : slot->pidfds[p];
+                if (fd >= 0 && (p < 0 || slot->out_fd < 0)) {
+                    fds[nfds].fd = fd;
+                    fds[nfds].events = POLLIN;
+                    fd_slot[nfds] = (int)s;
+                    fd_proc[nfds++] = p;
                 }
-                if (dup2(fd, STDOUT_FILENO) < 0) {
-                    perror("dup2 output");
-                    exit(EXIT_FAILURE);
+            }
+        }
+        if (rc == ERR_MEMORY) {
+            // Nothing left to poll with: wait the running jobs out and stop
+            fprintf(stderr, "parallel: out of memory\n");
+            for (long s = 0; s < nslots; s++) {
+                if (slots[s].busy) {
+                    par_abandon(&slots[s]);
                 }
-                close(fd);
-            } 
-            // Set up stdout to next pipe (if not last command)
-            else if (i < clist->num - 1) {
-                if (dup2(pipes[i][1], STDOUT_FILENO) < 0) {
-                    perror("dup2 stdout");
-                    exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        if (nfds > 0 && poll(fds, nfds, -1) < 0) {
+            continue;
+        }
+        
+        for (int f = 0; f < nfds; f++) {
+            par_slot_t *slot = &slots[fd_slot[f]];
+            if (fds[f].revents == 0) {
+                continue;
+            }
+            if (fd_proc[f] >= 0) {
+                par_reap(slot, fd_proc[f]);
+            } else if (par_drain(slot)) {
+                close(slot->out_fd);
+                slot->out_fd = -1;
+            }
+        }
+        
+        for (long s = 0; s < nslots; s++) {
+            par_slot_t *slot = &slots[s];
+            if (!slot->busy || slot->out_fd >= 0) {
+                continue;
+            }
+            // Without pidfds all that is left is to block on them
+            for (int p = 0; p < slot->npids; p++) {
+                if (slot->pids[p] > 0 && slot->pidfds[p] < 0) {
+                    par_reap(slot, p);
                 }
             }
-            
-            // Close all pipe fds
-            for (int j = 0; j < num_pipes; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            if (slot->live > 0) {
+                continue;
             }
-            
-            // Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            perror("execvp");
-            exit(EXIT_FAILURE);
+            failed += !(WIFEXITED(slot->status) && WEXITSTATUS(slot->status) == 0);
+            slot->busy = 0;
+            running--;
+            par_finish(&ord, &slot->out);
         }
+        fflush(ord.out);
     }
     
-    // Parent process - close all pipe fds
-    for (int i = 0; i < num_pipes; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    if (failed > 0) {
+        fprintf(stderr, "parallel: %d of %ld jobs failed\n", failed, next_seq);
+    }
+    
+    if (slots) {
+        for (long s = 0; s < nslots; s++) {
+            release_cmd_list(&slots[s].clist);
+            free(slots[s].pids);
+            free(slots[s].pidfds);
+            free(slots[s].out.data);
+        }
+    }
+    for (int h = 0; h < ord.nheld; h++) {
+        free(ord.held[h].data);
+    }
+    if (src.fp && src.fp != stdin) {
+        fclose(src.fp);
+    }
+    if (ord.out != stdout) {
+        fclose(ord.out);
+    }
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    free(ord.held);
+    free(src.line);
+    free(line.buf);
+    free(fds);
+    free(fd_slot);
+    free(fd_proc);
+    free(slots);
+    return (rc == OK && failed > 0) ? ERR_EXEC_CMD : rc;
+}
+
+/*
+ * time.  "time [--json] pipeline" runs the pipeline and reports, on
+ * stderr, each stage's wall time (from the start of the pipeline to its
+ * exit), user and system CPU time, peak RSS, voluntary and involuntary
+ * context switches and exit status, then the same for the pipeline as a
+ * whole.  Stages are reaped with wait4 in the order they exit, found by
+ * polling their pidfds, so every wall time is that stage's own.  --json
+ * prints one JSON object per pipeline instead, for tools to collect.
+ */
+typedef struct stage_time {
+    double        real;
+    struct rusage ru;
+    int           status;
+} stage_time_t;
+
+static double elapsed(const struct timespec *t0) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t0->tv_sec) + (now.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static double tv_secs(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Strips a leading "time [--json]" off cmd; returns 1 if there was one
+ * and sets *json
+ */
+static int take_time_prefix(cmd_buff_t *cmd, int *json) {
+    int skip = 0;
+    
+    if (cmd->argc == 0 || strcmp(cmd->argv[0], "time") != 0) {
+        return 0;
+    }
+    skip = 1;
+    *json = (cmd->argc > 1 && strcmp(cmd->argv[1], "--json") == 0);
+    skip += *json;
+    memmove(cmd->argv, cmd->argv + skip, (cmd->argc - skip + 1) * sizeof(char *));
+    cmd->argc -= skip;
+    return 1;
+}
+
+static void put_json_str(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static void print_stage_time(FILE *fp, int json, const char *label, const char *name,
+                             const stage_time_t *st) {
+    int code = WIFEXITED(st->status) ? WEXITSTATUS(st->status) : WTERMSIG(st->status);
+    const char *how = WIFEXITED(st->status) ? "exit" : "signal";
+    
+    if (json) {
+        fprintf(fp, "{\"stage\":%s,\"cmd\":", label);
+        put_json_str(fp, name);
+        fprintf(fp, ",\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                    "\"vcsw\":%ld,\"ivcsw\":%ld,\"%s\":%d}",
+                st->real, tv_secs(&st->ru.ru_utime), tv_secs(&st->ru.ru_stime),
+                st->ru.ru_maxrss, st->ru.ru_nvcsw, st->ru.ru_nivcsw, how, code);
+    } else {
+        fprintf(fp, "time: %-5s %-12s real %.3fs user %.3fs sys %.3fs maxrss %ldK "
+                    "csw %ld/%ld %s %d\n",
+                label, name, st->real, tv_secs(&st->ru.ru_utime), tv_secs(&st->ru.ru_stime),
+                st->ru.ru_maxrss, st->ru.ru_nvcsw, st->ru.ru_nivcsw, how, code);
+    }
+}
+
+/*
+ * Reaps the started stages of a timed pipeline as they exit and prints
+ * the report.  pids[i] is the process of stage i; a stage that never
+ * started has pid 0 and is reported with status 127.  Returns the wait
+ * status of the last stage.
+ */
+static int wait_timed(command_list_t *clist, pid_t *pids, int json,
+                       const struct timespec *t0) {
+    int n = clist->num;
+    stage_time_t st[n];
+    int pidfd[n];
+    int left = 0;
+    
+    memset(st, 0, sizeof(st));
+    for (int i = 0; i < n; i++) {
+        st[i].status = 127 << 8;
+        pidfd[i] = pids[i] > 0 ? (int)syscall(SYS_pidfd_open, pids[i], 0) : -1;
+        left += (pids[i] > 0);
+    }
+    
+    while (left > 0) {
+        // pidfd[] stays per-stage; poll gets a fresh compacted copy
+        struct pollfd fds[n];
+        int stage_of[n];
+        int nfds = 0;
+        for (int i = 0; i < n; i++) {
+            if (pids[i] > 0 && pidfd[i] >= 0) {
+                fds[nfds] = (struct pollfd){ .fd = pidfd[i], .events = POLLIN };
+                stage_of[nfds++] = i;
+            }
+        }
+        if (nfds == 0) {
+            // No pidfds: wait4 in stage order, wall times are upper bounds
+            for (int i = 0; i < n; i++) {
+                if (pidfd[i] >= 0) {
+                    close(pidfd[i]);
+                    pidfd[i] = -1;
+                }
+                if (pids[i] > 0) {
+                    wait4(pids[i], &st[i].status, 0, &st[i].ru);
+                    st[i].real = elapsed(t0);
+                    pids[i] = 0;
+                    left--;
+                }
+            }
+            break;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            continue;
+        }
+        for (int f = 0; f < nfds; f++) {
+            int i = stage_of[f];
+            if (fds[f].revents == 0) {
+                continue;
+            }
+            if (pipe_conf.stats) {
+                print_stage_stats(i + 1, &clist->commands[i], pids[i]);
+            }
+            wait4(pids[i], &st[i].status, 0, &st[i].ru);
+            st[i].real = elapsed(t0);
+            close(pidfd[i]);
+            pidfd[i] = -1;
+            pids[i] = 0;
+            left--;
+        }
+    }
+    
+    stage_time_t total = { .status = st[n - 1].status };
+    char label[16];
+    for (int i = 0; i < n; i++) {
+        total.real = (st[i].real > total.real) ? st[i].real : total.real;
+        timeradd(&total.ru.ru_utime, &st[i].ru.ru_utime, &total.ru.ru_utime);
+        timeradd(&total.ru.ru_stime, &st[i].ru.ru_stime, &total.ru.ru_stime);
+        if (st[i].ru.ru_maxrss > total.ru.ru_maxrss) {
+            total.ru.ru_maxrss = st[i].ru.ru_maxrss;
+        }
+        total.ru.ru_nvcsw += st[i].ru.ru_nvcsw;
+        total.ru.ru_nivcsw += st[i].ru.ru_nivcsw;
+    }
+    
+    if (json) {
+        fprintf(stderr, "{\"stages\":[");
+        for (int i = 0; i < n; i++) {
+            snprintf(label, sizeof(label), "%d", i + 1);
+            if (i > 0) {
+                fputc(',', stderr);
+            }
+            print_stage_time(stderr, 1, label, clist->commands[i].argv[0], &st[i]);
+        }
+        fprintf(stderr, "],\"total\":");
+        print_stage_time(stderr, 1, "null", "", &total);
+        fprintf(stderr, "}\n");
+        return total.status;
+    }
+    for (int i = 0; i < n && n > 1; i++) {
+        snprintf(label, sizeof(label), "%d", i + 1);
+        print_stage_time(stderr, 0, label, clist->commands[i].argv[0], &st[i]);
+    }
+    print_stage_time(stderr, 0, "total", "", &total);
+    return total.status;
+}
+
+/*
+ * execute_pipeline
+ *
+ * Executes a pipeline of commands
+ * Handles input/output redirection for extra credit
+ */
+int execute_pipeline(command_list_t *clist) {
+    if (!clist || clist->num == 0) {
+        return WARN_NO_CMDS;
+    }
+    
+    int json = 0;
+    int timed = take_time_prefix(&clist->commands[0], &json) && !clist->background;
+    if (clist->commands[0].argc == 0) {
+        fprintf(stderr, "usage: time [--json] command [| command]...\n");
+        return ERR_CMD_ARGS_BAD;
+    }
+    
+    // Check if it's a single command
+    if (clist->num == 1 && !clist->background && !timed) {
+        return exec_cmd(&clist->commands[0]);
     }
     
-    // Wait for all children
+    // Built-ins always run in the shell itself, even with a &, except the
+    // utilities, which can be a background job as well as any command
+    Built_In_Cmds bi = (clist->num == 1) ? match_command(clist->commands[0].argv[0]) : BI_NOT_BI;
+    if (bi != BI_NOT_BI && !(bi == BI_CMD_UTIL && clist->background)) {
+        struct timespec t0;
+        stage_time_t st = {0};
+        struct rusage before;
+        
+        // A timed built-in is charged the shell's own usage meanwhile
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        getrusage(RUSAGE_SELF, &before);
+        Built_In_Cmds bi_result = BI_EXECUTED;
+        if (bi == BI_CMD_UTIL) {
+            last_status = exec_util_cmd(&clist->commands[0]);
+        } else {
+            bi_result = exec_built_in_cmd(&clist->commands[0]);
+        }
+        st.status = last_status << 8;
+        if (timed) {
+            getrusage(RUSAGE_SELF, &st.ru);
+            st.real = elapsed(&t0);
+            timersub(&st.ru.ru_utime, &before.ru_utime, &st.ru.ru_utime);
+            timersub(&st.ru.ru_stime, &before.ru_stime, &st.ru.ru_stime);
+            st.ru.ru_nvcsw -= before.ru_nvcsw;
+            st.ru.ru_nivcsw -= before.ru_nivcsw;
+            print_stage_time(stderr, json, json ? "null" : "total", "", &st);
+            if (json) {
+                fputc('\n', stderr);
+            }
+        }
+        if (bi_result == BI_CMD_EXIT) {
+            return OK_EXIT;
+        }
+        return OK;
+    }
+    
+    // A background job must not eat the shell's (or the script's) input
+    int null_fd = clist->background ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+    pid_t pids[clist->num];
+    int started = 0;
+    struct timespec t0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = start_pipeline(clist, null_fd, -1, pids, &started);
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    
+    if (clist->background) {
+        int job_rc = add_job(clist, pids, started);
+        last_status = (job_rc == OK) ? 0 : 127;
+        return (rc == OK) ? job_rc : rc;
+    }
+    
+    if (timed) {
+        last_status = exit_code(wait_timed(clist, pids, json, &t0));
+        return rc;
+    }
+    
+    // Wait for all children; the last stage's status is the pipeline's
+    int stats = pipe_conf.stats;
+    int status = 127 << 8;
     for (int i = 0; i < clist->num; i++) {
-        int status;
+        siginfo_t info;
+        if (pids[i] == 0) {
+            status = 127 << 8;
+            continue;
+        }
+        if (stats) {
+            waitid(P_PID, pids[i], &info, WEXITED | WNOWAIT);
+            print_stage_stats(i + 1, &clist->commands[i], pids[i]);
+        }
         waitpid(pids[i], &status, 0);
     }
+    last_status = exit_code(status);
+    if (stats && clist->num > 1) {
+        fprintf(stderr, "pipestats: pipe size %ld\n", pipe_conf.last);
+    }
     
-    return OK;
+    return rc;
 }
 
 /*
@@ -567,9 +2541,13 @@ int execute_pipeline(command_list_t *clist) {
  * Main command loop
  */
 int exec_local_cmd_loop() {
-    char cmd_buff[SH_CMD_MAX];
+    char *cmd_buff = NULL;      // grown by getline, so lines have no length limit
+    size_t cmd_cap = 0;
     command_list_t clist;
     
+    init_cmd_list(&clist);
+    jobs_notify = 1;
+    
     // Print the initial prompt
     printf("%s", SH_PROMPT);
     fflush(stdout);
@@ -577,7 +2555,7 @@ int exec_local_cmd_loop() {
     // Main command loop
     while (1) {
         // Read next command
-        if (!fgets(cmd_buff, SH_CMD_MAX, stdin)) {
+        if (getline(&cmd_buff, &cmd_cap, stdin) < 0) {
             // EOF => exit gracefully
             break;
         }
@@ -588,6 +2566,7 @@ int exec_local_cmd_loop() {
         // Check for empty input
         if (strlen(cmd_buff) == 0) {
             printf("%s", CMD_WARN_NO_CMD);
+            report_jobs();
             printf("%s", SH_PROMPT);
             fflush(stdout);
             continue;
@@ -603,6 +2582,7 @@ int exec_local_cmd_loop() {
         int rc = build_cmd_list(cmd_buff, &clist);
         if (rc != OK) {
             // If parse error or no commands, print prompt and continue
+            report_jobs();
             printf("%s", SH_PROMPT);
             fflush(stdout);
             continue;
@@ -617,10 +2597,134 @@ int exec_local_cmd_loop() {
         // Free the command list
         free_cmd_list(&clist);
         
-        // Print the prompt again
+        // Announce finished jobs, then print the prompt again
+        report_jobs();
         printf("%s", SH_PROMPT);
         fflush(stdout);
     }
     
+    release_cmd_list(&clist);
+    release_jobs();
+    zygote_stop();
+    free(cmd_buff);
     return 0;
 }
+
+/*
+ * Script mode.  No prompts, no per-line flushes and no interactive
+ * warnings: blank lines and # comments are skipped, and a bare exit
+ * ends the script quietly.  Every line is parsed into the same command
+ * list, so once its arena has grown to fit the longest line the script
+ * runs without a single allocation in the shell.  stdout is left to
+ * stdio's buffering and only flushed when a child is about to write.
+ *
+ * returns:  the line's exit status (2 if it did not parse), or OK_EXIT
+ *           if the script ran exit
+ */
+static int run_script_line(const char *line, size_t len, command_list_t *clist) {
+    size_t i = 0;
+    
+    report_jobs();
+    while (i < len && isspace((unsigned char)line[i])) {
+        i++;
+    }
+    if (i == len || line[i] == '#') {
+        return last_status;
+    }
+    if (build_cmd_list_len(line + i, len - i, clist) != OK) {
+        last_status = 2;    // the parser already printed what was wrong
+        return last_status;
+    }
+    if (clist->num == 1 && strcmp(clist->commands[0].argv[0], EXIT_CMD) == 0) {
+        return OK_EXIT;
+    }
+    return (execute_pipeline(clist) == OK_EXIT) ? OK_EXIT : last_status;
+}
+
+/*
+ * exec_script
+ *
+ * Runs every line of a script file, or of stdin for "-".  A regular file
+ * is mapped and walked in place; anything else goes through one large
+ * stdio buffer.
+ *
+ * returns:  the exit status of the last command line run, as sh does,
+ *           or 127 if the script cannot be opened
+ */
+int exec_script(const char *path) {
+    command_list_t clist;
+    struct stat st;
+    int rc = OK;
+    
+    init_cmd_list(&clist);
+    jobs_notify = 0;
+    
+    int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "dsh: %s: %s\n", path, strerror(errno));
+        return 127;
+    }
+    
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const char *ptr = map;
+            const char *end = map + st.st_size;
+            while (ptr < end && rc != OK_EXIT) {
+                const char *nl = memchr(ptr, '\n', end - ptr);
+                size_t len = (nl ? nl : end) - ptr;
+                rc = run_script_line(ptr, len, &clist);
+                ptr += len + 1;
+            }
+            munmap(map, st.st_size);
+            goto done;
+        }
+    }
+    
+    FILE *in = (fd == STDIN_FILENO) ? stdin : fdopen(fd, "r");
+    if (in) {
+        static char in_buff[SCRIPT_BUFF_SZ];
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        
+        setvbuf(in, in_buff, _IOFBF, sizeof(in_buff));
+        while (rc != OK_EXIT && (len = getline(&line, &cap, in)) >= 0) {
+            rc = run_script_line(line, len, &clist);
+        }
+        free(line);
+        if (in != stdin) {
+            fclose(in);
+            fd = -1;
+        }
+    }
+    
+done:
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+    release_cmd_list(&clist);
+    release_jobs();
+    zygote_stop();
+    fflush(stdout);
+    return last_status;
+}
+
+/*
+ * exec_cmd_string
+ *
+ * Runs one command line given on the command line, script style, and
+ * returns its exit status
+ */
+int exec_cmd_string(const char *cmd_line) {
+    command_list_t clist;
+    
+    init_cmd_list(&clist);
+    jobs_notify = 0;
+    run_script_line(cmd_line, strlen(cmd_line), &clist);
+    release_cmd_list(&clist);
+    release_jobs();
+    zygote_stop();
+    fflush(stdout);
+    return last_status;
+}
@@ -1,12 +1,13 @@
 #ifndef __DSHLIB_H__
     #define __DSHLIB_H__
+#include <sys/types.h>
 //Constants for command structure sizes
 #define EXE_MAX 64
 #define ARG_MAX 256
-#define CMD_MAX 8
-#define CMD_ARGV_MAX (CMD_MAX + 1)
-// Longest command that can be read from the shell
-#define SH_CMD_MAX EXE_MAX + ARG_MAX
+// Commands and arguments that fit inline; longer pipelines and argument
+// lists spill into the command list's arena, so neither has a limit
+#define CMD_INLINE 8
+#define CMD_ARGV_INLINE (CMD_INLINE + 1)
 
 // Redirection types for extra credit
 typedef enum {
@@ -25,7 +26,9 @@ typedef struct command
 typedef struct cmd_buff
 {
     int  argc;
-    char *argv[CMD_ARGV_MAX];
+    int  argv_cap;                  // slots in argv, counting the final NULL
+    char **argv;                    // argv_inline until it spills
+    char *argv_inline[CMD_ARGV_INLINE];
     char *_cmd_buffer;
     
     // Extra credit - redirection
@@ -44,9 +47,32 @@ typedef struct command{
     char *argv[N_ARG_MAX + 1];  //last argv[LAST] must be \0
 }command_t;
 */
+/*
+ * Bump allocator for everything parsed out of one command line.  Blocks
+ * are kept across lines, so once the first few lines have sized it,
+ * parsing allocates nothing and a reset is two stores.
+ */
+#define CMD_ARENA_BLOCK 4096
+
+typedef struct cmd_arena_block {
+    struct cmd_arena_block *next;
+    size_t cap;
+    char data[];
+} cmd_arena_block_t;
+
+typedef struct cmd_arena {
+    cmd_arena_block_t *head;
+    cmd_arena_block_t *cur;
+    size_t used;            // bytes taken from cur
+} cmd_arena_t;
+
 typedef struct command_list{
     int num;
-    cmd_buff_t commands[CMD_MAX];
+    int cap;
+    int background;         // the line ended in &
+    cmd_buff_t *commands;   // commands_inline until it spills
+    cmd_buff_t commands_inline[CMD_INLINE];
+    cmd_arena_t arena;      // owns the line copy and anything that spilled
 }command_list_t;
 //Special character #defines
 #define SPACE_CHAR  ' '
@@ -54,13 +80,14 @@ typedef struct command_list{
 #define PIPE_STRING "|"
 #define REDIR_IN_CHAR '<'
 #define REDIR_OUT_CHAR '>'
+#define BG_CHAR '&'
 #define SH_PROMPT "dsh3> "
+#define SCRIPT_BUFF_SZ (64 * 1024)     //stdio buffer for scripts read from a pipe
 #define EXIT_CMD "exit"
 #define EXIT_SC     99
 //Standard Return Codes
 #define OK                       0
 #define WARN_NO_CMDS            -1
-#define ERR_TOO_MANY_COMMANDS   -2
 #define ERR_CMD_OR_ARGS_TOO_BIG -3
 #define ERR_CMD_ARGS_BAD        -4      //for extra credit
 #define ERR_MEMORY              -5
@@ -73,12 +100,25 @@ int clear_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff);
 int close_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_list(char *cmd_line, command_list_t *clist);
+int build_cmd_list_len(const char *cmd_line, size_t line_len, command_list_t *clist);
 int free_cmd_list(command_list_t *cmd_lst);
+int init_cmd_list(command_list_t *clist);
+void release_cmd_list(command_list_t *clist);
+void *cmd_arena_alloc(cmd_arena_t *arena, size_t n);
+void cmd_arena_reset(cmd_arena_t *arena);
+void cmd_arena_release(cmd_arena_t *arena);
 //built in command stuff
 typedef enum {
     BI_CMD_EXIT,
     BI_CMD_DRAGON,
     BI_CMD_CD,
+    BI_CMD_HASH,
+    BI_CMD_JOBS,
+    BI_CMD_WAIT,
+    BI_CMD_FG,
+    BI_CMD_PARALLEL,
+    BI_CMD_SET,
+    BI_CMD_UTIL,            // echo, printf, pwd, test, [, true, false
     BI_NOT_BI,
     BI_EXECUTED,
 } Built_In_Cmds;
@@ -86,11 +126,30 @@ Built_In_Cmds match_command(const char *input);
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 //main execution context
 int exec_local_cmd_loop();
+int exec_script(const char *path);
+int exec_cmd_string(const char *cmd_line);
 int exec_cmd(cmd_buff_t *cmd);
+int spawn_cmd(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd, pid_t *pid);
+int lookup_cmd(const char *name, char *path, size_t cap);
+void forget_cmd(const char *name);
+int exec_hash_cmd(cmd_buff_t *cmd);
+int exec_job_cmd(Built_In_Cmds which, cmd_buff_t *cmd);
+void report_jobs(void);
+void release_jobs(void);
+int exec_parallel_cmd(cmd_buff_t *cmd);
+int exec_set_cmd(cmd_buff_t *cmd);
+int exec_util_cmd(cmd_buff_t *cmd);
+int is_util(const char *name);
+int run_util(cmd_buff_t *cmd, int out_fd, int err_fd);
+int zygote_start(void);
+void zygote_stop(void);
+int zygote_running(void);
+int zygote_spawn(const char *path, char **argv, int in_fd, int out_fd, int err_fd, pid_t *pid);
 int execute_pipeline(command_list_t *clist);
 //output constants
 #define CMD_OK_HEADER       "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
-#define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
 #define CMD_ERR_REDIR       "error: redirection syntax error\n"
+#define CMD_ERR_QUOTE       "error: unterminated quote\n"
+#define CMD_ERR_BG          "error: & must end the command line\n"
 #endif
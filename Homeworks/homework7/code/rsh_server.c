@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -62,9 +63,10 @@ int start_server(char *ifaces, int port, int is_threaded) {
 
 /*
  * stop_server(svr_socket)
- * Close server socket
+ * Close server socket, and shut down the spawn helper if -z started one
  */
 int stop_server(int svr_socket) {
+    zygote_stop();
     return close(svr_socket);
 }
 
@@ -268,6 +270,8 @@ int exec_client_requests(int cli_socket) {
     int cmd_rc;
     char *io_buff;
     
+    init_cmd_list(&cmd_list);
+    
     // Allocate buffer for network I/O
     io_buff = malloc(RDSH_COMM_BUFF_SZ);
     if (io_buff == NULL) {
@@ -280,6 +284,7 @@ int exec_client_requests(int cli_socket) {
         
         if (io_size <= 0) {
             // Client closed connection or error
+            release_cmd_list(&cmd_list);
             free(io_buff);
             return OK;
         }
@@ -293,6 +298,7 @@ int exec_client_requests(int cli_socket) {
         // Check for exit command
         if (strcmp(io_buff, EXIT_CMD) == 0) {
             printf(RCMD_MSG_CLIENT_EXITED);
+            release_cmd_list(&cmd_list);
             free(io_buff);
             return OK;
         }
@@ -301,6 +307,7 @@ int exec_client_requests(int cli_socket) {
         if (strcmp(io_buff, "stop-server") == 0) {
             send_message_string(cli_socket, "Stopping server...\n");
             send_message_eof(cli_socket);
+            release_cmd_list(&cmd_list);
             free(io_buff);
             return OK_EXIT;
         }
@@ -319,8 +326,6 @@ int exec_client_requests(int cli_socket) {
             char error_msg[256];
             if (rc == WARN_NO_CMDS) {
                 snprintf(error_msg, sizeof(error_msg), "%s", CMD_WARN_NO_CMD);
-            } else if (rc == ERR_TOO_MANY_COMMANDS) {
-                snprintf(error_msg, sizeof(error_msg), CMD_ERR_PIPE_LIMIT, CMD_MAX);
             } else if (rc == ERR_CMD_ARGS_BAD) {
                 snprintf(error_msg, sizeof(error_msg), "%s", CMD_ERR_REDIR);
             } else {
@@ -386,6 +391,7 @@ int exec_client_requests(int cli_socket) {
                 send_message_string(cli_socket, "Stopping server...\n");
                 send_message_eof(cli_socket);
                 free_cmd_list(&cmd_list);
+                release_cmd_list(&cmd_list);
                 free(io_buff);
                 return OK_EXIT;
             }
@@ -403,11 +409,13 @@ int exec_client_requests(int cli_socket) {
         // Send EOF to mark end of command output
         rc = send_message_eof(cli_socket);
         if (rc != OK) {
+            release_cmd_list(&cmd_list);
             free(io_buff);
             return ERR_RDSH_COMMUNICATION;
         }
     }
 
+    release_cmd_list(&cmd_list);
     free(io_buff);
     return OK;
 }
@@ -468,106 +476,29 @@ int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
         }
     }
 
-    // Create pipes for command pipeline
+    // Create pipes for command pipeline, close-on-exec so each child only
+    // keeps the ends spawn_cmd hands it
     for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
             perror("pipe");
             send_message_string(cli_sock, "Error creating pipe\n");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
             return ERR_RDSH_CMD_EXEC;
         }
     }
 
-    // Fork and execute each command in the pipeline
+    // Spawn each command: the first reads from the client, the last writes
+    // to it, and stderr always goes to the client.  < and > files override.
     for (int i = 0; i < clist->num; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            // Fork failed
-            perror("fork");
-            send_message_string(cli_sock, "Error creating process\n");
-            return ERR_RDSH_CMD_EXEC;
-        } else if (pids[i] == 0) {
-            // Child process
-            
-            // Handle input redirection for first command
-            if (i == 0 && clist->commands[i].in_redir_type == REDIR_IN) {
-                int fd = open(clist->commands[i].in_redir_file, O_RDONLY);
-                if (fd < 0) {
-                    char error_msg[256];
-                    snprintf(error_msg, sizeof(error_msg), 
-                             "Cannot open input file: %s\n", clist->commands[i].in_redir_file);
-                    write(cli_sock, error_msg, strlen(error_msg));
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            } 
-            // If no input redirection for first command, use client socket for stdin
-            else if (i == 0) {
-                dup2(cli_sock, STDIN_FILENO);
-            } 
-            // Not first process: redirect stdin from previous pipe
-            else {
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            }
-            
-            // Handle output redirection for last command
-            if (i == clist->num - 1 && clist->commands[i].out_redir_type != REDIR_NONE) {
-                int flags = O_WRONLY | O_CREAT;
-                if (clist->commands[i].out_redir_type == REDIR_APPEND) {
-                    flags |= O_APPEND;
-                } else {
-                    flags |= O_TRUNC;
-                }
-                
-                int fd = open(clist->commands[i].out_redir_file, flags, 0644);
-                if (fd < 0) {
-                    char error_msg[256];
-                    snprintf(error_msg, sizeof(error_msg), 
-                             "Cannot open output file: %s\n", clist->commands[i].out_redir_file);
-                    write(cli_sock, error_msg, strlen(error_msg));
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-                
-                // Always redirect stderr to client
-                dup2(cli_sock, STDERR_FILENO);
-            } 
-            // If no output redirection for last command, use client socket
-            else if (i == clist->num - 1) {
-                dup2(cli_sock, STDOUT_FILENO);
-                dup2(cli_sock, STDERR_FILENO);
-            } 
-            // Not last process: redirect stdout to next pipe
-            else {
-                dup2(pipes[i][1], STDOUT_FILENO);
-                // For stderr, always redirect to client socket
-                dup2(cli_sock, STDERR_FILENO);
-            }
-            
-            // Close all pipe file descriptors
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            // Execute command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, there was an error
-            char error_msg[256];
-            
-            
-            if (errno == ENOENT) {
-                snprintf(error_msg, sizeof(error_msg), "%s: command not found\n", clist->commands[i].argv[0]);
-            } else {
-                snprintf(error_msg, sizeof(error_msg), "%s: %s\n", clist->commands[i].argv[0], strerror(errno));
-            }
-
+        int in_fd = (i == 0) ? cli_sock : pipes[i-1][0];
+        int out_fd = (i == clist->num - 1) ? cli_sock : pipes[i][1];
 
-            write(cli_sock, error_msg, strlen(error_msg));
-            exit(EXIT_FAILURE);
+        if (spawn_cmd(&clist->commands[i], in_fd, out_fd, cli_sock, &pids[i]) != OK) {
+            pids[i] = -1;
+            pids_st[i] = EXIT_FAILURE << 8;     // as if the child had exited 1
         }
     }
 
@@ -579,7 +510,9 @@ int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
 
     // Wait for all children to complete
     for (int i = 0; i < clist->num; i++) {
-        waitpid(pids[i], &pids_st[i], 0);
+        if (pids[i] > 0) {
+            waitpid(pids[i], &pids_st[i], 0);
+        }
     }
 
     // Get exit code from last process in pipeline